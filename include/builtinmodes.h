@@ -141,6 +141,8 @@ class ModeUserInvisible : public SimpleUserModeHandler
 	ModeUserInvisible() : SimpleUserModeHandler(NULL, "invisible", 'i')
 	{
 	}
+
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string& parameter, bool adding) CXX11_OVERRIDE;
 };
 
 /** User mode +s
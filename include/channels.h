@@ -26,6 +26,8 @@
 #include "mode.h"
 #include "parammode.h"
 
+class NamesCache;
+
 /** Holds an entry for a ban list, exemption list, or invite list.
  * This class contains a single element in a channel list, such as a banlist.
  */
@@ -55,6 +57,22 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** Rendered NAMES entries of the members, NULL until NAMES is sent for a large enough channel
+	 */
+	NamesCache* namescache;
+
+	/** Incremented when the NAMES entries of all channels must be rendered again
+	 */
+	static unsigned int namesgeneration;
+
+	/** Build the NAMES entry of a member, as it is shown to a user
+	 * @param user The user the NAMES list is for
+	 * @param memb The member to build the entry for
+	 * @param showinvisible True if members with +i are shown
+	 * @param item Set to the entry, empty if the member is not shown
+	 */
+	void GetNamesItem(User* user, Membership* memb, bool showinvisible, std::string& item);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -63,6 +81,8 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	Channel(const std::string &name, time_t ts);
 
+	~Channel();
+
 	/** Checks whether the channel should be destroyed, and if yes, begins
 	 * the teardown procedure.
 	 *
@@ -293,6 +313,16 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void UserList(User* user, bool isinside = true);
 
+	/** Render the NAMES entry of a member again when NAMES is next sent, or those of all members.
+	 * Joins, parts and changes of nick, host, ident, prefix modes and +i are tracked by the core.
+	 * @param memb The member whose entry changed, NULL for all members
+	 */
+	void InvalidateNames(Membership* memb = NULL);
+
+	/** Render the NAMES entries of all channels again, e.g. because a module changing them was loaded
+	 */
+	static void InvalidateAllNames() { namesgeneration++; }
+
 	/** Get the value of a users prefix on this channel.
 	 * @param user The user to look up
 	 * @return The module or core-defined value of the users prefix.
@@ -30,6 +30,38 @@
 class CoreExport CommandParser
 {
  private:
+	/** Modules attached to OnPreCommand, in calling order, with the module called first at the end
+	 */
+	typedef std::vector<Module*> PreCommandHandlers;
+
+	/** Maps module to the names of the commands it wants to receive OnPreCommand for
+	 */
+	typedef std::map<Module*, std::set<std::string> > PreCommandSubscriptions;
+
+	/** Commands which modules have restricted their OnPreCommand hook to
+	 */
+	PreCommandSubscriptions precmdsubs;
+
+	/** OnPreCommand handlers of commands at least one module subscribed to
+	 */
+	TR1NS::unordered_map<std::string, PreCommandHandlers> precmdtable;
+
+	/** OnPreCommand handlers of all other commands: modules without subscriptions
+	 */
+	PreCommandHandlers precmdglobal;
+
+	/** True if subscriptions or the OnPreCommand handler list have changed since the tables were last built
+	 */
+	bool precmddirty;
+
+	/** Number of OnPreCommand calls in progress, the tables are not rebuilt while this is non-zero
+	 */
+	unsigned int precmddepth;
+
+	/** Rebuild precmdtable and precmdglobal from the current OnPreCommand handler list
+	 */
+	void RebuildPreCommandTable();
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for
 	 * @param cmd The command string to process
@@ -120,6 +152,35 @@ class CoreExport CommandParser
 	 */
 	void RemoveCommand(Command* x);
 
+	/** Restrict the OnPreCommand hook of a module to a set of commands.
+	 * Once a module has subscribed to at least one command its OnPreCommand handler is only
+	 * called for the commands it has subscribed to, instead of for every command (including
+	 * unknown ones). The module must still be attached to I_OnPreCommand.
+	 * Subscriptions are removed automatically when the module is unloaded.
+	 * @param mod The module to subscribe
+	 * @param command The name of the command, in uppercase; it does not need to exist
+	 */
+	void SubscribePreCommand(Module* mod, const std::string& command);
+
+	/** Remove all OnPreCommand subscriptions of a module, after which it receives all commands again.
+	 * @param mod The module to unsubscribe
+	 */
+	void UnsubscribePreCommand(Module* mod);
+
+	/** Called by the ModuleManager when the OnPreCommand handler list changes
+	 */
+	void InvalidatePreCommandTable() { precmddirty = true; }
+
+	/** Run the OnPreCommand hook, only calling the modules interested in the command
+	 * @param command The command being executed, modules may change it
+	 * @param parameters The parameters of the command
+	 * @param user The user executing the command
+	 * @param validated True if the command has been validated
+	 * @param original_line The original line as received from the user
+	 * @return The first result other than MOD_RES_PASSTHRU, or MOD_RES_PASSTHRU
+	 */
+	ModResult CallPreCommand(std::string& command, std::vector<std::string>& parameters, LocalUser* user, bool validated, const std::string& original_line);
+
 	/** Translate a single item based on the TranslationType given.
 	 * @param to The translation type to use for the process
 	 * @param item The input string
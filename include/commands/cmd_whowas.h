@@ -23,20 +23,119 @@
 
 #include "modules.h"
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
+namespace WhoWas
+{
+	class Entry;
+	class Nick;
+	class StringPool;
+
+	/** Tag for the list of records belonging to a single nickname */
+	struct NickListTag { };
+
+	/** Tag for the list of all records, oldest first */
+	struct AgeListTag { };
+}
+
+/** Nicknames tracked by WHOWAS
+ */
+typedef TR1NS::unordered_map<std::string, WhoWas::Nick*, irc::insensitive, irc::StrHashComp> whowas_users;
 
-/** A group of users related by nickname
+/** Deduplicates the strings which are the same across many records, such as server names
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+class WhoWas::StringPool
+{
+	typedef TR1NS::unordered_map<std::string, unsigned int> PoolMap;
+
+	/** Interned strings, mapped to the number of records using them
+	 */
+	PoolMap strings;
+
+ public:
+	/** Get the shared copy of a string, creating it if needed.
+	 * Every call must be paired with a call to Release().
+	 * @param str The string to intern
+	 * @return A pointer to the shared copy which remains valid until released
+	 */
+	const std::string* Intern(const std::string& str);
+
+	/** Drop a reference obtained from Intern()
+	 * @param str The shared string to release
+	 */
+	void Release(const std::string* str);
+
+	/** Get the number of distinct strings in the pool */
+	size_t size() const { return strings.size(); }
+
+	/** Get the number of bytes used by the text of the strings in the pool */
+	size_t GetBytes() const;
+};
 
-/** Sets of users in the whowas system
+/** Used to hold WHOWAS information. The gecos is stored directly after
+ * the record in the same allocation, the other strings are interned.
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+class WhoWas::Entry : public intrusive_list_node<Entry, NickListTag>, public intrusive_list_node<Entry, AgeListTag>
+{
+	Entry(Nick* n, StringPool& pool, const std::string& Host, const std::string& DHost, const std::string& Ident,
+		const std::string& Server, time_t Signon, time_t Added);
+
+ public:
+	/** Nickname this record belongs to
+	 */
+	Nick* const nick;
+	/** Real host
+	 */
+	const std::string* const host;
+	/** Displayed host
+	 */
+	const std::string* const dhost;
+	/** Ident
+	 */
+	const std::string* const ident;
+	/** Server name
+	 */
+	const std::string* const server;
+	/** Signon time
+	 */
+	const time_t signon;
+	/** Time the record was added, used for expiry
+	 */
+	const time_t added;
+
+	/** Get the fullname (GECOS) */
+	const char* GetGecos() const { return reinterpret_cast<const char*>(this + 1); }
+
+	/** Allocate a new record
+	 * @param n Nickname the record belongs to
+	 * @param pool String pool to intern the host, ident and server name in
+	 * @param gecos Fullname (GECOS)
+	 * @return A new record, which must be freed using Destroy()
+	 */
+	static Entry* Create(Nick* n, StringPool& pool, const std::string& host, const std::string& dhost, const std::string& ident,
+		const std::string& server, const std::string& gecos, time_t signon, time_t added);
+
+	/** Free this record and release its interned strings
+	 * @param pool String pool the record was created with
+	 */
+	void Destroy(StringPool& pool);
+};
 
-/** Sets of time and users in whowas list
+/** A group of records related by nickname
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+class WhoWas::Nick : public intrusive_list_node<Nick>
+{
+ public:
+	typedef intrusive_list_tail<Entry, NickListTag> List;
+
+	/** Records for this nickname, oldest first
+	 */
+	List entries;
+
+	/** The nickname
+	 */
+	const std::string nick;
+
+	Nick(const std::string& Nickname) : nick(Nickname) { }
+};
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -50,9 +149,41 @@ class CommandWhowas : public Command
 	 */
 	whowas_users whowas;
 
-	/** List of nicknames in the order they were inserted into the map
+	/** Nicknames in the order they were last added to, used to evict when there are too many
+	 */
+	intrusive_list_tail<WhoWas::Nick> nicks;
+
+	/** All records in the order they were added, used to expire old records
+	 */
+	intrusive_list_tail<WhoWas::Entry, WhoWas::AgeListTag> entries;
+
+	/** Shared strings referenced by the records
+	 */
+	WhoWas::StringPool pool;
+
+	/** True if records were added or removed since the database was last read or written
+	 */
+	bool dirty;
+
+	/** Add a record, evicting old ones as needed
+	 */
+	void Add(const std::string& nickname, const std::string& host, const std::string& dhost, const std::string& ident,
+		const std::string& server, const std::string& gecos, time_t signon, time_t added);
+
+	/** Remove a record, and its nickname if it was the last record for it
 	 */
-	whowas_users_fifo whowas_fifo;
+	void RemoveEntry(WhoWas::Entry* entry);
+
+	/** Remove a nickname and all records for it
+	 */
+	void RemoveNick(WhoWas::Nick* nick);
+
+	/** Parse a database image created by Save()
+	 * @param data Contents of the database
+	 * @param len Length of the database
+	 * @return Number of records loaded
+	 */
+	size_t LoadData(const char* data, size_t len);
 
   public:
 	/** Max number of WhoWas entries per user.
@@ -68,6 +199,14 @@ class CommandWhowas : public Command
 	 */
 	unsigned int MaxKeep;
 
+	/** Path of the file the records are saved to, empty if they are not saved
+	 */
+	std::string Database;
+
+	/** Make the next Save() write the database even if no records changed, e.g. after its path changed
+	 */
+	void Invalidate() { dirty = true; }
+
 	CommandWhowas(Module* parent);
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
@@ -80,34 +219,15 @@ class CommandWhowas : public Command
 	std::string GetStats();
 	void Prune();
 	void Maintain();
-	~CommandWhowas();
-};
 
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
+	/** Write all records to the database file if they changed since it was last read or written
+	 * @return True if the file was written or is up to date, false on error
 	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
+	bool Save();
 
-	/** Initialize this WhoWasFroup with a user
+	/** Read records from the database file, the file being absent is not an error
+	 * @return True if the file was read or does not exist, false on error
 	 */
-	WhoWasGroup(User* user);
+	bool Load();
+	~CommandWhowas();
 };
@@ -28,9 +28,11 @@
 #if defined _LIBCPP_VERSION || defined _WIN32
 # define TR1NS std
 # include <unordered_map>
+# include <unordered_set>
 #else
 # define TR1NS std::tr1
 # include <tr1/unordered_map>
+# include <tr1/unordered_set>
 #endif
 
 /**
@@ -350,6 +350,11 @@ class CoreExport ServerConfig
 	 */
 	int MaxConn;
 
+	/** The most connections a listener accepts each time it becomes readable
+	 * before other events get a turn.
+	 */
+	unsigned int AcceptBatch;
+
 	/** If we should check for clones during CheckClass() in AddUser()
 	 * Setting this to false allows to not trigger on maxclones for users
 	 * that may belong to another class after DNS-lookup is complete.
@@ -357,6 +362,15 @@ class CoreExport ServerConfig
 	 */
 	bool CCOnConnect;
 
+	/** If true, the time spent in each module hook is measured and shown in /STATS h.
+	 * Invocation counts are always kept.
+	 */
+	bool TimeHooks;
+
+	/** Milliseconds the main loop may spend deleting culled objects per iteration, 0 for no limit
+	 */
+	unsigned int CullBudget;
+
 	/** The soft limit value assigned to the irc server.
 	 * The IRC server will not allow more than this
 	 * number of local users.
@@ -32,6 +32,25 @@ class CoreExport CullList
 	std::vector<classbase*> list;
 	std::vector<LocalUser*> SQlist;
 
+	/** Objects which have been culled but not deleted yet, oldest first
+	 */
+	std::deque<classbase*> culled;
+
+	/** Call cull() on every queued object once and move them to the culled list
+	 */
+	void CullQueued();
+
+	/** Call cull() on a batch of queued objects, skipping objects queued twice
+	 * @param queue Objects to cull, in the order they were queued
+	 * @param done Sorted list of objects culled before this batch, the objects of the batch are added to it
+	 */
+	void CullObjects(const std::vector<classbase*>& queue, std::vector<classbase*>& done);
+
+	/** Delete culled objects, oldest first
+	 * @param maxusecs Stop once this many microseconds have been spent, 0 to delete all of them
+	 */
+	void DeleteCulled(unsigned long maxusecs);
+
  public:
 	/** Adds an item to the cull list
 	 */
@@ -39,8 +58,16 @@ class CoreExport CullList
 	void AddSQItem(LocalUser* item) { SQlist.push_back(item); }
 
 	/** Applies the cull list (deletes the contents)
+	 * @param maxms If not 0, every queued object is culled but objects are only deleted
+	 * for up to this many milliseconds, the rest are deleted by later calls. Used by the
+	 * main loop so a mass quit doesn't stall the server while the users are destroyed.
+	 */
+	void Apply(unsigned int maxms = 0);
+
+	/** Check whether Apply() left objects to delete
+	 * @return True if there are objects waiting to be deleted
 	 */
-	void Apply();
+	bool HasPending() const { return !culled.empty(); }
 };
 
 class CoreExport ActionList
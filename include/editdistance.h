@@ -0,0 +1,178 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Counts of the characters of a line folded into a few buckets. Comparing two of these
+ * gives a lower bound on the edit distance of the lines without looking at the lines.
+ */
+class CharHistogram
+{
+	static const unsigned int Buckets = 32;
+	uint16_t counts[Buckets];
+
+ public:
+	CharHistogram(const std::string& line)
+	{
+		std::fill(counts, counts + Buckets, 0);
+		for (std::string::const_iterator i = line.begin(); i != line.end(); ++i)
+			counts[static_cast<unsigned char>(*i) % Buckets]++;
+	}
+
+	/** Get a lower bound on the edit distance between the lines of two histograms.
+	 * Every edit changes at most one count up and one down, so the distance is at
+	 * least the total surplus of either line.
+	 */
+	unsigned int MinDistance(const CharHistogram& other) const
+	{
+		unsigned int surplus = 0;
+		unsigned int deficit = 0;
+		for (unsigned int i = 0; i < Buckets; ++i)
+		{
+			if (counts[i] > other.counts[i])
+				surplus += counts[i] - other.counts[i];
+			else
+				deficit += other.counts[i] - counts[i];
+		}
+		return std::max(surplus, deficit);
+	}
+};
+
+/** Computes the Levenshtein distance of lines to a pattern with Myers' bit-parallel
+ * algorithm. Each column of the edit matrix is kept as bit vectors of vertical deltas,
+ * so 64 rows are advanced per word operation instead of one cell at a time.
+ */
+class EditDistance
+{
+	typedef uint64_t Word;
+	static const unsigned int WordBits = 64;
+
+	/** For every character, a bitmask of the positions it occurs at in the pattern
+	 */
+	std::vector<Word> peq;
+
+	/** Positive and negative vertical deltas of the current column
+	 */
+	std::vector<Word> pv;
+	std::vector<Word> mv;
+
+	/** Words allocated for each character in peq
+	 */
+	size_t maxblocks;
+
+	std::string pattern;
+
+	/** Advance one block of the column by a character of the text
+	 * @param block Index of the block
+	 * @param eq Match mask of the character for this block
+	 * @param hin Horizontal delta entering the block from above
+	 * @param high Bit of the last row of the block
+	 * @return Horizontal delta leaving the block at the last row
+	 */
+	int AdvanceBlock(size_t block, Word eq, int hin, Word high)
+	{
+		Word& Pv = pv[block];
+		Word& Mv = mv[block];
+
+		const Word xv = eq | Mv;
+		if (hin < 0)
+			eq |= 1;
+		const Word xh = (((eq & Pv) + Pv) ^ Pv) | eq;
+		Word ph = Mv | ~(xh | Pv);
+		Word mh = Pv & xh;
+
+		int hout = 0;
+		if (ph & high)
+			hout = 1;
+		else if (mh & high)
+			hout = -1;
+
+		ph <<= 1;
+		mh <<= 1;
+		if (hin < 0)
+			mh |= 1;
+		else if (hin > 0)
+			ph |= 1;
+
+		Pv = mh | ~(xv | ph);
+		Mv = ph & xv;
+		return hout;
+	}
+
+ public:
+	EditDistance() : maxblocks(0) { }
+
+	/** Allocate space for patterns up to the given length
+	 */
+	void Resize(size_t maxlen)
+	{
+		pattern.clear();
+		maxblocks = (maxlen + WordBits - 1) / WordBits;
+		peq.assign(256 * maxblocks, 0);
+		pv.resize(maxblocks);
+		mv.resize(maxblocks);
+	}
+
+	/** Set the line other lines are compared to, it must not be longer than the size given to Resize()
+	 */
+	void SetPattern(const std::string& newpattern)
+	{
+		// Only the entries of characters in the old pattern are set
+		for (std::string::const_iterator i = pattern.begin(); i != pattern.end(); ++i)
+			std::fill_n(peq.begin() + static_cast<unsigned char>(*i) * maxblocks, maxblocks, 0);
+
+		pattern = newpattern;
+		for (size_t i = 0; i < pattern.length(); ++i)
+			peq[static_cast<unsigned char>(pattern[i]) * maxblocks + i / WordBits] |= Word(1) << (i % WordBits);
+	}
+
+	/** Get the edit distance of a line to the pattern, giving up early once it is known to exceed limit
+	 * @param text Line to compare to the pattern
+	 * @param limit The largest distance the caller is interested in
+	 * @return The distance, or a value above limit if the distance is larger than limit
+	 */
+	unsigned int Get(const std::string& text, unsigned int limit)
+	{
+		const size_t m = pattern.length();
+		const size_t n = text.length();
+		if (m == 0)
+			return n;
+
+		const size_t blocks = (m + WordBits - 1) / WordBits;
+		const Word lasthigh = Word(1) << ((m - 1) % WordBits);
+		const Word high = Word(1) << (WordBits - 1);
+		std::fill_n(pv.begin(), blocks, ~Word(0));
+		std::fill_n(mv.begin(), blocks, 0);
+
+		size_t score = m;
+		for (size_t j = 0; j < n; ++j)
+		{
+			const Word* eq = &peq[static_cast<unsigned char>(text[j]) * maxblocks];
+
+			// The top row of the matrix is 0, 1, 2, ... so every column enters with +1
+			int hin = 1;
+			for (size_t b = 0; b + 1 < blocks; ++b)
+				hin = AdvanceBlock(b, eq[b], hin, high);
+			score += AdvanceBlock(blocks - 1, eq[blocks - 1], hin, lasthigh);
+
+			// Each remaining column can lower the score by at most one
+			if (score > limit + (n - j - 1))
+				return limit + 1;
+		}
+		return score;
+	}
+};
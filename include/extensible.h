@@ -37,6 +37,12 @@ enum SerializeFormat
  */
 class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 {
+	/** Index of this item in the extension storage of every Extensible
+	 */
+	const unsigned int slot;
+
+	friend class Extensible;
+
  public:
 	ExtensionItem(const std::string& key, Module* owner);
 	virtual ~ExtensionItem();
@@ -57,11 +63,11 @@ class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 	virtual void free(void* item) = 0;
 
  protected:
-	/** Get the item from the internal map */
-	void* get_raw(const Extensible* container) const;
-	/** Set the item in the internal map; returns old value */
+	/** Get the item from the internal store */
+	inline void* get_raw(const Extensible* container) const;
+	/** Set the item in the internal store; returns old value */
 	void* set_raw(Extensible* container, void* value);
-	/** Remove the item from the internal map; returns old value */
+	/** Remove the item from the internal store; returns old value */
 	void* unset_raw(Extensible* container);
 };
 
@@ -75,7 +81,59 @@ class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 class CoreExport Extensible : public classbase
 {
  public:
-	typedef std::map<reference<ExtensionItem>,void*> ExtensibleStore;
+	/** Extension items set on an object, indexed by the slot of each item so they
+	 * can be found without a search. Iterating skips the slots which aren't set.
+	 */
+	class ExtensibleStore
+	{
+	 public:
+		typedef std::pair<reference<ExtensionItem>, void*> value_type;
+		typedef std::vector<value_type> SlotList;
+
+		class const_iterator
+		{
+			SlotList::const_iterator it;
+			SlotList::const_iterator last;
+
+			void SkipUnset()
+			{
+				while ((it != last) && (!it->first))
+					++it;
+			}
+
+		 public:
+			const_iterator(SlotList::const_iterator pos, SlotList::const_iterator end)
+				: it(pos), last(end)
+			{
+				SkipUnset();
+			}
+
+			const value_type& operator*() const { return *it; }
+			const value_type* operator->() const { return &*it; }
+			const_iterator& operator++() { ++it; SkipUnset(); return *this; }
+			const_iterator operator++(int) { const_iterator ret(*this); ++*this; return ret; }
+			bool operator==(const const_iterator& other) const { return (it == other.it); }
+			bool operator!=(const const_iterator& other) const { return (it != other.it); }
+		};
+
+		ExtensibleStore() : count(0) { }
+		const_iterator begin() const { return const_iterator(slots.begin(), slots.end()); }
+		const_iterator end() const { return const_iterator(slots.end(), slots.end()); }
+		bool empty() const { return (count == 0); }
+		size_t size() const { return count; }
+
+	 private:
+		/** Grows on demand up to the highest slot set on this object
+		 */
+		SlotList slots;
+
+		/** Number of slots which are set
+		 */
+		size_t count;
+
+		friend class Extensible;
+		friend class ExtensionItem;
+	};
 
 	// Friend access for the protected getter/setter
 	friend class ExtensionItem;
@@ -113,8 +171,26 @@ class CoreExport ExtensionManager
 	bool Register(ExtensionItem* item);
 	void BeginUnregister(Module* module, std::vector<reference<ExtensionItem> >& list);
 	ExtensionItem* GetItem(const std::string& name);
+
+	/** Reserve a slot in the extension storage of every Extensible for a new item.
+	 * Slots are handed out lowest first and reused once their item is destroyed, so
+	 * they stay dense. This is static as core items are created before ServerInstance.
+	 * @return The slot for the item
+	 */
+	static unsigned int AllocateSlot();
+
+	/** Free the slot of a destroyed item
+	 * @param slot The slot to free
+	 */
+	static void ReleaseSlot(unsigned int slot);
 };
 
+inline void* ExtensionItem::get_raw(const Extensible* container) const
+{
+	const Extensible::ExtensibleStore::SlotList& slots = container->extensions.slots;
+	return ((slot < slots.size()) ? slots[slot].second : NULL);
+}
+
 /** Base class for items that are NOT synchronized between servers */
 class CoreExport LocalExtItem : public ExtensionItem
 {
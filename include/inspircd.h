@@ -673,6 +673,19 @@ class CommandModule : public Module
 	}
 };
 
+inline HookTimer::HookTimer(Module* mod, Implementation i)
+	: stats(mod->hookstats[i])
+	, start(ServerInstance->Config->TimeHooks ? Now() : 0)
+{
+	stats.calls++;
+}
+
+inline HookTimer::~HookTimer()
+{
+	if (start)
+		stats.usecs += Now() - start;
+}
+
 inline void stdalgo::culldeleter::operator()(classbase* item)
 {
 	if (item)
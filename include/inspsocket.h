@@ -106,17 +106,29 @@ class CoreExport StreamSocket : public EventHandler
 	/** The IOHook that handles raw I/O for this socket, or NULL */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Note that individual items may be shared with other sockets
 	 */
-	std::deque<std::string> sendq;
+	SendQueue sendq;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
+	/** Number of bytes at the start of the first sendq item which were already sent */
+	size_t sendq_offset;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+
+	/** Remove data which was sent from the sendq
+	 * @param len Number of bytes which were sent
+	 */
+	void ConsumeSendQ(size_t len);
+
+	/** Pass the first sendq item to an IOHook which does not implement OnStreamSocketWriteV()
+	 * @return Return value of IOHook::OnStreamSocketWrite()
+	 */
+	int HookWriteFront();
  protected:
 	std::string recvq;
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), sendq_len(0), sendq_offset(0) {}
 	IOHook* GetIOHook() const;
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
@@ -143,6 +155,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Send data which may also be queued on other sockets, either now or when writes unblock.
+	 * The data is not copied, the send queue keeps a reference to it.
+	 */
+	void WriteData(const reference<SharedBuffer>& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
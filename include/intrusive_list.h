@@ -24,6 +24,7 @@
 struct intrusive_list_def_tag { };
 
 template <typename T, typename Tag = intrusive_list_def_tag> class intrusive_list;
+template <typename T, typename Tag = intrusive_list_def_tag> class intrusive_list_tail;
 
 template <typename T, typename Tag = intrusive_list_def_tag>
 class intrusive_list_node
@@ -48,6 +49,7 @@ class intrusive_list_node
 	}
 
 	friend class intrusive_list<T, Tag>;
+	friend class intrusive_list_tail<T, Tag>;
 };
 
 template <typename T, typename Tag>
@@ -160,3 +162,87 @@ class intrusive_list
 	T* listhead;
 	size_t listsize;
 };
+
+/** Intrusive list which also tracks its last element, allowing it to be used as a FIFO
+ */
+template <typename T, typename Tag>
+class intrusive_list_tail
+{
+ public:
+	typedef typename intrusive_list<T, Tag>::iterator iterator;
+	typedef iterator const_iterator;
+
+	intrusive_list_tail()
+		: listhead(NULL)
+		, listtail(NULL)
+		, listsize(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return (size() == 0);
+	}
+
+	size_t size() const
+	{
+		return listsize;
+	}
+
+	iterator begin() const
+	{
+		return iterator(listhead);
+	}
+
+	iterator end() const
+	{
+		return iterator();
+	}
+
+	void pop_front()
+	{
+		erase(listhead);
+	}
+
+	T* front() const
+	{
+		return listhead;
+	}
+
+	T* back() const
+	{
+		return listtail;
+	}
+
+	void push_back(T* x)
+	{
+		if (listsize++)
+		{
+			x->intrusive_list_node<T, Tag>::ptr_prev = listtail;
+			listtail->intrusive_list_node<T, Tag>::ptr_next = x;
+		}
+		else
+			listhead = x;
+		listtail = x;
+	}
+
+	void erase(const iterator& it)
+	{
+		erase(*it);
+	}
+
+	void erase(T* x)
+	{
+		if (listhead == x)
+			listhead = x->intrusive_list_node<T, Tag>::ptr_next;
+		if (listtail == x)
+			listtail = x->intrusive_list_node<T, Tag>::ptr_prev;
+		x->intrusive_list_node<T, Tag>::unlink();
+		listsize--;
+	}
+
+ private:
+	T* listhead;
+	T* listtail;
+	size_t listsize;
+};
@@ -51,16 +51,113 @@ class IOHookProvider : public ServiceProvider
 	virtual void OnConnect(StreamSocket* sock) = 0;
 };
 
+/** Data which is queued on several sockets at once, for example a line sent to every server link.
+ * The data must not be modified once it has been queued.
+ */
+class CoreExport SharedBuffer : public refcountbase
+{
+ public:
+	/** The data to send */
+	const std::string data;
+
+	SharedBuffer(const std::string& str) : data(str) { }
+};
+
+/** Item of a StreamSocket send queue. It holds either data owned by the queue or
+ * a reference to a SharedBuffer, so data sent to many sockets isn't copied for each one.
+ */
+class CoreExport SendQueueItem
+{
+	/** Data owned by this item, used if shared is NULL */
+	std::string own;
+
+	/** Shared data, or NULL */
+	reference<SharedBuffer> shared;
+
+ public:
+	SendQueueItem() { }
+	SendQueueItem(SharedBuffer* buf) : shared(buf) { }
+
+	const char* data() const { return (shared ? shared->data.data() : own.data()); }
+	size_t length() const { return (shared ? shared->data.length() : own.length()); }
+
+	/** Get the data for modifying it, copying it first if it is shared
+	 * @return The data owned by this item
+	 */
+	std::string& str()
+	{
+		if (shared)
+		{
+			own = shared->data;
+			shared = NULL;
+		}
+		return own;
+	}
+};
+
+typedef std::deque<SendQueueItem> SendQueue;
+
+/** Walks a send queue handing out contiguous blocks of data, for IOHooks which
+ * process data in records of a fixed maximum size (e.g. TLS).
+ * Buffers are handed out directly where possible; only when several buffers smaller than
+ * a record are queued are they copied together so a single record can be filled from them.
+ */
+class CoreExport SendQueueReader
+{
+	/** The send queue being read */
+	const SendQueue& sendq;
+
+	/** The buffer currently being read */
+	SendQueue::const_iterator curr;
+
+	/** Position in the buffer currently being read */
+	size_t pos;
+
+ public:
+	/** Largest block handed out by Peek(), equal to the maximum TLS record payload */
+	static const size_t MAX_BLOCK = 16384;
+
+	/** Create a reader
+	 * @param queue The send queue to read
+	 * @param offset Number of bytes at the start of the first buffer which were already sent
+	 */
+	SendQueueReader(const SendQueue& queue, size_t offset)
+		: sendq(queue), curr(queue.begin()), pos(offset)
+	{
+	}
+
+	/** Get the next block of data without consuming it
+	 * @param len Set to the length of the block, 0 if there is no more data
+	 * @return The data, valid until Skip() is called or the send queue is modified
+	 */
+	const char* Peek(size_t& len);
+
+	/** Consume data
+	 * @param len Number of bytes to consume
+	 */
+	void Skip(size_t len);
+};
+
 class IOHook : public classbase
 {
  public:
+	/** Returned by the default implementation of OnStreamSocketWriteV() */
+	static const int WRITEV_UNSUPPORTED = -2;
+
 	/** The IOHookProvider for this hook, contains information about the hook,
 	 * such as the module providing it and the hook type.
 	 */
 	IOHookProvider* const prov;
 
+	/** If true, data written to the socket needs no processing by this hook (for example
+	 * because the kernel does the encryption) and the core writes the send queue to the
+	 * socket itself, without calling OnStreamSocketWrite() or OnStreamSocketWriteV().
+	 * Reads still go through the hook.
+	 */
+	bool writethrough;
+
 	IOHook(IOHookProvider* provider)
-		: prov(provider) { }
+		: prov(provider), writethrough(false) { }
 
 	/**
 	 * Called when a hooked stream has data to write, or when the socket
@@ -72,6 +169,25 @@ class IOHook : public classbase
 	 */
 	virtual int OnStreamSocketWrite(StreamSocket* sock, std::string& sendq) = 0;
 
+	/**
+	 * Called when a hooked stream has data to write, or when the socket
+	 * engine returns it as writable, with the whole send queue at once.
+	 * Hooks which can make use of several buffers in one go (for example to fill
+	 * complete TLS records) should override this; hooks which do not are called
+	 * through OnStreamSocketWrite() one buffer at a time instead.
+	 * @param sock The socket in question
+	 * @param sendq Data to send to the socket, must not be modified
+	 * @param offset Number of bytes at the start of the first buffer which were already sent
+	 * @param written Set to the number of bytes (after offset) that were consumed
+	 * @return 1 if the sendq has been completely consumed, 0 if there is
+	 *  still data to send, -1 if there was an error, WRITEV_UNSUPPORTED if
+	 *  the hook does not implement this method
+	 */
+	virtual int OnStreamSocketWriteV(StreamSocket* sock, const SendQueue& sendq, size_t offset, size_t& written)
+	{
+		return WRITEV_UNSUPPORTED;
+	}
+
 	/** Called immediately before any socket is closed. When this event is called, shutdown()
 	 * has not yet been called on the socket.
 	 * @param sock The socket in question
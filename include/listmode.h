@@ -35,15 +35,21 @@ class CoreExport ListModeBase : public ModeHandler
 			: setter(Setter), mask(Mask), time(Time) { }
 	};
 
-	/** Items stored in the channel's list
+	/** Items stored in the channel's list, in the order they were added
 	 */
-	typedef std::list<ListItem> ModeList;
+	typedef std::vector<ListItem> ModeList;
 
  private:
 	class ChanData
 	{
 	public:
 		ModeList list;
+
+		/** Masks on the list, to find duplicates without scanning it. Masks are
+		 * compared case insensitively, like they are when they are matched.
+		 */
+		TR1NS::unordered_set<std::string, irc::insensitive, irc::StrHashComp> index;
+
 		int maxitems;
 
 		ChanData() : maxitems(-1) { }
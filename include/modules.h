@@ -128,6 +128,32 @@ struct ModResult {
 		_next = _i+1; \
 		try \
 		{ \
+			HookTimer _timer(*_i, I_ ## y); \
+			(*_i)->y x ; \
+		} \
+		catch (CoreException& modexcept) \
+		{ \
+			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason()); \
+		} \
+	} \
+} while (0);
+
+/**
+ * Like FOREACH_MOD, but for hooks which are passed a message target.
+ * Modules whose HookFilter for the hook does not match the target are
+ * skipped without being called, see ModuleManager::SetHookFilter().
+ * 'FOREACH_MOD_TARGET(OnText, target_type, dest, (user, dest, target_type, text, status, except_list));'
+ */
+#define FOREACH_MOD_TARGET(y,tt,dest,x) do { \
+	const IntModuleList& _handlers = ServerInstance->Modules->EventHandlers[I_ ## y]; \
+	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
+	{ \
+		_next = _i+1; \
+		if (!(*_i)->hookfilters[I_ ## y].Matches(tt, dest)) \
+			continue; \
+		try \
+		{ \
+			HookTimer _timer(*_i, I_ ## y); \
 			(*_i)->y x ; \
 		} \
 		catch (CoreException& modexcept) \
@@ -151,6 +177,7 @@ do { \
 		_next = _i+1; \
 		try \
 		{ \
+			HookTimer _timer(*_i, I_ ## n); \
 			v = (*_i)->n args;
 
 #define WHILE_EACH_HOOK(n) \
@@ -179,6 +206,35 @@ do { \
 	WHILE_EACH_HOOK(n); \
 } while (0)
 
+/**
+ * Like FIRST_MOD_RESULT, but for hooks which are passed a message target.
+ * Modules whose HookFilter for the hook does not match the target are
+ * skipped without being called, see ModuleManager::SetHookFilter().
+ *
+ * Example: FIRST_MOD_RESULT_TARGET(OnUserPreMessage, result, TYPE_CHANNEL, chan, (user, chan, TYPE_CHANNEL, ...))
+ */
+#define FIRST_MOD_RESULT_TARGET(n,v,tt,dest,args) do { \
+	v = MOD_RES_PASSTHRU; \
+	const IntModuleList& _handlers = ServerInstance->Modules->EventHandlers[I_ ## n]; \
+	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
+	{ \
+		_next = _i+1; \
+		if (!(*_i)->hookfilters[I_ ## n].Matches(tt, dest)) \
+			continue; \
+		try \
+		{ \
+			HookTimer _timer(*_i, I_ ## n); \
+			v = (*_i)->n args; \
+			if (v != MOD_RES_PASSTHRU) \
+				break; \
+		} \
+		catch (CoreException& except_ ## n) \
+		{ \
+			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + (except_ ## n).GetReason()); \
+		} \
+	} \
+} while (0)
+
 /** Holds a module's Version information.
  * The members (set by the constructor only) indicate details as to the version number
  * of a module. A class of type Version is returned by the GetVersion method of the Module class.
@@ -266,9 +322,65 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnNamesListItem, I_OnNumeric,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnNamesListCache,
 	I_END
 };
 
+/** Conditions under which a module wants one of its message hooks to be called.
+ * The core checks these before calling the module, so a module which only cares
+ * about channels with one of its modes set is not called for every message on
+ * the network. Only hooks which are passed a message target honour the filter
+ * (OnUserPreMessage, OnText and OnUserMessage); it is ignored everywhere else.
+ * A default constructed filter matches everything.
+ */
+class CoreExport HookFilter
+{
+ public:
+	/** Bitmask of (1 << TYPE_*) values the hook wants to see, 0 to see all target types
+	 */
+	unsigned int targetmask;
+
+	/** If non-NULL, channel targets are only passed to the hook if this mode is set on them.
+	 * The mode must stay loaded for as long as the filter is in place, which is always the
+	 * case for a mode provided by the module setting the filter.
+	 */
+	ModeHandler* chanmode;
+
+	/** Create a filter
+	 * @param targettype If non-zero, the hook is only called for this target type (one of TYPE_*),
+	 * call AddTarget() to allow more.
+	 * @param mode If non-NULL, the hook is only called for channels which have this mode set.
+	 */
+	HookFilter(int targettype = 0, ModeHandler* mode = NULL)
+		: targetmask(targettype ? (1 << targettype) : 0), chanmode(mode)
+	{
+	}
+
+	/** Allow another target type through the filter
+	 * @param targettype One of TYPE_*
+	 * @return This filter
+	 */
+	HookFilter& AddTarget(int targettype)
+	{
+		targetmask |= (1 << targettype);
+		return *this;
+	}
+
+	/** Check whether a message target passes this filter
+	 * @param target_type The type of the target, one of TYPE_*
+	 * @param dest The target, a Channel* if target_type is TYPE_CHANNEL
+	 * @return True if the hook should be called
+	 */
+	bool Matches(int target_type, void* dest) const
+	{
+		if ((targetmask) && (!(targetmask & (1 << target_type))))
+			return false;
+		if ((chanmode) && (target_type == TYPE_CHANNEL) && (!static_cast<Channel*>(dest)->IsModeSet(chanmode)))
+			return false;
+		return true;
+	}
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -294,6 +406,26 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Call counters of one hook of a module, shown in /STATS h
+	 */
+	struct HookStats
+	{
+		/** Number of times the hook was called */
+		unsigned long calls;
+		/** Time spent in the hook in microseconds, only counted if <performance:timehooks> is on */
+		unsigned long usecs;
+
+		HookStats() : calls(0), usecs(0) { }
+	};
+
+	/** Filters set by ModuleManager::SetHookFilter(), indexed by Implementation
+	 */
+	HookFilter hookfilters[I_END];
+
+	/** Call counters of each hook, indexed by Implementation
+	 */
+	HookStats hookstats[I_END];
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -551,12 +683,12 @@ class CoreExport Module : public classbase, public usecountbase
 	 * that is, all users that share a common channel. This is used in
 	 * commands such as NICK, QUIT, etc.
 	 * @param source The source of the message
-	 * @param include_c Channels to scan for users to include
-	 * @param exceptions Map of user->bool that overrides the inclusion decision
+	 * @param neighbors The neighbor list being built. Remove channels from neighbors.chans
+	 * to stop scanning them for users to include.
 	 *
-	 * Set exceptions[user] = true to include, exceptions[user] = false to exclude
+	 * Call neighbors.Include(user) to include, neighbors.Exclude(user) to exclude
 	 */
-	virtual void OnBuildNeighborList(User* source, IncludeChanList& include_c, std::map<User*, bool>& exceptions);
+	virtual void OnBuildNeighborList(User* source, NeighborList& neighbors);
 
 	/** Called before any nickchange, local or remote. This can be used to implement Q-lines etc.
 	 * Please note that although you can see remote nickchanges through this function, you should
@@ -1046,6 +1178,20 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 
+	/** Called before a NAMES list is sent, to find out whether it can be built from the entries cached
+	 * for the channel rather than calling OnNamesListItem for every member. A module which implements
+	 * OnNamesListItem must also implement this hook, otherwise NAMES is never cached while it is loaded.
+	 * If an entry changes for a reason other than a join, part, nick, host, ident, prefix or +i change,
+	 * the module must call Channel::InvalidateNames().
+	 * @param issuer The user the NAMES list is for
+	 * @param chan The channel the NAMES list is for
+	 * @param variant Identifies which entries the issuer gets. Append a character to it if the entries
+	 * you produce for this issuer differ from those for other issuers, e.g. because of a capability.
+	 * @return MOD_RES_DENY if the entries on this channel depend on the issuer in some other way,
+	 * MOD_RES_PASSTHRU to allow using the cache
+	 */
+	virtual ModResult OnNamesListCache(User* issuer, Channel* chan, std::string& variant);
+
 	virtual ModResult OnNumeric(User* user, unsigned int numeric, const std::string &text);
 
 	/** Called whenever a result from /WHO is about to be returned
@@ -1189,6 +1335,21 @@ class CoreExport ModuleManager
 	 */
 	bool Detach(Implementation i, Module* mod);
 
+	/** Set the conditions under which a module's message hook is called.
+	 * Hooks are called unconditionally until this is used; the filter is dropped
+	 * along with the module when it is unloaded.
+	 * @param i The hook to filter, one of I_OnUserPreMessage, I_OnText or I_OnUserMessage
+	 * @param mod The module to set the filter for
+	 * @param filter The conditions, see HookFilter
+	 */
+	void SetHookFilter(Implementation i, Module* mod, const HookFilter& filter);
+
+	/** Get the name of a hook
+	 * @param i The hook to get the name of
+	 * @return The name of the hook without the I_ prefix, e.g. "OnUserPreMessage"
+	 */
+	static const char* GetEventName(Implementation i);
+
 	/** Attach an array of events to a module
 	 * @param i Event types (array) to attach
 	 * @param mod Module to attach events to
@@ -1277,6 +1438,34 @@ class CoreExport ModuleManager
 	const ModuleMap& GetModules() const { return Modules; }
 };
 
+/** Counts a call to a module hook, and times it if <performance:timehooks> is enabled.
+ * Used by FOREACH_MOD and friends, the result is shown in /STATS h.
+ */
+class CoreExport HookTimer
+{
+	/** Counters being updated */
+	Module::HookStats& stats;
+
+	/** Time the hook was entered in microseconds, 0 if not timing */
+	unsigned long start;
+
+ public:
+	/** Count a call to a hook and start timing it if timing is enabled
+	 * @param mod The module being called
+	 * @param i The hook being called
+	 */
+	HookTimer(Module* mod, Implementation i);
+
+	/** Add the time spent in the hook to the counters
+	 */
+	~HookTimer();
+
+	/** Get a monotonic timestamp
+	 * @return The current time in microseconds
+	 */
+	static unsigned long Now();
+};
+
 /** Do not mess with these functions unless you know the C preprocessor
  * well enough to explain why they are needed. The order is important.
  */
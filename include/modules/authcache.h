@@ -0,0 +1,164 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "modules/hash.h"
+
+/** Cache of recent verdicts of an authentication backend, used by the auth modules
+ * so a user reconnecting with the same credentials doesn't need another query.
+ * Entries are keyed by the SHA-256 of the credentials the backend was asked about,
+ * so no passwords are kept; caching is off when m_sha256 is not loaded.
+ */
+class AuthCache
+{
+ public:
+	struct Entry
+	{
+		/** True if the backend accepted the credentials
+		 */
+		bool allow;
+
+		/** Extra data the module needs to apply the verdict again
+		 */
+		std::string data;
+
+		/** Time the entry expires
+		 */
+		time_t expires;
+
+		/** Position in the insertion order, for evicting the oldest entry
+		 */
+		std::list<std::string>::iterator pos;
+	};
+
+ private:
+	typedef TR1NS::unordered_map<std::string, Entry> EntryMap;
+
+	EntryMap entries;
+	std::list<std::string> order;
+
+	/** Seconds to cache accepted and rejected credentials for, 0 to not cache them
+	 */
+	unsigned int positivettl;
+	unsigned int negativettl;
+
+	/** Maximum number of entries
+	 */
+	unsigned int maxsize;
+
+	/** Incremented when the cache is cleared so queries sent before can't add stale verdicts
+	 */
+	unsigned int generation;
+
+	void Erase(EntryMap::iterator it)
+	{
+		order.erase(it->second.pos);
+		entries.erase(it);
+	}
+
+ public:
+	AuthCache() : positivettl(0), negativettl(0), maxsize(0), generation(0) { }
+
+	/** Read the cache settings from the module's config tag and clear the cache
+	 * @param tag Tag with the cachettl, negativettl and cachesize keys
+	 */
+	void Configure(ConfigTag* tag)
+	{
+		positivettl = tag->getDuration("cachettl", 0, 0);
+		negativettl = tag->getDuration("negativettl", positivettl, 0);
+		maxsize = tag->getInt("cachesize", 1000, 1);
+		Clear();
+	}
+
+	void Clear()
+	{
+		entries.clear();
+		order.clear();
+		generation++;
+	}
+
+	unsigned int GetGeneration() const { return generation; }
+
+	/** Append a field of the credentials to a key, unambiguously
+	 * @param tuple Key being built
+	 * @param field Value to append
+	 */
+	static void AddField(std::string& tuple, const std::string& field)
+	{
+		tuple.append(ConvToStr(field.length())).push_back(':');
+		tuple.append(field);
+	}
+
+	/** Get the cache key of a set of credentials
+	 * @param tuple The fields of the credentials, built with AddField()
+	 * @return The key, or an empty string if caching is off
+	 */
+	std::string MakeKey(const std::string& tuple)
+	{
+		if (!positivettl && !negativettl)
+			return "";
+
+		HashProvider* sha256 = ServerInstance->Modules->FindDataService<HashProvider>("hash/sha256");
+		return (sha256 ? sha256->sum(tuple) : "");
+	}
+
+	/** Look up the verdict for a key
+	 * @return The cached verdict, or NULL if there is none
+	 */
+	const Entry* Find(const std::string& key)
+	{
+		if (key.empty())
+			return NULL;
+
+		EntryMap::iterator it = entries.find(key);
+		if (it == entries.end())
+			return NULL;
+
+		if (it->second.expires <= ServerInstance->Time())
+		{
+			Erase(it);
+			return NULL;
+		}
+		return &it->second;
+	}
+
+	/** Remember the verdict of the backend
+	 * @param key Key returned by MakeKey() when the query was sent
+	 * @param gen Value of GetGeneration() when the query was sent
+	 * @param allow True if the credentials were accepted
+	 * @param data Extra data needed to apply the verdict again
+	 */
+	void Add(const std::string& key, unsigned int gen, bool allow, const std::string& data = "")
+	{
+		const unsigned int ttl = (allow ? positivettl : negativettl);
+		if (key.empty() || gen != generation || !ttl)
+			return;
+
+		EntryMap::iterator it = entries.find(key);
+		if (it != entries.end())
+			Erase(it);
+		else if (entries.size() >= maxsize)
+			Erase(entries.find(order.front()));
+
+		Entry& entry = entries[key];
+		entry.allow = allow;
+		entry.data = data;
+		entry.expires = ServerInstance->Time() + ttl;
+		entry.pos = order.insert(order.end(), key);
+	}
+};
@@ -20,69 +20,73 @@
 
 #pragma once
 
-class CapEvent : public Event
+/** A client capability which users can enable with CAP REQ.
+ * Every capability is registered as the data service "cap/<name>", which is how m_cap
+ * finds them, and owns a bit in the capability set of LocalUser, so checking whether
+ * a user enabled it needs no lookup.
+ */
+class GenericCap : public DataProvider
 {
- public:
-	enum CapEventType
-	{
-		CAPEVENT_REQ,
-		CAPEVENT_LS,
-		CAPEVENT_LIST,
-		CAPEVENT_CLEAR
-	};
+	/** Bit of the capability in the capability set of local users
+	 */
+	const unsigned int bit;
 
-	CapEventType type;
-	std::vector<std::string> wanted;
-	std::vector<std::string> ack;
-	User* user;
-	CapEvent(Module* sender, User* u, CapEventType capevtype) : Event(sender, "cap_request"), type(capevtype), user(u) {}
-};
+	/** True if the capability is offered to clients
+	 */
+	bool active;
 
-class GenericCap
-{
  public:
-	LocalIntExt ext;
+	/** Name of the capability
+	 */
 	const std::string cap;
-	GenericCap(Module* parent, const std::string &Cap) : ext("cap_" + Cap, parent), cap(Cap)
+
+	GenericCap(Module* parent, const std::string& Cap)
+		: DataProvider(parent, "cap/" + Cap)
+		, bit(LocalUser::AllocateCapBit())
+		, active(true)
+		, cap(Cap)
+	{
+		if (bit >= LocalUser::MaxCaps)
+			throw ModuleException("Unable to add capability " + Cap + ", there are too many capabilities loaded");
+	}
+
+	~GenericCap()
 	{
+		LocalUser::ReleaseCapBit(bit);
 	}
 
-	void HandleEvent(Event& ev)
+	/** Check whether a user has the capability enabled
+	 * @param user User to check, remote users never have it
+	 * @return True if the user enabled the capability
+	 */
+	bool get(User* user) const
 	{
-		if (ev.id != "cap_request")
-			return;
+		LocalUser* localuser = IS_LOCAL(user);
+		return ((localuser) && (localuser->HasCap(bit)));
+	}
 
-		CapEvent *data = static_cast<CapEvent*>(&ev);
-		if (data->type == CapEvent::CAPEVENT_REQ)
-		{
-			for (std::vector<std::string>::iterator it = data->wanted.begin(); it != data->wanted.end(); ++it)
-			{
-				if (it->empty())
-					continue;
-				bool enablecap = ((*it)[0] != '-');
-				if (((enablecap) && (*it == cap)) || (*it == "-" + cap))
-				{
-					// we can handle this, so ACK it, and remove it from the wanted list
-					data->ack.push_back(*it);
-					data->wanted.erase(it);
-					ext.set(data->user, enablecap ? 1 : 0);
-					break;
-				}
-			}
-		}
-		else if (data->type == CapEvent::CAPEVENT_LS)
-		{
-			data->wanted.push_back(cap);
-		}
-		else if (data->type == CapEvent::CAPEVENT_LIST)
-		{
-			if (ext.get(data->user))
-				data->wanted.push_back(cap);
-		}
-		else if (data->type == CapEvent::CAPEVENT_CLEAR)
-		{
-			data->ack.push_back("-" + cap);
-			ext.set(data->user, 0);
-		}
+	/** Enable or disable the capability for a user
+	 * @param user User to change, remote users are ignored
+	 * @param enable True to enable the capability, false to disable it
+	 */
+	void set(User* user, bool enable = true)
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		if (localuser)
+			localuser->SetCap(bit, enable);
 	}
+
+	/** Check whether any local user has the capability enabled, so a module
+	 * can skip looking for recipients of a message only sent to those users
+	 * @return True if at least one local user enabled the capability
+	 */
+	bool IsEnabledByAny() const { return (LocalUser::GetCapUserCount(bit) != 0); }
+
+	bool IsActive() const { return active; }
+
+	/** Set whether the capability is offered to clients. Users who already
+	 * enabled an inactive capability keep it but can't request it again.
+	 * @param newstate True to offer the capability in CAP LS
+	 */
+	void SetActive(bool newstate) { active = newstate; }
 };
@@ -0,0 +1,87 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Rate limiter used by the flood protection modes.
+ * The bucket holds up to limit tokens and refills at limit tokens per period seconds;
+ * every event takes a token. This allows a burst of limit events, after which events
+ * are only allowed at the average rate. Refilling is calculated from the time elapsed
+ * when the bucket is next used, so idle buckets need no timer.
+ */
+class TokenBucket
+{
+	/** Tokens missing from the bucket, in units of 1/(1000 * period) tokens
+	 * so refilling by limit units per millisecond is exact.
+	 */
+	uint64_t used;
+
+	/** Time of the last refill in milliseconds
+	 */
+	uint64_t last;
+
+	static uint64_t Now()
+	{
+		return (static_cast<uint64_t>(ServerInstance->Time()) * 1000) + (ServerInstance->Time_ns() / 1000000);
+	}
+
+	void Refill(unsigned int limit)
+	{
+		const uint64_t now = Now();
+		if (now > last)
+		{
+			const uint64_t refill = (now - last) * limit;
+			used = (refill >= used ? 0 : used - refill);
+		}
+		last = now;
+	}
+
+ public:
+	TokenBucket() : used(0), last(0) { }
+
+	/** Check whether the bucket has no token left for another event
+	 * @param limit Number of events allowed per period
+	 * @param period Length of the period in seconds
+	 * @return True if limit events have recently occurred
+	 */
+	bool IsEmpty(unsigned int limit, unsigned int period)
+	{
+		Refill(limit);
+		const uint64_t cost = static_cast<uint64_t>(period) * 1000;
+		return (used > (limit - 1) * cost);
+	}
+
+	/** Take a token from the bucket for an event
+	 * @param limit Number of events allowed per period
+	 * @param period Length of the period in seconds
+	 * @return True if the event took the last token
+	 */
+	bool Add(unsigned int limit, unsigned int period)
+	{
+		Refill(limit);
+		const uint64_t cost = static_cast<uint64_t>(period) * 1000;
+		used += cost;
+		return (used > (limit - 1) * cost);
+	}
+
+	/** Fill the bucket again
+	 */
+	void Reset()
+	{
+		used = 0;
+	}
+};
@@ -97,8 +97,13 @@ struct LDAPResult
 	QueryType type;
 	LDAPQuery id;
 
+	/** True if the server processed the query and refused it (invalid
+	 * credentials or a false comparison), rather than failing to process it
+	 */
+	bool rejected;
+
 	LDAPResult()
-		: type(QUERY_UNKNOWN), id(-1)
+		: type(QUERY_UNKNOWN), id(-1), rejected(false)
 	{
 	}
 
@@ -144,7 +144,149 @@ class SQLQuery : public classbase
 };
 
 /**
- * Provider object for SQL servers
+ * A parameterised query format converted for use as a prepared statement.
+ * Only a parameter which makes up a whole single quoted string in the format,
+ * as in '$nick', can be bound; the quotes are removed from the statement.
+ */
+class SQLFormat
+{
+ public:
+	/** The statement text, each parameter replaced by a placeholder
+	 */
+	std::string statement;
+
+	/** For '$name' formats, the name of each placeholder in order
+	 */
+	std::vector<std::string> names;
+
+	/** Number of placeholders
+	 */
+	unsigned int count;
+
+	/** False if a parameter is part of a larger literal, such as '%$nick%', or is
+	 * not quoted at all and so may be SQL text rather than a value, in which case
+	 * the format can only be run by substituting the parameters
+	 */
+	bool preparable;
+
+	/** Convert a query format
+	 * @param format The parameterised query string
+	 * @param named True for a format with '$name' parameters, false for '?' parameters
+	 * @param numbered True to use numbered placeholders ($1, $2, ...) rather than '?'
+	 */
+	SQLFormat(const std::string& format, bool named, bool numbered)
+		: count(0), preparable(true)
+	{
+		char quote = 0;
+		std::string::size_type opened = 0;
+		for (std::string::size_type i = 0; i < format.length(); i++)
+		{
+			const char c = format[i];
+			if (c != (named ? '$' : '?'))
+			{
+				if (quote)
+				{
+					if (c == quote)
+						quote = 0;
+				}
+				else if ((c == '\'') || (c == '"'))
+				{
+					// A doubled quote is an escaped quote within the same literal
+					if ((i == 0) || (format[i - 1] != c))
+						opened = statement.length();
+					quote = c;
+				}
+				statement.push_back(c);
+				continue;
+			}
+
+			std::string::size_type end = i + 1;
+			std::string name;
+			if (named)
+			{
+				while (end < format.length() && isalnum(format[end]))
+					name.push_back(format[end++]);
+			}
+
+			// Only a parameter which is the whole string can be bound in its place
+			if ((quote != '\'') || (opened + 1 != statement.length()) || (end >= format.length()) || (format[end] != quote)
+				|| ((end + 1 < format.length()) && (format[end + 1] == quote)))
+			{
+				preparable = false;
+				return;
+			}
+			statement.erase(opened);
+			end++;
+			quote = 0;
+
+			count++;
+			if (named)
+				names.push_back(name);
+			if (numbered)
+				statement.append("$").append(ConvToStr(count));
+			else
+				statement.push_back('?');
+			i = end - 1;
+		}
+	}
+
+	/** Get the values of the placeholders of a '?' format, missing parameters are empty
+	 */
+	void GetValues(const ParamL& p, ParamL& values) const
+	{
+		values.assign(p.begin(), p.begin() + std::min<size_t>(p.size(), count));
+		values.resize(count);
+	}
+
+	/** Get the values of the placeholders of a '$name' format, missing parameters are empty
+	 */
+	void GetValues(const ParamM& p, ParamL& values) const
+	{
+		values.resize(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			ParamM::const_iterator it = p.find(names[i]);
+			values[i] = (it != p.end() ? it->second : "");
+		}
+	}
+};
+
+/** Converted query formats of a provider, keyed by the format string. Formats
+ * normally come from the configuration, so there are only ever a few of them.
+ */
+class SQLFormatCache
+{
+	typedef std::map<std::string, SQLFormat> FormatMap;
+	FormatMap formats;
+	const bool numbered;
+
+ public:
+	/** @param Numbered True if the database uses numbered placeholders ($1, $2, ...) rather than '?'
+	 */
+	SQLFormatCache(bool Numbered) : numbered(Numbered) { }
+
+	const SQLFormat& Get(const std::string& format, bool named)
+	{
+		std::string key(1, named ? '$' : '?');
+		key.append(format);
+
+		FormatMap::iterator it = formats.find(key);
+		if (it == formats.end())
+		{
+			// Guard against a module generating formats on the fly
+			if (formats.size() >= 256)
+				formats.clear();
+			it = formats.insert(std::make_pair(key, SQLFormat(format, named, numbered))).first;
+		}
+		return it->second;
+	}
+};
+
+/**
+ * Provider object for SQL servers.
+ * Queries submitted with parameters may be run as server side prepared statements,
+ * which providers cache per connection by the converted format and prepare again
+ * after reconnecting; see SQLFormat for the formats this applies to.
  */
 class SQLProvider : public DataProvider
 {
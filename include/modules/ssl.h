@@ -167,6 +167,261 @@ class SSLIOHook : public IOHook
 	}
 };
 
+class SSLHandshakeWorker;
+
+/** A step of an SSL handshake which can be run on a worker thread.
+ * While the job is queued the SSL module must not touch the session or the socket.
+ */
+class SSLHandshakeJob
+{
+ public:
+	/** Held by the worker thread while Run() is executing
+	 */
+	Mutex running;
+
+	/** The worker this job was queued on, NULL if it isn't queued
+	 */
+	SSLHandshakeWorker* worker;
+
+	SSLHandshakeJob() : worker(NULL) { }
+	virtual ~SSLHandshakeJob() { }
+
+	/** Advance the handshake. Called on a worker thread, so this must not use anything
+	 * besides the session and the socket file descriptor.
+	 */
+	virtual void Run() = 0;
+
+	/** Called on the main thread after Run() has returned
+	 */
+	virtual void OnComplete() = 0;
+
+	/** Check whether this job is waiting for a worker or for its result to be delivered
+	 * @return True if the job is queued
+	 */
+	bool IsQueued() const { return (worker != NULL); }
+};
+
+/** Worker thread running SSL handshake steps
+ */
+class SSLHandshakeWorker : public SocketThread
+{
+	/** Jobs waiting to be run, protected by the queue lock
+	 */
+	std::deque<SSLHandshakeJob*> queue;
+
+	/** Jobs which have been run, protected by the queue lock
+	 */
+	std::deque<SSLHandshakeJob*> done;
+
+	static bool Remove(std::deque<SSLHandshakeJob*>& list, SSLHandshakeJob* job)
+	{
+		std::deque<SSLHandshakeJob*>::iterator it = std::find(list.begin(), list.end(), job);
+		if (it == list.end())
+			return false;
+		list.erase(it);
+		return true;
+	}
+
+ public:
+	/** Number of jobs queued on this worker whose result hasn't been delivered yet
+	 */
+	size_t pending;
+
+	SSLHandshakeWorker() : pending(0) { }
+
+	void Add(SSLHandshakeJob* job)
+	{
+		job->worker = this;
+		pending++;
+		LockQueue();
+		queue.push_back(job);
+		UnlockQueueWakeup();
+	}
+
+	/** Take a job back, waiting for it if it is running right now
+	 */
+	void Cancel(SSLHandshakeJob* job)
+	{
+		LockQueue();
+		bool removed = Remove(queue, job);
+		UnlockQueue();
+
+		if (!removed)
+		{
+			// The worker locks the job before it leaves the queue and keeps it locked until it is in done
+			job->running.Lock();
+			job->running.Unlock();
+
+			LockQueue();
+			Remove(done, job);
+			UnlockQueue();
+		}
+
+		job->worker = NULL;
+		pending--;
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		LockQueue();
+		while (!GetExitFlag())
+		{
+			if (queue.empty())
+			{
+				WaitForQueue();
+				continue;
+			}
+
+			SSLHandshakeJob* job = queue.front();
+			queue.pop_front();
+			job->running.Lock();
+			UnlockQueue();
+
+			job->Run();
+
+			LockQueue();
+			done.push_back(job);
+			job->running.Unlock();
+			NotifyParent();
+		}
+		UnlockQueue();
+	}
+
+	/** Forget about all jobs after the thread has been joined, the handshakes they were
+	 * running will never finish
+	 */
+	void Abandon()
+	{
+		for (std::deque<SSLHandshakeJob*>::iterator i = queue.begin(); i != queue.end(); ++i)
+			(*i)->worker = NULL;
+		for (std::deque<SSLHandshakeJob*>::iterator i = done.begin(); i != done.end(); ++i)
+			(*i)->worker = NULL;
+		queue.clear();
+		done.clear();
+		pending = 0;
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		// Deliver one at a time as a completion handler may cancel a job that is also done
+		while (true)
+		{
+			LockQueue();
+			if (done.empty())
+			{
+				UnlockQueue();
+				break;
+			}
+			SSLHandshakeJob* job = done.front();
+			done.pop_front();
+			UnlockQueue();
+
+			job->worker = NULL;
+			pending--;
+			job->OnComplete();
+		}
+	}
+};
+
+/** Runs the handshakes of inbound SSL connections on worker threads so a storm of
+ * new connections doesn't stall the main loop.
+ */
+class SSLHandshakePool
+{
+	std::vector<SSLHandshakeWorker*> workers;
+
+	/** Maximum number of jobs queued at once, further handshake steps run on the main thread
+	 */
+	const size_t maxpending;
+
+	/** Statistics: most jobs queued at once, jobs queued and handshake steps run on the main thread
+	 * because too many jobs were queued
+	 */
+	size_t peak;
+	unsigned long offloaded;
+	unsigned long inlined;
+
+ public:
+	SSLHandshakePool(unsigned int threads, size_t maxqueue)
+		: maxpending(maxqueue)
+		, peak(0)
+		, offloaded(0)
+		, inlined(0)
+	{
+		for (unsigned int i = 0; i < threads; ++i)
+		{
+			SSLHandshakeWorker* worker = new SSLHandshakeWorker;
+			workers.push_back(worker);
+			ServerInstance->Threads->Start(worker);
+		}
+	}
+
+	~SSLHandshakePool()
+	{
+		for (std::vector<SSLHandshakeWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			SSLHandshakeWorker* worker = *i;
+			worker->join();
+			worker->Abandon();
+			delete worker;
+		}
+	}
+
+	/** Queue a handshake step on the least busy worker
+	 * @param job The job to queue
+	 * @return True if the job was queued, false if the caller should run it right away
+	 */
+	bool Queue(SSLHandshakeJob* job)
+	{
+		size_t pending = 0;
+		SSLHandshakeWorker* best = NULL;
+		for (std::vector<SSLHandshakeWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			SSLHandshakeWorker* worker = *i;
+			pending += worker->pending;
+			if ((!best) || (worker->pending < best->pending))
+				best = worker;
+		}
+
+		if ((!best) || (pending >= maxpending))
+		{
+			inlined++;
+			return false;
+		}
+
+		best->Add(job);
+		offloaded++;
+		if (++pending > peak)
+			peak = pending;
+		return true;
+	}
+
+	/** Take a job back before its session is freed
+	 * @param job The job to cancel, may or may not be queued
+	 */
+	void Cancel(SSLHandshakeJob* job)
+	{
+		if (job->IsQueued())
+			job->worker->Cancel(job);
+	}
+
+	/** Get the number of jobs queued on all workers
+	 */
+	size_t GetPending() const
+	{
+		size_t pending = 0;
+		for (std::vector<SSLHandshakeWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+			pending += (*i)->pending;
+		return pending;
+	}
+
+	std::string GetStats() const
+	{
+		return "handshake threads " + ConvToStr(workers.size()) + " pending " + ConvToStr(GetPending()) + " peak " + ConvToStr(peak)
+			+ " offloaded " + ConvToStr(offloaded) + " inline " + ConvToStr(inlined);
+	}
+};
+
 /** Helper functions for obtaining SSL client certificates and key fingerprints
  * from StreamSockets
  */
@@ -141,6 +141,8 @@ class CoreExport ListenSocket : public EventHandler
 	int bind_port;
 	/** Human-readable bind description */
 	std::string bind_desc;
+	/** True if SO_REUSEPORT is set so other sockets can listen on the same port */
+	const bool reuseport;
 
 	/** The IOHook provider which handles connections on this socket,
 	 * NULL if there is none.
@@ -148,8 +150,11 @@ class CoreExport ListenSocket : public EventHandler
 	dynamic_reference_nocheck<IOHookProvider> iohookprov;
 
 	/** Create a new listening socket
+	 * @param tag The bind tag this socket was created from
+	 * @param bind_to The address and port to listen on
+	 * @param reuse If true, other sockets may listen on the same port and share its connections
 	 */
-	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to);
+	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to, bool reuse = false);
 	/** Handle an I/O event
 	 */
 	void HandleEvent(EventType et, int errornum = 0);
@@ -158,8 +163,9 @@ class CoreExport ListenSocket : public EventHandler
 	~ListenSocket();
 
 	/** Handles sockets internals crap of a connection, convenience wrapper really
+	 * @return True if a connection was waiting, false if the accept queue is empty
 	 */
-	void AcceptInternal();
+	bool AcceptInternal();
 
 	/** Inspects the bind block belonging to this socket to set the name of the IO hook
 	 * provider which this socket will use for incoming connections.
@@ -160,13 +160,16 @@ enum EventMask
  * must have a file descriptor. What this file descriptor
  * is actually attached to is completely up to you.
  */
-class CoreExport EventHandler : public classbase
+class CoreExport EventHandler : public classbase, public intrusive_list_node<EventHandler>
 {
  private:
 	/** Private state maintained by socket engine */
 	int event_mask;
 
-	void SetEventMask(int mask) { event_mask = mask; }
+	/** Set the event mask after the socket engine changed it.
+	 * The trial bits are kept, they are only changed together with the list of pending trials.
+	 */
+	void SetEventMask(int mask) { event_mask = (mask & ~FD_TRIAL_NOTE_MASK) | (event_mask & FD_TRIAL_NOTE_MASK); }
 
  protected:
 	/** File descriptor.
@@ -195,9 +198,9 @@ class CoreExport EventHandler : public classbase
 	 */
 	EventHandler();
 
-	/** Destructor
+	/** Destructor, removes the handler from the list of pending trials if it is still on it
 	 */
-	virtual ~EventHandler() {}
+	virtual ~EventHandler();
 
 	/** Process an I/O event.
 	 * You MUST implement this function in your derived
@@ -280,9 +283,11 @@ class CoreExport SocketEngine
 	/** Current number of descriptors in the engine
 	 */
 	static size_t CurrentSetSize;
-	/** List of handlers that want a trial read/write
+	/** Handlers that want a trial read/write, in the order they asked for it.
+	 * A handler is on the list exactly when it has FD_ADD_TRIAL_READ or FD_ADD_TRIAL_WRITE
+	 * set, so adding or removing one needs no search.
 	 */
-	static std::set<int> trials;
+	static intrusive_list_tail<EventHandler> trials;
 
 	static int MAX_DESCRIPTORS;
 
@@ -386,9 +391,10 @@ public:
 	 * dispatch events to their handlers by calling their
 	 * EventHandler::HandleEvent() methods with the necessary EventType
 	 * value.
+	 * @param timeout Milliseconds to wait for an event if none are pending
 	 * @return The number of events which have occured.
 	 */
-	static int DispatchEvents();
+	static int DispatchEvents(int timeout = 1000);
 
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
 	 * to happen when writes have been pre-buffered.
@@ -401,7 +407,8 @@ public:
 	static bool BoundsCheckFd(EventHandler* eh);
 
 	/** Abstraction for BSD sockets accept(2).
-	 * This function should emulate its namesake system call exactly.
+	 * This function should emulate its namesake system call, except that the new socket
+	 * is always nonblocking and, where the system allows, closed on exec.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
 	 * @param addr The client IP address and port
 	 * @param addrlen The size of the sockaddr parameter.
@@ -517,6 +524,11 @@ public:
 	 */
 	static void SetReuse(int sockfd);
 
+	/** Set SO_REUSEPORT on this file descriptor so several sockets can listen on the same port
+	 * @return True on success, false if it failed or the system doesn't support it
+	 */
+	static bool SetReusePort(int sockfd);
+
 	/** This function is called immediately after fork().
 	 * Some socket engines (notably kqueue) cannot have their
 	 * handles inherited by forked processes. This method
@@ -544,6 +556,8 @@ public:
 	/** Returns the error for the given error num, strerror(errnum) on *nix
 	 */
 	static std::string GetError(int errnum);
+
+	friend class EventHandler;
 };
 
 inline bool SocketEngine::IgnoreError()
@@ -31,6 +31,11 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoTrialWriteBenchmark();
+	bool DoQuitFanOutBenchmark();
+	bool DoBatchedQuitTests();
+	bool DoCullListTests();
+	bool DoEditDistanceBenchmark();
 };
 
 #endif
@@ -32,8 +32,10 @@ class FakeUser;
 class InspIRCd;
 class Invitation;
 class LocalUser;
+class LocalMemberCache;
 class Membership;
 class Module;
+class NeighborList;
 class OperInfo;
 class ProtocolServer;
 class RemoteUser;
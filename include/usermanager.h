@@ -44,6 +44,14 @@ class CoreExport UserManager
 	 */
 	CloneMap clonemap;
 
+	/** Disconnect a user gracefully, implementation of QuitUser() and QuitUsers()
+	 * @param user The user to remove
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers, can be NULL if same as quitreason
+	 * @param cache Local members of channels, NULL to scan the channels of the user
+	 */
+	void DoQuitUser(User* user, const std::string& quitreason, const std::string* operreason, LocalMemberCache* cache);
+
 	/** A CloneCounts that contains zero for both local and global
 	 */
 	const CloneCounts zeroclonecounts;
@@ -114,6 +122,15 @@ class CoreExport UserManager
 	 */
 	void QuitUser(User* user, const std::string& quitreason, const std::string* operreason = NULL);
 
+	/** Disconnect many users at once, e.g. all users behind a server that has split.
+	 * This is equivalent to calling QuitUser() for every user in the list but the
+	 * channels they are on are only scanned once for local users to send the QUIT to.
+	 * @param users The users to remove, users who are already quitting are skipped
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers, can be NULL if same as quitreason
+	 */
+	void QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason = NULL);
+
 	/** Add a user to the clone map
 	 * @param user The user to add
 	 */
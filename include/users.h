@@ -211,6 +211,17 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** Callback interface for User::ForEachNeighbor() and NeighborList::ForEach()
+ */
+class CoreExport ForEachNeighborHandler
+{
+ public:
+	/** Called once with all local users selected as neighbors
+	 * @param users Local users sharing a channel with the source or included by a module, each of them once
+	 */
+	virtual void Execute(const std::vector<LocalUser*>& users) = 0;
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -545,8 +556,17 @@ class CoreExport User : public Extensible
 	 * quit message for opers only.
 	 * @param normal_text Normal user quit message
 	 * @param oper_text Oper only quit message
+	 * @param cache If not NULL, the local members of channels are taken from this cache
+	 */
+	void WriteCommonQuit(const std::string &normal_text, const std::string &oper_text, LocalMemberCache* cache = NULL);
+
+	/** Call a handler with every local user that can see this user, each of them exactly once.
+	 * The neighbor list is built using NeighborList, so the OnBuildNeighborList hook is honored.
+	 * @param handler The handler to call with the neighbors
+	 * @param include_self True to call the handler for this user as well (if local)
+	 * @param cache If not NULL, the local members of channels are taken from this cache
 	 */
-	void WriteCommonQuit(const std::string &normal_text, const std::string &oper_text);
+	void ForEachNeighbor(ForEachNeighborHandler& handler, bool include_self = true, LocalMemberCache* cache = NULL);
 
 	/** Dump text to a user target, splitting it appropriately to fit
 	 * @param linePrefix text to prefix each complete line with
@@ -714,6 +734,45 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
+ private:
+	/** Client capabilities enabled by the user, one bit for each GenericCap
+	 */
+	uint64_t caps;
+
+ public:
+	/** Maximum number of client capabilities which can be registered at the same time
+	 */
+	static const unsigned int MaxCaps = 64;
+
+	/** Reserve a bit in the capability set of every local user, see GenericCap in modules/cap.h.
+	 * Bits are handed out lowest first and reused once they are released.
+	 * @return The bit, or MaxCaps if all of them are in use
+	 */
+	static unsigned int AllocateCapBit();
+
+	/** Turn off a capability bit for every local user and free it
+	 * @param bit The bit to free
+	 */
+	static void ReleaseCapBit(unsigned int bit);
+
+	/** Get the number of local users who have a capability bit turned on
+	 * @param bit The bit to count
+	 * @return The number of users, if it is 0 there is no need to look for users with the capability
+	 */
+	static unsigned int GetCapUserCount(unsigned int bit);
+
+	/** Check whether the user has a capability bit turned on
+	 * @param bit The bit to check
+	 * @return True if the bit is on
+	 */
+	bool HasCap(unsigned int bit) const { return ((caps & (static_cast<uint64_t>(1) << bit)) != 0); }
+
+	/** Turn a capability bit on or off for the user
+	 * @param bit The bit to change
+	 * @param enable True to turn the bit on, false to turn it off
+	 */
+	void SetCap(unsigned int bit, bool enable);
+
 	/** Check if the user matches a G or K line, and disconnect them if they do.
 	 * @param doZline True if ZLines should be checked (if IP has changed since initial connect)
 	 * Returns true if the user matched a ban, false else.
@@ -739,6 +798,12 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write several lines to this user with a single addition to the sendq.
+	 * @param lines The lines to send, each already within the line length limit and ending in CR/LF
+	 * @param count The number of lines in the buffer, used for statistics
+	 */
+	void WriteBatch(const std::string& lines, unsigned int count);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -834,6 +899,153 @@ inline FakeUser* IS_SERVER(User* u)
 	return u->usertype == USERTYPE_SERVER ? static_cast<FakeUser*>(u) : NULL;
 }
 
+/** Remembers the local members of channels while the neighbors of many users are visited in one go,
+ * e.g. when a netsplit quits thousands of remote users. Channels are scanned once instead of once per
+ * departing user, and remote members are skipped entirely afterwards. When a local user joins or leaves
+ * a channel (e.g. from a hook) every cache is emptied, so it is rebuilt on its next use.
+ */
+class CoreExport LocalMemberCache
+{
+ public:
+	typedef std::vector<LocalUser*> LocalMemberList;
+
+ private:
+	typedef TR1NS::unordered_map<Channel*, LocalMemberList> ChanMap;
+
+	/** Local members of every channel looked up so far */
+	ChanMap chans;
+
+	/** Incremented whenever a local user joins or leaves a channel */
+	static unsigned long changes;
+
+	/** Value of changes when chans was last emptied */
+	unsigned long cachedchanges;
+
+ public:
+	LocalMemberCache() : cachedchanges(changes) { }
+
+	/** Called when a local user joins or leaves a channel, invalidates all caches
+	 */
+	static void OnMembershipChange() { changes++; }
+
+	/** Get the local members of a channel, scanning the channel if it is not cached yet
+	 * @param chan Channel to get the local members of
+	 * @return Local members of the channel at the time of the first call for the channel
+	 */
+	const LocalMemberList& GetLocalMembers(Channel* chan);
+};
+
+/** The set of local users that receive a message sent to the neighbors of a user, e.g. NICK or QUIT.
+ * Neighbors are the local users who share at least one channel with the source. Modules can change the
+ * list of channels to consider and override the decision for individual users in OnBuildNeighborList().
+ *
+ * Decisions are recorded in LocalUser::already_sent rather than in a container: two fresh already_sent
+ * ids are taken for every list, one marking users who have been visited (or explicitly included) and one
+ * marking users who have been explicitly excluded. The containers are taken from a pool and reused, so
+ * building a list does not allocate memory in the common case. A list built while another one is in use
+ * (from a hook or handler) restores the marks it overwrote when it is destroyed.
+ */
+class CoreExport NeighborList
+{
+ public:
+	/** Reusable storage of a NeighborList */
+	struct Scratch
+	{
+		IncludeChanList chans;
+		std::vector<LocalUser*> included;
+		std::vector<std::pair<LocalUser*, already_sent_t> > saved;
+		std::vector<LocalUser*> neighbors;
+	};
+
+ private:
+	/** Storage taken from the pool, returned when this list is destroyed */
+	Scratch* const scratch;
+
+	/** already_sent value of users who are visited or included */
+	const already_sent_t seen_id;
+
+	/** already_sent value of users who are excluded */
+	const already_sent_t silent_id;
+
+	/** Number of lists in existence */
+	static unsigned int active;
+
+	/** True if another list was in use when this one was built, its marks are saved and restored then */
+	const bool nested;
+
+	/** Set the already_sent value of a user, saving the old value if this list is nested
+	 * @param user User to mark
+	 * @param id New already_sent value
+	 */
+	void Mark(LocalUser* user, already_sent_t id)
+	{
+		if (nested)
+			scratch->saved.push_back(std::make_pair(user, user->already_sent));
+		user->already_sent = id;
+	}
+
+ public:
+	/** Channels to scan for neighbors, initially all channels of the source.
+	 * Modules may remove channels from this list in OnBuildNeighborList().
+	 */
+	IncludeChanList& chans;
+
+	/** Build the neighbor list of a user, calling the OnBuildNeighborList hook
+	 * @param source User whose neighbors to find
+	 * @param include_self True to include the source user (if local), false to exclude them
+	 */
+	NeighborList(User* source, bool include_self);
+	~NeighborList();
+
+	/** Include a user regardless of the channels in the list, overriding any previous decision.
+	 * Remote users are ignored.
+	 * @param user User to include
+	 */
+	void Include(User* user);
+
+	/** Exclude a user even if they share a channel in the list, overriding any previous decision.
+	 * Remote users are ignored.
+	 * @param user User to exclude
+	 */
+	void Exclude(User* user);
+
+	/** Check whether a module has already included or excluded a user
+	 * @param user User to check
+	 * @return True if Include() or Exclude() was called for the user
+	 */
+	bool IsExcepted(User* user) const;
+
+	/** Check whether a user has been excluded
+	 * @param user User to check
+	 * @return True if the user must not receive anything
+	 */
+	bool IsExcluded(LocalUser* user) const { return (user->already_sent == silent_id); }
+
+	/** Mark a user as visited
+	 * @param user User to visit
+	 * @return True if the user was neither visited, included nor excluded before this call
+	 */
+	bool Visit(LocalUser* user)
+	{
+		if ((user->already_sent == seen_id) || (user->already_sent == silent_id))
+			return false;
+		Mark(user, seen_id);
+		return true;
+	}
+
+	/** Get the users explicitly included by modules or the constructor
+	 * @return Users included by Include(), they are all marked as visited
+	 */
+	const std::vector<LocalUser*>& GetIncluded() const { return scratch->included; }
+
+	/** Call a handler once with every included user followed by every local member of the
+	 * channels in the list who was not visited or excluded yet.
+	 * @param handler Handler to call, not called if there are no neighbors
+	 * @param cache If not NULL, the local members of channels are taken from this cache
+	 */
+	void ForEach(ForEachNeighborHandler& handler, LocalMemberCache* cache = NULL);
+};
+
 inline bool User::IsModeSet(ModeHandler* mh)
 {
 	return (modes[mh->GetId()]);
@@ -90,48 +90,73 @@ ServiceProvider::~ServiceProvider()
 }
 
 ExtensionItem::ExtensionItem(const std::string& Key, Module* mod) : ServiceProvider(mod, Key, SERVICE_METADATA)
+	, slot(ExtensionManager::AllocateSlot())
 {
 }
 
 ExtensionItem::~ExtensionItem()
 {
-}
-
-void* ExtensionItem::get_raw(const Extensible* container) const
-{
-	Extensible::ExtensibleStore::const_iterator i =
-		container->extensions.find(const_cast<ExtensionItem*>(this));
-	if (i == container->extensions.end())
-		return NULL;
-	return i->second;
+	ExtensionManager::ReleaseSlot(slot);
 }
 
 void* ExtensionItem::set_raw(Extensible* container, void* value)
 {
-	std::pair<Extensible::ExtensibleStore::iterator,bool> rv =
-		container->extensions.insert(std::make_pair(this, value));
-	if (rv.second)
-	{
-		return NULL;
-	}
-	else
+	Extensible::ExtensibleStore& store = container->extensions;
+	if (slot >= store.slots.size())
+		store.slots.resize(slot + 1);
+
+	Extensible::ExtensibleStore::value_type& entry = store.slots[slot];
+	void* old = entry.second;
+	if (!entry.first)
 	{
-		void* old = rv.first->second;
-		rv.first->second = value;
-		return old;
+		entry.first = this;
+		store.count++;
 	}
+	entry.second = value;
+	return old;
 }
 
 void* ExtensionItem::unset_raw(Extensible* container)
 {
-	Extensible::ExtensibleStore::iterator i = container->extensions.find(this);
-	if (i == container->extensions.end())
+	Extensible::ExtensibleStore& store = container->extensions;
+	if ((slot >= store.slots.size()) || (!store.slots[slot].first))
 		return NULL;
-	void* rv = i->second;
-	container->extensions.erase(i);
+
+	Extensible::ExtensibleStore::value_type& entry = store.slots[slot];
+	void* rv = entry.second;
+	entry.first = NULL;
+	entry.second = NULL;
+	store.count--;
 	return rv;
 }
 
+/** Slots which are in use by an ExtensionItem. A function static so it is
+ * constructed before any item, including the ones in InspIRCd itself.
+ */
+static std::vector<bool>& GetUsedSlots()
+{
+	static std::vector<bool> usedslots;
+	return usedslots;
+}
+
+unsigned int ExtensionManager::AllocateSlot()
+{
+	std::vector<bool>& usedslots = GetUsedSlots();
+	std::vector<bool>::iterator it = std::find(usedslots.begin(), usedslots.end(), false);
+	if (it != usedslots.end())
+	{
+		*it = true;
+		return it - usedslots.begin();
+	}
+	usedslots.push_back(true);
+	return usedslots.size() - 1;
+}
+
+void ExtensionManager::ReleaseSlot(unsigned int slot)
+{
+	GetUsedSlots()[slot] = false;
+}
+
 bool ExtensionManager::Register(ExtensionItem* item)
 {
 	return types.insert(std::make_pair(item->name, item)).second;
@@ -165,12 +190,8 @@ void Extensible::doUnhookExtensions(const std::vector<reference<ExtensionItem> >
 	for(std::vector<reference<ExtensionItem> >::const_iterator i = toRemove.begin(); i != toRemove.end(); ++i)
 	{
 		ExtensionItem* item = *i;
-		ExtensibleStore::iterator e = extensions.find(item);
-		if (e != extensions.end())
-		{
-			item->free(e->second);
-			extensions.erase(e);
-		}
+		if (item->slot < extensions.slots.size() && extensions.slots[item->slot].first)
+			item->free(item->unset_raw(this));
 	}
 }
 
@@ -188,11 +209,13 @@ CullResult Extensible::cull()
 
 void Extensible::FreeAllExtItems()
 {
-	for(ExtensibleStore::iterator i = extensions.begin(); i != extensions.end(); ++i)
+	for(ExtensibleStore::SlotList::iterator i = extensions.slots.begin(); i != extensions.slots.end(); ++i)
 	{
-		i->first->free(i->second);
+		if (i->first)
+			i->first->free(i->second);
 	}
-	extensions.clear();
+	extensions.slots.clear();
+	extensions.count = 0;
 }
 
 Extensible::~Extensible()
@@ -37,15 +37,103 @@ namespace
 	ChanModeReference secretmode(NULL, "secret");
 	ChanModeReference privatemode(NULL, "private");
 	UserModeReference invisiblemode(NULL, "invisible");
+
+	/** Channels smaller than this build NAMES from scratch, which is cheap enough
+	 * for them that caching it isn't worth the memory
+	 */
+	const size_t NamesCacheMinUsers = 32;
 }
 
+/** NAMES entries of the members of a channel, rendered once and reused until they change.
+ * Users get different entries depending on the variant string built by OnNamesListCache,
+ * so the entries are kept separately for each variant in use.
+ */
+class NamesCache
+{
+ public:
+	struct Entry
+	{
+		/** The rendered entry, empty if the member is hidden
+		 */
+		std::string item;
+
+		/** True if the entry must be rendered again before use
+		 */
+		bool dirty;
+
+		Entry() : dirty(true) { }
+	};
+
+	struct Variant
+	{
+		typedef TR1NS::unordered_map<Membership*, Entry> EntryMap;
+		EntryMap entries;
+
+		/** Number of dirty entries
+		 */
+		size_t dirty;
+
+		/** The entries joined into RPL_NAMREPLY sized lines, without the channel part.
+		 * Empty if they must be built again.
+		 */
+		std::vector<std::string> lines;
+
+		/** Line length the lines were built for
+		 */
+		size_t maxlen;
+
+		Variant() : dirty(0), maxlen(0) { }
+
+		/** Mark the entry of a member dirty, adding it if the member is new
+		 */
+		void Invalidate(Membership* memb)
+		{
+			lines.clear();
+			std::pair<EntryMap::iterator, bool> ret = entries.insert(std::make_pair(memb, Entry()));
+			Entry& entry = ret.first->second;
+			if (ret.second || !entry.dirty)
+			{
+				entry.dirty = true;
+				dirty++;
+			}
+		}
+
+		void Remove(Membership* memb)
+		{
+			lines.clear();
+			EntryMap::iterator it = entries.find(memb);
+			if (it == entries.end())
+				return;
+			if (it->second.dirty)
+				dirty--;
+			entries.erase(it);
+		}
+	};
+
+	typedef std::map<std::string, Variant> VariantMap;
+	VariantMap variants;
+
+	/** Value of Channel::namesgeneration when the cache was created
+	 */
+	const unsigned int generation;
+
+	NamesCache(unsigned int gen) : generation(gen) { }
+};
+
+unsigned int Channel::namesgeneration = 0;
+
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: namescache(NULL), name(cname), age(ts), topicset(0)
 {
 	if (!ServerInstance->chanlist.insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
 }
 
+Channel::~Channel()
+{
+	delete namescache;
+}
+
 void Channel::SetMode(ModeHandler* mh, bool on)
 {
 	modes[mh->GetId()] = on;
@@ -68,6 +156,9 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	memb = new Membership(user, this);
+	InvalidateNames(memb);
+	if (IS_LOCAL(user))
+		LocalMemberCache::OnMembershipChange();
 	return memb;
 }
 
@@ -103,6 +194,22 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+		LocalMemberCache::OnMembershipChange();
+	if (namescache)
+	{
+		if (userlist.size() <= NamesCacheMinUsers)
+		{
+			delete namescache;
+			namescache = NULL;
+		}
+		else
+		{
+			for (NamesCache::VariantMap::iterator i = namescache->variants.begin(); i != namescache->variants.end(); ++i)
+				i->second.Remove(memb);
+		}
+	}
+
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
@@ -619,12 +726,55 @@ const char* Channel::ChanModes(bool showkey)
 	return scratch.c_str();
 }
 
+void Channel::GetNamesItem(User* user, Membership* memb, bool showinvisible, std::string& item)
+{
+	item.clear();
+	if ((!showinvisible) && (memb->user->IsModeSet(invisiblemode)))
+	{
+		/*
+		 * user is +i, and source not on the channel, does not show
+		 * nick in NAMES list
+		 */
+		return;
+	}
+
+	std::string prefixlist;
+	char prefix = memb->GetPrefixChar();
+	if (prefix)
+		prefixlist.push_back(prefix);
+	std::string nick = memb->user->nick;
+
+	FOREACH_MOD(OnNamesListItem, (user, memb, prefixlist, nick));
+
+	/* Nick was nuked, a module wants us to skip it */
+	if (nick.empty())
+		return;
+
+	item.append(prefixlist).append(nick);
+}
+
+void Channel::InvalidateNames(Membership* memb)
+{
+	if (!namescache)
+		return;
+
+	if (!memb)
+	{
+		delete namescache;
+		namescache = NULL;
+		return;
+	}
+
+	for (NamesCache::VariantMap::iterator i = namescache->variants.begin(); i != namescache->variants.end(); ++i)
+		i->second.Invalidate(memb);
+}
+
 /* compile a userlist of a channel into a string, each nick seperated by
  * spaces and op, voice etc status shown as @ and +, and send it to 'user'
  */
 void Channel::UserList(User* user, bool has_user)
 {
-	bool has_privs = user->HasPrivPermission("channels/auspex");
+	bool showinvisible = (has_user || user->HasPrivPermission("channels/auspex"));
 	std::string list;
 	list.push_back(this->IsModeSet(secretmode) ? '@' : this->IsModeSet(privatemode) ? '*' : '=');
 	list.push_back(' ');
@@ -632,49 +782,109 @@ void Channel::UserList(User* user, bool has_user)
 	std::string::size_type pos = list.size();
 
 	const size_t maxlen = ServerInstance->Config->Limits.MaxLine - 10 - ServerInstance->Config->ServerName.size();
-	std::string prefixlist;
-	std::string nick;
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+
+	bool cacheable = (userlist.size() >= NamesCacheMinUsers);
+	std::string variant(1, showinvisible ? 'i' : '-');
+	if (cacheable)
 	{
-		if ((!has_user) && (i->first->IsModeSet(invisiblemode)) && (!has_privs))
+		ModResult res;
+		FIRST_MOD_RESULT(OnNamesListCache, res, (user, this, variant));
+		cacheable = (res != MOD_RES_DENY);
+
+		// Every module changing entries must have told us how they vary between users
+		const IntModuleList& itemhandlers = ServerInstance->Modules->EventHandlers[I_OnNamesListItem];
+		const IntModuleList& cachehandlers = ServerInstance->Modules->EventHandlers[I_OnNamesListCache];
+		for (IntModuleList::const_iterator i = itemhandlers.begin(); cacheable && i != itemhandlers.end(); ++i)
+			cacheable = (std::find(cachehandlers.begin(), cachehandlers.end(), *i) != cachehandlers.end());
+	}
+
+	if (!cacheable)
+	{
+		std::string item;
+		for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
 		{
-			/*
-			 * user is +i, and source not on the channel, does not show
-			 * nick in NAMES list
-			 */
-			continue;
-		}
+			GetNamesItem(user, i->second, showinvisible, item);
+			if (item.empty())
+				continue;
 
-		Membership* memb = i->second;
+			if (list.size() + item.length() + 1 > maxlen)
+			{
+				/* list overflowed into multiple numerics */
+				user->WriteNumeric(RPL_NAMREPLY, list);
+
+				// Erase all nicks, keep the constant part
+				list.erase(pos);
+			}
 
-		prefixlist.clear();
-		char prefix = memb->GetPrefixChar();
-		if (prefix)
-			prefixlist.push_back(prefix);
-		nick = i->first->nick;
+			list.append(item).push_back(' ');
+		}
+
+		// Only send the user list numeric if there is at least one user in it
+		if (list.size() != pos)
+			user->WriteNumeric(RPL_NAMREPLY, list);
+	}
+	else
+	{
+		if ((namescache) && (namescache->generation != namesgeneration))
+		{
+			delete namescache;
+			namescache = NULL;
+		}
+		if (!namescache)
+			namescache = new NamesCache(namesgeneration);
 
-		FOREACH_MOD(OnNamesListItem, (user, memb, prefixlist, nick));
+		NamesCache::VariantMap::iterator vit = namescache->variants.find(variant);
+		if (vit == namescache->variants.end())
+		{
+			vit = namescache->variants.insert(std::make_pair(variant, NamesCache::Variant())).first;
+			for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+				vit->second.Invalidate(i->second);
+		}
 
-		/* Nick was nuked, a module wants us to skip it */
-		if (nick.empty())
-			continue;
+		NamesCache::Variant& cached = vit->second;
+		if (cached.dirty)
+		{
+			for (NamesCache::Variant::EntryMap::iterator i = cached.entries.begin(); i != cached.entries.end(); ++i)
+			{
+				if (!i->second.dirty)
+					continue;
+				GetNamesItem(user, i->first, showinvisible, i->second.item);
+				i->second.dirty = false;
+			}
+			cached.dirty = 0;
+		}
 
-		if (list.size() + prefixlist.length() + nick.length() + 1 > maxlen)
+		if ((cached.lines.empty()) || (cached.maxlen != maxlen))
 		{
-			/* list overflowed into multiple numerics */
-			user->WriteNumeric(RPL_NAMREPLY, list);
+			cached.lines.clear();
+			cached.maxlen = maxlen;
 
-			// Erase all nicks, keep the constant part
-			list.erase(pos);
+			std::string line;
+			for (NamesCache::Variant::EntryMap::const_iterator i = cached.entries.begin(); i != cached.entries.end(); ++i)
+			{
+				const std::string& item = i->second.item;
+				if (item.empty())
+					continue;
+
+				if (pos + line.size() + item.length() + 1 > maxlen)
+				{
+					cached.lines.push_back(line);
+					line.clear();
+				}
+				line.append(item).push_back(' ');
+			}
+			if (!line.empty())
+				cached.lines.push_back(line);
 		}
 
-		list.append(prefixlist).append(nick).push_back(' ');
+		for (std::vector<std::string>::const_iterator i = cached.lines.begin(); i != cached.lines.end(); ++i)
+		{
+			list.erase(pos);
+			list.append(*i);
+			user->WriteNumeric(RPL_NAMREPLY, list);
+		}
 	}
 
-	// Only send the user list numeric if there is at least one user in it
-	if (list.size() != pos)
-		user->WriteNumeric(RPL_NAMREPLY, list);
-
 	user->WriteNumeric(RPL_ENDOFNAMES, "%s :End of /NAMES list.", this->name.c_str());
 }
 
@@ -748,11 +958,17 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			bool changed = (adding != (mchar == prefix));
+			if (changed)
+				chan->InvalidateNames(this);
+			return changed;
 		}
 	}
 	if (adding)
+	{
 		modes.push_back(prefix);
+		chan->InvalidateNames(this);
+	}
 	return adding;
 }
 
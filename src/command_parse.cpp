@@ -191,8 +191,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 
 	if (!handler)
 	{
-		ModResult MOD_RESULT;
-		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, false, cmd));
+		ModResult MOD_RESULT = CallPreCommand(command, command_p, user, false, cmd);
 		if (MOD_RESULT == MOD_RES_DENY)
 			return;
 
@@ -245,8 +244,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	 * We call OnPreCommand here seperately if the command exists, so the magic above can
 	 * truncate to max_params if necessary. -- w00t
 	 */
-	ModResult MOD_RESULT;
-	FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, false, cmd));
+	ModResult MOD_RESULT = CallPreCommand(command, command_p, user, false, cmd);
 	if (MOD_RESULT == MOD_RES_DENY)
 		return;
 
@@ -307,7 +305,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		handler->use_count++;
 
 		/* module calls too */
-		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, true, cmd));
+		MOD_RESULT = CallPreCommand(command, command_p, user, true, cmd);
 		if (MOD_RESULT == MOD_RES_DENY)
 			return;
 
@@ -327,6 +325,100 @@ void CommandParser::RemoveCommand(Command* x)
 		cmdlist.erase(n);
 }
 
+void CommandParser::SubscribePreCommand(Module* mod, const std::string& command)
+{
+	if (precmdsubs[mod].insert(command).second)
+		precmddirty = true;
+}
+
+void CommandParser::UnsubscribePreCommand(Module* mod)
+{
+	if (precmdsubs.erase(mod))
+		precmddirty = true;
+}
+
+void CommandParser::RebuildPreCommandTable()
+{
+	const PreCommandHandlers& all = ServerInstance->Modules->EventHandlers[I_OnPreCommand];
+	precmdtable.clear();
+	precmdglobal.clear();
+	precmddirty = false;
+
+	for (PreCommandHandlers::const_iterator i = all.begin(); i != all.end(); ++i)
+	{
+		if (!precmdsubs.count(*i))
+			precmdglobal.push_back(*i);
+	}
+
+	// Every subscribed command gets all global handlers plus its subscribers, keeping the priority order
+	for (PreCommandSubscriptions::const_iterator i = precmdsubs.begin(); i != precmdsubs.end(); ++i)
+	{
+		for (std::set<std::string>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+		{
+			PreCommandHandlers& handlers = precmdtable[*j];
+			if (!handlers.empty())
+				continue;
+
+			for (PreCommandHandlers::const_iterator k = all.begin(); k != all.end(); ++k)
+			{
+				PreCommandSubscriptions::const_iterator sub = precmdsubs.find(*k);
+				if ((sub == precmdsubs.end()) || (sub->second.count(*j)))
+					handlers.push_back(*k);
+			}
+		}
+	}
+}
+
+ModResult CommandParser::CallPreCommand(std::string& command, std::vector<std::string>& parameters, LocalUser* user, bool validated, const std::string& original_line)
+{
+	const PreCommandHandlers& all = ServerInstance->Modules->EventHandlers[I_OnPreCommand];
+	if ((!precmddepth) && (precmddirty))
+		RebuildPreCommandTable();
+
+	// If the handler list has changed while the tables are in use (the hook of a module has
+	// executed another command) then use the full list; modules check the command name anyway
+	const PreCommandHandlers* handlers = &all;
+	if (!precmddirty)
+	{
+		TR1NS::unordered_map<std::string, PreCommandHandlers>::const_iterator it = precmdtable.find(command);
+		handlers = ((it != precmdtable.end()) ? &it->second : &precmdglobal);
+	}
+
+	precmddepth++;
+	const std::string origcommand = command;
+	ModResult res;
+	for (size_t pos = handlers->size(); pos > 0; )
+	{
+		Module* const mod = (*handlers)[--pos];
+		try
+		{
+			HookTimer timer(mod, I_OnPreCommand);
+			res = mod->OnPreCommand(command, parameters, user, validated, original_line);
+		}
+		catch (CoreException& modexcept)
+		{
+			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason());
+		}
+
+		if (res != MOD_RES_PASSTHRU)
+			break;
+
+		if ((handlers != &all) && (command != origcommand))
+		{
+			// A module has rewritten the command (e.g. m_abbreviation), let the remaining
+			// modules subscribed to the new command see it by continuing with the full list
+			PreCommandHandlers::const_iterator it = std::find(all.begin(), all.end(), mod);
+			if (it != all.end())
+			{
+				pos = it - all.begin();
+				handlers = &all;
+			}
+		}
+	}
+	precmddepth--;
+	return res;
+}
+
 CommandBase::~CommandBase()
 {
 }
@@ -358,6 +450,8 @@ bool CommandParser::AddCommand(Command *f)
 }
 
 CommandParser::CommandParser()
+	: precmddirty(false)
+	, precmddepth(0)
 {
 }
 
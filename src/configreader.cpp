@@ -31,13 +31,15 @@
 
 ServerConfig::ServerConfig()
 {
-	RawLog = HideBans = HideSplits = UndernetMsgPrefix = false;
+	RawLog = HideBans = HideSplits = UndernetMsgPrefix = TimeHooks = false;
 	WildcardIPv6 = InvBypassModes = true;
 	dns_timeout = 5;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
 	SoftLimit = SocketEngine::GetMaxFds();
 	MaxConn = SOMAXCONN;
+	AcceptBatch = 32;
+	CullBudget = 10;
 	MaxChans = 20;
 	OperMaxChans = 30;
 	c_ipv4_range = 32;
@@ -368,7 +370,10 @@ void ServerConfig::Fill()
 	}
 	SoftLimit = ConfValue("performance")->getInt("softlimit", SocketEngine::GetMaxFds(), 10, SocketEngine::GetMaxFds());
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
+	TimeHooks = ConfValue("performance")->getBool("timehooks");
+	CullBudget = ConfValue("performance")->getInt("cullbudget", 10, 0, 1000);
 	MaxConn = ConfValue("performance")->getInt("somaxconn", SOMAXCONN);
+	AcceptBatch = ConfValue("performance")->getInt("acceptbatch", 32, 1, 1024);
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = ConfValue("server")->getString("description", "Configure Me");
 	Network = ConfValue("server")->getString("network", "Network");
@@ -95,19 +95,19 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 
 		ModResult MOD_RESULT;
 		std::string temp = parameters[1];
-		FIRST_MOD_RESULT(OnUserPreMessage, MOD_RESULT, (user, (void*)parameters[0].c_str(), TYPE_SERVER, temp, 0, except_list, mt));
+		FIRST_MOD_RESULT_TARGET(OnUserPreMessage, MOD_RESULT, TYPE_SERVER, (void*)parameters[0].c_str(), (user, (void*)parameters[0].c_str(), TYPE_SERVER, temp, 0, except_list, mt));
 		if (MOD_RESULT == MOD_RES_DENY)
 			return CMD_FAILURE;
 
 		const char* text = temp.c_str();
 		const char* servermask = (parameters[0].c_str()) + 1;
 
-		FOREACH_MOD(OnText, (user, (void*)parameters[0].c_str(), TYPE_SERVER, text, 0, except_list));
+		FOREACH_MOD_TARGET(OnText, TYPE_SERVER, (void*)parameters[0].c_str(), (user, (void*)parameters[0].c_str(), TYPE_SERVER, text, 0, except_list));
 		if (InspIRCd::Match(ServerInstance->Config->ServerName, servermask, NULL))
 		{
 			SendAll(user, text, mt);
 		}
-		FOREACH_MOD(OnUserMessage, (user, (void*)parameters[0].c_str(), TYPE_SERVER, text, 0, except_list, mt));
+		FOREACH_MOD_TARGET(OnUserMessage, TYPE_SERVER, (void*)parameters[0].c_str(), (user, (void*)parameters[0].c_str(), TYPE_SERVER, text, 0, except_list, mt));
 		return CMD_SUCCESS;
 	}
 	char status = 0;
@@ -152,7 +152,7 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 			ModResult MOD_RESULT;
 
 			std::string temp = parameters[1];
-			FIRST_MOD_RESULT(OnUserPreMessage, MOD_RESULT, (user, chan, TYPE_CHANNEL, temp, status, except_list, mt));
+			FIRST_MOD_RESULT_TARGET(OnUserPreMessage, MOD_RESULT, TYPE_CHANNEL, chan, (user, chan, TYPE_CHANNEL, temp, status, except_list, mt));
 			if (MOD_RESULT == MOD_RES_DENY)
 				return CMD_FAILURE;
 
@@ -165,7 +165,7 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 				return CMD_FAILURE;
 			}
 
-			FOREACH_MOD(OnText, (user,chan,TYPE_CHANNEL,text,status,except_list));
+			FOREACH_MOD_TARGET(OnText, TYPE_CHANNEL, chan, (user,chan,TYPE_CHANNEL,text,status,except_list));
 
 			if (status)
 			{
@@ -183,7 +183,7 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 				chan->WriteAllExcept(user, false, status, except_list, "%s %s :%s", MessageTypeString[mt], chan->name.c_str(), text);
 			}
 
-			FOREACH_MOD(OnUserMessage, (user,chan, TYPE_CHANNEL, text, status, except_list, mt));
+			FOREACH_MOD_TARGET(OnUserMessage, TYPE_CHANNEL, chan, (user,chan, TYPE_CHANNEL, text, status, except_list, mt));
 		}
 		else
 		{
@@ -236,13 +236,13 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 		ModResult MOD_RESULT;
 
 		std::string temp = parameters[1];
-		FIRST_MOD_RESULT(OnUserPreMessage, MOD_RESULT, (user, dest, TYPE_USER, temp, 0, except_list, mt));
+		FIRST_MOD_RESULT_TARGET(OnUserPreMessage, MOD_RESULT, TYPE_USER, dest, (user, dest, TYPE_USER, temp, 0, except_list, mt));
 		if (MOD_RESULT == MOD_RES_DENY)
 			return CMD_FAILURE;
 
 		const char* text = temp.c_str();
 
-		FOREACH_MOD(OnText, (user, dest, TYPE_USER, text, 0, except_list));
+		FOREACH_MOD_TARGET(OnText, TYPE_USER, dest, (user, dest, TYPE_USER, text, 0, except_list));
 
 		if (IS_LOCAL(dest))
 		{
@@ -250,7 +250,7 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 			dest->WriteFrom(user, "%s %s :%s", MessageTypeString[mt], dest->nick.c_str(), text);
 		}
 
-		FOREACH_MOD(OnUserMessage, (user, dest, TYPE_USER, text, 0, except_list, mt));
+		FOREACH_MOD_TARGET(OnUserMessage, TYPE_USER, dest, (user, dest, TYPE_USER, text, 0, except_list, mt));
 	}
 	else
 	{
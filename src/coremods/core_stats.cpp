@@ -300,6 +300,28 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 		}
 		break;
 
+		/* stats h: module hook call counters */
+		case 'h':
+		{
+			const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+			for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+			{
+				Module* mod = i->second;
+				for (size_t n = I_BEGIN + 1; n != I_END; ++n)
+				{
+					const Module::HookStats& hs = mod->hookstats[n];
+					if (!hs.calls)
+						continue;
+
+					std::string line = "249 " + user->nick + " :" + i->first + " " + ModuleManager::GetEventName((Implementation)n) + " calls " + ConvToStr(hs.calls);
+					if (ServerInstance->Config->TimeHooks)
+						line.append(" usecs " + ConvToStr(hs.usecs) + " avg " + ConvToStr(hs.usecs / hs.calls));
+					results.push_back(line);
+				}
+			}
+		}
+		break;
+
 		/* stats o */
 		case 'o':
 		{
@@ -23,8 +23,22 @@
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
 
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/** Identifies a whowas database, followed by records of two 64-bit times (added, signon)
+ * in host byte order and six NUL-terminated strings (nick, ident, host, dhost, server, gecos).
+ */
+static const char DB_MAGIC[] = "INSPWW01";
+
 CommandWhowas::CommandWhowas( Module* parent)
 	: Command(parent, "WHOWAS", 1)
+	, dirty(false)
 	, GroupSize(0), MaxGroups(0), MaxKeep(0)
 {
 	syntax = "<nick>{,<nick>}";
@@ -40,7 +54,7 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		return CMD_FAILURE;
 	}
 
-	whowas_users::iterator i = whowas.find(assign(parameters[0]));
+	whowas_users::iterator i = whowas.find(parameters[0]);
 
 	if (i == whowas.end())
 	{
@@ -48,28 +62,21 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 	}
 	else
 	{
-		whowas_set* grp = i->second;
-		if (!grp->empty())
+		const WhoWas::Nick::List& list = i->second->entries;
+		for (WhoWas::Nick::List::iterator ux = list.begin(); ux != list.end(); ++ux)
 		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
+			WhoWas::Entry* u = *ux;
 
-				user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
+			user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
+				u->ident->c_str(), u->dhost->c_str(), u->GetGecos());
 
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
-						parameters[0].c_str(), u->host.c_str());
+			if (user->HasPrivPermission("users/auspex"))
+				user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
+					parameters[0].c_str(), u->host->c_str());
 
-				std::string signon = InspIRCd::TimeString(u->signon);
-				bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
-				user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server.c_str()), signon.c_str());
-			}
-		}
-		else
-		{
-			user->WriteNumeric(ERR_WASNOSUCHNICK, "%s :There was no such nickname", parameters[0].c_str());
+			std::string signon = InspIRCd::TimeString(u->signon);
+			bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
+			user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server->c_str()), signon.c_str());
 		}
 	}
 
@@ -79,15 +86,14 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 
 std::string CommandWhowas::GetStats()
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		whowas_set* n = i->second;
-		whowas_size += n->size();
-		whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+	size_t whowas_bytes = pool.GetBytes() + (entries.size() * sizeof(WhoWas::Entry)) + (nicks.size() * sizeof(WhoWas::Nick));
+	for (intrusive_list_tail<WhoWas::Entry, WhoWas::AgeListTag>::iterator i = entries.begin(); i != entries.end(); ++i)
+		whowas_bytes += strlen((*i)->GetGecos()) + 1;
+	for (intrusive_list_tail<WhoWas::Nick>::iterator i = nicks.begin(); i != nicks.end(); ++i)
+		whowas_bytes += (*i)->nick.length() + 1;
+
+	return "Whowas entries: " + ConvToStr(entries.size()) + " (" + ConvToStr(whowas_bytes) + " bytes) nicks: "
+		+ ConvToStr(nicks.size()) + " shared strings: " + ConvToStr(pool.size());
 }
 
 void CommandWhowas::AddToWhoWas(User* user)
@@ -98,138 +104,345 @@ void CommandWhowas::AddToWhoWas(User* user)
 		return;
 	}
 
-	// Insert nick if it doesn't exist
-	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
-	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(irc::string(user->nick.c_str()), static_cast<whowas_set*>(NULL)));
+	Add(user->nick, user->host, user->dhost, user->ident, user->server->GetName(), user->fullname, user->signon, ServerInstance->Time());
+}
 
-	if (ret.second) // If inserted
+void CommandWhowas::Add(const std::string& nickname, const std::string& host, const std::string& dhost, const std::string& ident,
+	const std::string& server, const std::string& gecos, time_t signon, time_t added)
+{
+	WhoWas::Nick* nick;
+	whowas_users::iterator it = whowas.find(nickname);
+	if (it == whowas.end())
 	{
-		// This nick is new, create a list for it and add the first record to it
-		whowas_set* n = new whowas_set;
-		n->push_back(new WhoWasGroup(user));
-		ret.first->second = n;
-
-		// Add this nick to the fifo too
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(), ret.first->first));
-
-		if (whowas.size() > this->MaxGroups)
-		{
-			// Too many nicks, remove the nick which was inserted the longest time ago from both the map and the fifo
-			whowas_users::iterator it = whowas.find(whowas_fifo.front().second);
-			if (it != whowas.end())
-			{
-				whowas_set* set = it->second;
-				stdalgo::delete_all(*set);
-
-				delete set;
-				whowas.erase(it);
-			}
-			whowas_fifo.pop_front();
-		}
+		// This nick is new, create a group for it
+		nick = new WhoWas::Nick(nickname);
+		whowas.insert(std::make_pair(nickname, nick));
+		nicks.push_back(nick);
+
+		// Too many nicks, remove the one which was added to the longest time ago
+		if (nicks.size() > this->MaxGroups)
+			RemoveNick(nicks.front());
 	}
 	else
 	{
-		// We've met this nick before, add a new record to the list
-		whowas_set* set = ret.first->second;
-		set->push_back(new WhoWasGroup(user));
+		// We've met this nick before, move it to the back so nicks still in use are evicted last
+		nick = it->second;
+		nicks.erase(nick);
+		nicks.push_back(nick);
+	}
 
-		// If there are too many records for this nick, remove the oldest (front)
-		if (set->size() > this->GroupSize)
-		{
-			delete set->front();
-			set->pop_front();
-		}
+	WhoWas::Entry* entry = WhoWas::Entry::Create(nick, pool, host, dhost, ident, server, gecos, signon, added);
+	nick->entries.push_back(entry);
+	entries.push_back(entry);
+	dirty = true;
+
+	// If there are too many records for this nick, remove the oldest (front)
+	if (nick->entries.size() > this->GroupSize)
+		RemoveEntry(nick->entries.front());
+}
+
+void CommandWhowas::RemoveEntry(WhoWas::Entry* entry)
+{
+	WhoWas::Nick* nick = entry->nick;
+	nick->entries.erase(entry);
+	entries.erase(entry);
+	entry->Destroy(pool);
+	dirty = true;
+
+	if (nick->entries.empty())
+		RemoveNick(nick);
+}
+
+void CommandWhowas::RemoveNick(WhoWas::Nick* nick)
+{
+	while (!nick->entries.empty())
+	{
+		WhoWas::Entry* entry = nick->entries.front();
+		nick->entries.pop_front();
+		entries.erase(entry);
+		entry->Destroy(pool);
 	}
+
+	whowas.erase(nick->nick);
+	nicks.erase(nick);
+	delete nick;
+	dirty = true;
 }
 
 /* on rehash, refactor maps according to new conf values */
 void CommandWhowas::Prune()
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
-
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	while (!whowas_fifo.empty())
+	if (this->GroupSize == 0 || this->MaxGroups == 0)
 	{
-		if ((whowas_fifo.size() > this->MaxGroups) || (whowas_fifo.front().first < min))
-		{
-			whowas_users::iterator iter = whowas.find(whowas_fifo.front().second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-
-			whowas_set* set = iter->second;
-			stdalgo::delete_all(*set);
-
-			delete set;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
+		while (!nicks.empty())
+			RemoveNick(nicks.front());
+		return;
 	}
 
+	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
+	while (nicks.size() > this->MaxGroups)
+		RemoveNick(nicks.front());
+	Maintain();
+
 	/* Then cut the whowas sets to new size (groupsize) */
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	for (intrusive_list_tail<WhoWas::Nick>::iterator i = nicks.begin(); i != nicks.end(); ++i)
 	{
-		whowas_set* n = i->second;
-		while (n->size() > this->GroupSize)
-		{
-			delete n->front();
-			n->pop_front();
-		}
+		WhoWas::Nick* nick = *i;
+		while (nick->entries.size() > this->GroupSize)
+			RemoveEntry(nick->entries.front());
 	}
 }
 
-/* call maintain once an hour to remove expired nicks */
+/* call maintain once an hour to remove expired records, oldest are at the front */
 void CommandWhowas::Maintain()
 {
 	time_t min = ServerInstance->Time() - this->MaxKeep;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	while (!entries.empty() && entries.front()->added < min)
+		RemoveEntry(entries.front());
+}
+
+static void WriteString(std::ofstream& stream, const std::string& str)
+{
+	stream.write(str.c_str(), str.length() + 1);
+}
+
+bool CommandWhowas::Save()
+{
+	// Rewriting the database is slow with many records, don't do it if it would not change
+	if ((Database.empty()) || (!dirty))
+		return true;
+
+	// Write to a temporary file and rename it over the old one so a crash can't leave a partial database
+	const std::string newdb = Database + ".new";
+	std::ofstream stream(newdb.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!stream.is_open())
 	{
-		whowas_set* set = i->second;
-		while (!set->empty() && set->front()->signon < min)
-		{
-			delete set->front();
-			set->pop_front();
-		}
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Cannot create database %s: %s (%d)", newdb.c_str(), strerror(errno), errno);
+		return false;
+	}
+
+	stream.write(DB_MAGIC, sizeof(DB_MAGIC) - 1);
+	for (intrusive_list_tail<WhoWas::Entry, WhoWas::AgeListTag>::iterator i = entries.begin(); i != entries.end(); ++i)
+	{
+		const WhoWas::Entry* entry = *i;
+		const int64_t times[2] = { entry->added, entry->signon };
+		stream.write(reinterpret_cast<const char*>(times), sizeof(times));
+		WriteString(stream, entry->nick->nick);
+		WriteString(stream, *entry->ident);
+		WriteString(stream, *entry->host);
+		WriteString(stream, *entry->dhost);
+		WriteString(stream, *entry->server);
+		stream.write(entry->GetGecos(), strlen(entry->GetGecos()) + 1);
+	}
+
+	stream.close();
+	if (stream.fail())
+	{
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Cannot write to database %s: %s (%d)", newdb.c_str(), strerror(errno), errno);
+		return false;
 	}
+
+#ifdef _WIN32
+	remove(Database.c_str());
+#endif
+	if (rename(newdb.c_str(), Database.c_str()) < 0)
+	{
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Cannot replace database %s: %s (%d)", Database.c_str(), strerror(errno), errno);
+		return false;
+	}
+
+	dirty = false;
+	return true;
 }
 
-CommandWhowas::~CommandWhowas()
+bool CommandWhowas::Load()
 {
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	if (Database.empty())
+		return true;
+
+	size_t count;
+#ifdef _WIN32
+	std::ifstream stream(Database.c_str(), std::ios::in | std::ios::binary);
+	if (!stream.is_open())
+		return true;
+
+	const std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+	count = LoadData(data.data(), data.size());
+#else
+	// Map the database rather than reading it so it is paged in only as it is parsed
+	int fd = open(Database.c_str(), O_RDONLY);
+	if (fd < 0)
 	{
-		whowas_set* set = i->second;
-		for (whowas_set::iterator j = set->begin(); j != set->end(); ++j)
-			delete *j;
+		if (errno == ENOENT)
+			return true;
 
-		delete set;
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Cannot open database %s: %s (%d)", Database.c_str(), strerror(errno), errno);
+		return false;
 	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0 || sb.st_size <= 0)
+	{
+		close(fd);
+		return true;
+	}
+
+	void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Cannot map database %s: %s (%d)", Database.c_str(), strerror(errno), errno);
+		return false;
+	}
+
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+	count = LoadData(static_cast<const char*>(data), sb.st_size);
+	munmap(data, sb.st_size);
+#endif
+
+	// The records are what the database holds (less any evicted by the limits, evicting them again is harmless)
+	dirty = false;
+	ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Loaded %lu records from %s", static_cast<unsigned long>(count), Database.c_str());
+	return true;
+}
+
+/** Read a NUL-terminated string from a database image
+ * @return False if the string runs past the end of the image
+ */
+static bool ReadString(const char*& pos, const char* end, std::string& out)
+{
+	const char* nul = static_cast<const char*>(memchr(pos, 0, end - pos));
+	if (!nul)
+		return false;
+
+	out.assign(pos, nul - pos);
+	pos = nul + 1;
+	return true;
+}
+
+size_t CommandWhowas::LoadData(const char* data, size_t len)
+{
+	const size_t magiclen = sizeof(DB_MAGIC) - 1;
+	if (len < magiclen || memcmp(data, DB_MAGIC, magiclen))
+	{
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Database %s is not a whowas database, ignoring it", Database.c_str());
+		return 0;
+	}
+
+	if (this->GroupSize == 0 || this->MaxGroups == 0)
+		return 0;
+
+	const time_t min = ServerInstance->Time() - this->MaxKeep;
+	const char* pos = data + magiclen;
+	const char* end = data + len;
+	size_t count = 0;
+	std::string nick, ident, host, dhost, server, gecos;
+	while (pos < end)
+	{
+		int64_t times[2];
+		if (static_cast<size_t>(end - pos) < sizeof(times))
+			break;
+		memcpy(times, pos, sizeof(times));
+		pos += sizeof(times);
+
+		if (!ReadString(pos, end, nick) || !ReadString(pos, end, ident) || !ReadString(pos, end, host)
+			|| !ReadString(pos, end, dhost) || !ReadString(pos, end, server) || !ReadString(pos, end, gecos))
+			break;
+
+		if (times[0] < min)
+			continue;
+
+		Add(nick, host, dhost, ident, server, gecos, times[1], times[0]);
+		count++;
+	}
+
+	if (pos != end)
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "Database %s is truncated, loaded %lu records", Database.c_str(), static_cast<unsigned long>(count));
+	return count;
 }
 
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server->GetName()), gecos(user->fullname), signon(user->signon)
+CommandWhowas::~CommandWhowas()
 {
+	while (!nicks.empty())
+		RemoveNick(nicks.front());
+}
+
+const std::string* WhoWas::StringPool::Intern(const std::string& str)
+{
+	PoolMap::iterator it = strings.find(str);
+	if (it == strings.end())
+		it = strings.insert(std::make_pair(str, 0)).first;
+
+	it->second++;
+	return &it->first;
+}
+
+void WhoWas::StringPool::Release(const std::string* str)
+{
+	PoolMap::iterator it = strings.find(*str);
+	if (--it->second == 0)
+		strings.erase(it);
+}
+
+size_t WhoWas::StringPool::GetBytes() const
+{
+	size_t bytes = 0;
+	for (PoolMap::const_iterator i = strings.begin(); i != strings.end(); ++i)
+		bytes += sizeof(PoolMap::value_type) + i->first.length() + 1;
+	return bytes;
+}
+
+WhoWas::Entry::Entry(Nick* n, StringPool& pool, const std::string& Host, const std::string& DHost, const std::string& Ident,
+	const std::string& Server, time_t Signon, time_t Added)
+	: nick(n), host(pool.Intern(Host)), dhost(pool.Intern(DHost)), ident(pool.Intern(Ident))
+	, server(pool.Intern(Server)), signon(Signon), added(Added)
+{
+}
+
+WhoWas::Entry* WhoWas::Entry::Create(Nick* n, StringPool& pool, const std::string& host, const std::string& dhost, const std::string& ident,
+	const std::string& server, const std::string& gecos, time_t signon, time_t added)
+{
+	// The gecos follows the record in the same block, saving an allocation per record
+	const size_t gecoslen = gecos.length() + 1;
+	void* mem = ::operator new(sizeof(Entry) + gecoslen);
+	Entry* entry = new(mem) Entry(n, pool, host, dhost, ident, server, signon, added);
+	memcpy(static_cast<char*>(mem) + sizeof(Entry), gecos.c_str(), gecoslen);
+	return entry;
+}
+
+void WhoWas::Entry::Destroy(StringPool& pool)
+{
+	pool.Release(host);
+	pool.Release(dhost);
+	pool.Release(ident);
+	pool.Release(server);
+	this->~Entry();
+	::operator delete(this);
 }
 
 class ModuleWhoWas : public Module
 {
 	CommandWhowas cmd;
 
+	/** Whether the database has been read, it is only read when the module is loaded
+	 */
+	bool loaded;
+
  public:
-	ModuleWhoWas() : cmd(this)
+	ModuleWhoWas() : cmd(this), loaded(false)
+	{
+	}
+
+	~ModuleWhoWas()
 	{
+		cmd.Save();
 	}
 
 	void OnGarbageCollect()
 	{
 		// Remove all entries older than MaxKeep
 		cmd.Maintain();
+		cmd.Save();
 	}
 
 	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message)
@@ -252,13 +465,31 @@ class ModuleWhoWas : public Module
 		unsigned int NewMaxGroups = tag->getInt("maxgroups", 10240, 0, 1000000);
 		unsigned int NewMaxKeep = tag->getDuration("maxkeep", 3600, 3600);
 
-		if ((NewGroupSize == cmd.GroupSize) && (NewMaxGroups == cmd.MaxGroups) && (NewMaxKeep == cmd.MaxKeep))
+		std::string database = tag->getString("database");
+		if (!database.empty())
+			database = ServerInstance->Config->Paths.PrependData(database);
+		if (database != cmd.Database)
+		{
+			// A new database has none of the records yet
+			cmd.Database = database;
+			cmd.Invalidate();
+		}
+
+		if ((loaded) && (NewGroupSize == cmd.GroupSize) && (NewMaxGroups == cmd.MaxGroups) && (NewMaxKeep == cmd.MaxKeep))
 			return;
 
 		cmd.GroupSize = NewGroupSize;
 		cmd.MaxGroups = NewMaxGroups;
 		cmd.MaxKeep = NewMaxKeep;
-		cmd.Prune();
+
+		if (!loaded)
+		{
+			// Records are always added newest last, so the database is only read once
+			loaded = true;
+			cmd.Load();
+		}
+		else
+			cmd.Prune();
 	}
 
 	Version GetVersion()
@@ -21,9 +21,8 @@
 
 
 #include "inspircd.h"
-#include <typeinfo>
 
-void CullList::Apply()
+void CullList::Apply(unsigned int maxms)
 {
 	std::vector<LocalUser *> working;
 	while (!SQlist.empty())
@@ -38,36 +37,100 @@ void CullList::Apply()
 		}
 		working.clear();
 	}
-	std::set<classbase*> gone;
+
+	if (!list.empty())
+		CullQueued();
+
+	if (culled.empty())
+		return;
+
+	DeleteCulled(maxms * 1000UL);
+	if ((!maxms) && (list.size()))
+	{
+		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Objects added to cull list in a destructor");
+		Apply();
+	}
+}
+
+void CullList::CullQueued()
+{
+	// Objects culled earlier, either in this pass or in an earlier one and not deleted yet.
+	// cull() may queue its own object again (e.g. User::cull() calling QuitUser()), so this
+	// spans every batch of the pass.
+	std::vector<classbase*> done(culled.begin(), culled.end());
+	std::sort(done.begin(), done.end());
+
+	// cull() may queue more objects, cull those in the same pass
 	std::vector<classbase*> queue;
-	queue.reserve(list.size() + 32);
-	for(unsigned int i=0; i < list.size(); i++)
+	while (!list.empty())
+	{
+		queue.swap(list);
+		CullObjects(queue, done);
+		queue.clear();
+	}
+}
+
+void CullList::CullObjects(const std::vector<classbase*>& queue, std::vector<classbase*>& done)
+{
+	// Objects are rarely added twice, so look for duplicates in a sorted copy of the
+	// queue instead of building a set of every object
+	std::vector<classbase*> sorted(queue);
+	std::sort(sorted.begin(), sorted.end());
+	const bool duplicates = (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end());
+	std::vector<bool> seen(duplicates ? sorted.size() : 0);
+
+	for (std::vector<classbase*>::const_iterator i = queue.begin(); i != queue.end(); ++i)
 	{
-		classbase* c = list[i];
-		if (gone.insert(c).second)
+		classbase* c = *i;
+		if ((!done.empty()) && (std::binary_search(done.begin(), done.end(), c)))
 		{
-			ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "Deleting %s @%p", typeid(*c).name(),
+			ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Object @%p culled twice!",
 				(void*)c);
-			c->cull();
-			queue.push_back(c);
+			continue;
 		}
-		else
+
+		if (duplicates)
 		{
-			ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Object @%p culled twice!",
-				(void*)c);
+			// Every copy of an object finds the first one in the sorted queue
+			const size_t pos = std::lower_bound(sorted.begin(), sorted.end(), c) - sorted.begin();
+			if (seen[pos])
+			{
+				ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Object @%p culled twice!",
+					(void*)c);
+				continue;
+			}
+			seen[pos] = true;
 		}
+
+		c->cull();
+		culled.push_back(c);
 	}
-	list.clear();
-	for(unsigned int i=0; i < queue.size(); i++)
+
+	// Every object of this batch is culled now (or was before), remember them for the next batches
+	const size_t oldsize = done.size();
+	done.insert(done.end(), sorted.begin(), sorted.end());
+	std::inplace_merge(done.begin(), done.begin() + oldsize, done.end());
+	done.erase(std::unique(done.begin(), done.end()), done.end());
+}
+
+void CullList::DeleteCulled(unsigned long maxusecs)
+{
+	const unsigned long start = (maxusecs ? HookTimer::Now() : 0);
+	size_t deleted = 0;
+	while (!culled.empty())
 	{
-		classbase* c = queue[i];
+		// Only look at the clock every few objects, most are quick to delete
+		if ((maxusecs) && (deleted % 64 == 63) && (HookTimer::Now() - start >= maxusecs))
+			break;
+
+		classbase* c = culled.front();
+		culled.pop_front();
 		delete c;
+		deleted++;
 	}
-	if (list.size())
-	{
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Objects added to cull list in a destructor");
-		Apply();
-	}
+
+	ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "Deleted %lu objects, %lu left for later",
+		(unsigned long)deleted, (unsigned long)culled.size());
 }
 
 void ActionList::Run()
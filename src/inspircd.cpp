@@ -734,10 +734,11 @@ void InspIRCd::Run()
 		 * dispatched to their handlers.
 		 */
 		SocketEngine::DispatchTrialWrites();
-		SocketEngine::DispatchEvents();
+		// Don't wait for events if culled objects are left to be deleted
+		SocketEngine::DispatchEvents(GlobalCulls.HasPending() ? 0 : 1000);
 
 		/* if any users were quit, take them out */
-		GlobalCulls.Apply();
+		GlobalCulls.Apply(Config->CullBudget);
 		AtomicActions.Run();
 
 		if (s_signal)
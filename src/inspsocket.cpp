@@ -219,6 +219,118 @@ void StreamSocket::DoRead()
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
+const char* SendQueueReader::Peek(size_t& len)
+{
+	if (curr == sendq.end())
+	{
+		len = 0;
+		return NULL;
+	}
+
+	// Hand out the buffer directly if it fills a block on its own or if there is nothing to join it with
+	len = curr->length() - pos;
+	SendQueue::const_iterator next = curr + 1;
+	if ((len >= MAX_BLOCK) || (next == sendq.end()))
+	{
+		if (len > MAX_BLOCK)
+			len = MAX_BLOCK;
+		return curr->data() + pos;
+	}
+
+	// Join small buffers together so that one block can be filled from them
+	static char block[MAX_BLOCK];
+	memcpy(block, curr->data() + pos, len);
+	for (; (next != sendq.end()) && (len < MAX_BLOCK); ++next)
+	{
+		size_t n = std::min(next->length(), MAX_BLOCK - len);
+		memcpy(block + len, next->data(), n);
+		len += n;
+	}
+	return block;
+}
+
+void SendQueueReader::Skip(size_t len)
+{
+	while ((len > 0) && (curr != sendq.end()))
+	{
+		size_t left = curr->length() - pos;
+		if (left > len)
+		{
+			pos += len;
+			return;
+		}
+		len -= left;
+		++curr;
+		pos = 0;
+	}
+}
+
+void StreamSocket::ConsumeSendQ(size_t len)
+{
+	sendq_len -= len;
+	while (len > 0 && !sendq.empty())
+	{
+		size_t left = sendq.front().length() - sendq_offset;
+		if (left <= len)
+		{
+			// this string got fully written out
+			len -= left;
+			sendq.pop_front();
+			sendq_offset = 0;
+		}
+		else
+		{
+			// stopped in the middle of this string, remember where instead of reallocating it
+			sendq_offset += len;
+			len = 0;
+		}
+	}
+}
+
+int StreamSocket::HookWriteFront()
+{
+	if (sendq_offset)
+	{
+		sendq.front().str().erase(0, sendq_offset);
+		sendq_offset = 0;
+	}
+
+	if (sendq.size() > 1 && sendq[0].length() < 1024)
+	{
+		// Avoid multiple repeated SSL encryption invocations
+		// This adds a single copy of the queue, but avoids
+		// much more overhead in terms of system calls invoked
+		// by the IOHook.
+		//
+		// The length limit of 1024 is to prevent merging strings
+		// more than once when writes begin to block.
+		std::string tmp;
+		tmp.reserve(1280);
+		while (!sendq.empty() && tmp.length() < 1024)
+		{
+			tmp.append(sendq.front().data(), sendq.front().length());
+			sendq.pop_front();
+		}
+		sendq.push_front(SendQueueItem());
+		sendq.front().str().swap(tmp);
+	}
+	std::string& front = sendq.front().str();
+	size_t itemlen = front.length();
+	int rv = GetIOHook()->OnStreamSocketWrite(this, front);
+	if (rv > 0)
+	{
+		// consumed the entire string, and is ready for more
+		sendq_len -= itemlen;
+		sendq.pop_front();
+	}
+	else if (rv == 0)
+	{
+		// Since it is possible that a partial write took place, adjust sendq_len
+		sendq_len = sendq_len - itemlen + front.length();
+	}
+	return rv;
+}
+
 void StreamSocket::DoWrite()
 {
 	if (sendq.empty())
@@ -229,8 +341,11 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
+	// Hooks which let data through unchanged are bypassed in favour of writev()
+	IOHook* const hook = ((GetIOHook()) && (!GetIOHook()->writethrough)) ? GetIOHook() : NULL;
+
 #ifndef DISABLE_WRITEV
-	if (GetIOHook())
+	if (hook)
 #endif
 	{
 		int rv = -1;
@@ -238,45 +353,22 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				if (hook)
 				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(1280);
-					while (!sendq.empty() && tmp.length() < 1024)
-					{
-						tmp.append(sendq.front());
-						sendq.pop_front();
-					}
-					sendq.push_front(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
-				if (GetIOHook())
-				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
-					if (rv > 0)
-					{
-						// consumed the entire string, and is ready for more
-						sendq_len -= itemlen;
-						sendq.pop_front();
-					}
-					else if (rv == 0)
+					size_t written = 0;
+					rv = hook->OnStreamSocketWriteV(this, sendq, sendq_offset, written);
+					if (rv == IOHook::WRITEV_UNSUPPORTED)
+						rv = HookWriteFront();
+					else
+						ConsumeSendQ(rv > 0 ? sendq_len : written);
+
+					if (rv == 0)
 					{
 						// socket has blocked. Stop trying to send data.
 						// IOHook has requested unblock notification from the socketengine
-
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
 						return;
 					}
-					else
+					else if (rv < 0)
 					{
 						SetError("Write Error"); // will not overwrite a better error message
 						return;
@@ -285,7 +377,9 @@ void StreamSocket::DoWrite()
 #ifdef DISABLE_WRITEV
 				else
 				{
-					rv = SocketEngine::Send(this, front.data(), itemlen, 0);
+					const SendQueueItem& front = sendq.front();
+					int itemlen = front.length() - sendq_offset;
+					rv = SocketEngine::Send(this, front.data() + sendq_offset, itemlen, 0);
 					if (rv == 0)
 					{
 						SetError("Connection closed");
@@ -302,14 +396,12 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
-						sendq_len -= rv;
+						ConsumeSendQ(rv);
 						return;
 					}
 					else
 					{
-						sendq_len -= itemlen;
-						sendq.pop_front();
+						ConsumeSendQ(itemlen);
 						if (sendq.empty())
 							SocketEngine::ChangeEventMask(this, FD_WANT_EDGE_WRITE);
 					}
@@ -350,6 +442,11 @@ void StreamSocket::DoWrite()
 				iovecs[i].iov_len = sendq[i].length();
 				rv_max += sendq[i].length();
 			}
+			// skip the part of the first string that was already sent
+			iovecs[0].iov_base = static_cast<char*>(iovecs[0].iov_base) + sendq_offset;
+			iovecs[0].iov_len -= sendq_offset;
+			rv_max -= sendq_offset;
+
 			int rv = writev(fd, iovecs, bufcount);
 			delete[] iovecs;
 
@@ -358,6 +455,7 @@ void StreamSocket::DoWrite()
 				// it's our lucky day, everything got written out. Fast cleanup.
 				// This won't ever happen if the number of buffers got capped.
 				sendq_len = 0;
+				sendq_offset = 0;
 				sendq.clear();
 			}
 			else if (rv > 0)
@@ -368,23 +466,7 @@ void StreamSocket::DoWrite()
 					// it's going to block now
 					eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
 				}
-				sendq_len -= rv;
-				while (rv > 0 && !sendq.empty())
-				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
-					{
-						// this string got fully written out
-						rv -= front.length();
-						sendq.pop_front();
-					}
-					else
-					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
-						rv = 0;
-					}
-				}
+				ConsumeSendQ(rv);
 			}
 			else if (rv == 0)
 			{
@@ -427,12 +509,28 @@ void StreamSocket::WriteData(const std::string &data)
 	}
 
 	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
+	sendq.push_back(SendQueueItem());
+	sendq.back().str().assign(data);
 	sendq_len += data.length();
 
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const reference<SharedBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->data.c_str());
+		return;
+	}
+
+	sendq.push_back(SendQueueItem(data));
+	sendq_len += data->data.length();
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
@@ -26,8 +26,9 @@
 #include <netinet/tcp.h>
 #endif
 
-ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
+ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to, bool reuse)
 	: bind_tag(tag)
+	, reuseport(reuse)
 	, iohookprov(NULL, std::string())
 {
 	irc::sockets::satoap(bind_to, bind_addr, bind_port);
@@ -57,7 +58,11 @@ ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_t
 #endif
 
 	SocketEngine::SetReuse(fd);
-	int rv = SocketEngine::Bind(this->fd, bind_to);
+	int rv = 0;
+	if (reuseport && !SocketEngine::SetReusePort(fd))
+		rv = -1;
+	if (rv >= 0)
+		rv = SocketEngine::Bind(this->fd, bind_to);
 	if (rv >= 0)
 		rv = SocketEngine::Listen(this->fd, ServerInstance->Config->MaxConn);
 
@@ -103,7 +108,7 @@ ListenSocket::~ListenSocket()
 }
 
 /* Just seperated into another func for tidiness really.. */
-void ListenSocket::AcceptInternal()
+bool ListenSocket::AcceptInternal()
 {
 	irc::sockets::sockaddrs client;
 	irc::sockets::sockaddrs server;
@@ -114,8 +119,10 @@ void ListenSocket::AcceptInternal()
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "HandleEvent for Listensocket %s nfd=%d", bind_desc.c_str(), incomingSockfd);
 	if (incomingSockfd < 0)
 	{
-		ServerInstance->stats->statsRefused++;
-		return;
+		// Running out of connections to accept isn't a refusal
+		if (!SocketEngine::IgnoreError())
+			ServerInstance->stats->statsRefused++;
+		return false;
 	}
 
 	socklen_t sz = sizeof(server);
@@ -141,7 +148,7 @@ void ListenSocket::AcceptInternal()
 		SocketEngine::Shutdown(incomingSockfd, 2);
 		SocketEngine::Close(incomingSockfd);
 		ServerInstance->stats->statsRefused++;
-		return;
+		return true;
 	}
 
 	if (client.sa.sa_family == AF_INET6)
@@ -174,8 +181,6 @@ void ListenSocket::AcceptInternal()
 		}
 	}
 
-	SocketEngine::NonBlocking(incomingSockfd);
-
 	ModResult res;
 	FIRST_MOD_RESULT(OnAcceptConnection, res, (incomingSockfd, this, &client, &server));
 	if (res == MOD_RES_PASSTHRU)
@@ -198,6 +203,7 @@ void ListenSocket::AcceptInternal()
 			bind_desc.c_str(), res == MOD_RES_DENY ? "Connection refused by module" : "Module for this port not found");
 		SocketEngine::Close(incomingSockfd);
 	}
+	return true;
 }
 
 void ListenSocket::HandleEvent(EventType e, int err)
@@ -211,8 +217,16 @@ void ListenSocket::HandleEvent(EventType e, int err)
 			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "*** BUG *** ListenSocket::HandleEvent() got a WRITE event!!!");
 			break;
 		case EVENT_READ:
-			this->AcceptInternal();
+		{
+			// Drain the accept queue instead of waiting for another event per connection, but
+			// don't starve everything else during a flood; the socket stays readable if more are waiting
+			for (unsigned int i = 0; i < ServerInstance->Config->AcceptBatch; ++i)
+			{
+				if (!AcceptInternal())
+					break;
+			}
 			break;
+		}
 	}
 }
 
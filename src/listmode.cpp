@@ -141,16 +141,13 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		}
 
 		// Check if the item already exists in the list
-		for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); it++)
+		if (cd->index.count(parameter))
 		{
-			if (parameter == it->mask)
-			{
-				/* Give a subclass a chance to error about this */
-				TellAlreadyOnList(source, channel, parameter);
+			/* Give a subclass a chance to error about this */
+			TellAlreadyOnList(source, channel, parameter);
 
-				// it does, deny the change
-				return MODEACTION_DENY;
-			}
+			// it does, deny the change
+			return MODEACTION_DENY;
 		}
 
 		if ((IS_LOCAL(source)) && (cd->list.size() >= GetLimitInternal(channel->name, cd)))
@@ -174,6 +171,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->index.insert(parameter);
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -185,12 +183,15 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 	else
 	{
 		// We're taking the mode off
-		if (cd)
+		if ((cd) && (cd->index.erase(parameter)))
 		{
+			irc::StrHashComp equals;
 			for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); ++it)
 			{
-				if (parameter == it->mask)
+				if (equals(parameter, it->mask))
 				{
+					// Remove the mask as it was set, so everyone removes the same entry
+					parameter = it->mask;
 					cd->list.erase(it);
 					return MODEACTION_ALLOW;
 				}
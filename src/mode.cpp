@@ -109,6 +109,18 @@ ModeAction SimpleUserModeHandler::OnModeChange(User* source, User* dest, Channel
 }
 
 
+ModeAction ModeUserInvisible::OnModeChange(User* source, User* dest, Channel* channel, std::string& parameter, bool adding)
+{
+	ModeAction res = SimpleUserModeHandler::OnModeChange(source, dest, channel, parameter, adding);
+	if (res == MODEACTION_ALLOW)
+	{
+		// Users who are not on the channel see different NAMES entries for this user now
+		for (UCListIter i = dest->chans.begin(); i != dest->chans.end(); ++i)
+			(*i)->chan->InvalidateNames(*i);
+	}
+	return res;
+}
+
 ModeAction SimpleChannelModeHandler::OnModeChange(User* source, User* dest, Channel* channel, std::string &parameter, bool adding)
 {
 	/* We're either trying to add a mode we already have or
@@ -147,7 +147,7 @@ ModResult	Module::OnChannelPreDelete(Channel*) { DetachEvent(I_OnChannelPreDelet
 void		Module::OnChannelDelete(Channel*) { DetachEvent(I_OnChannelDelete); }
 ModResult	Module::OnSetAway(User*, const std::string &) { DetachEvent(I_OnSetAway); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnWhoisLine(User*, User*, int&, std::string&) { DetachEvent(I_OnWhoisLine); return MOD_RES_PASSTHRU; }
-void		Module::OnBuildNeighborList(User*, IncludeChanList&, std::map<User*,bool>&) { DetachEvent(I_OnBuildNeighborList); }
+void		Module::OnBuildNeighborList(User*, NeighborList&) { DetachEvent(I_OnBuildNeighborList); }
 void		Module::OnGarbageCollect() { DetachEvent(I_OnGarbageCollect); }
 ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnSetConnectClass); return MOD_RES_PASSTHRU; }
 void 		Module::OnText(User*, void*, int, const std::string&, char, CUList&) { DetachEvent(I_OnText); }
@@ -156,6 +156,7 @@ ModResult	Module::OnNumeric(User*, unsigned int, const std::string&) { DetachEve
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { DetachEvent(I_OnAcceptConnection); return MOD_RES_PASSTHRU; }
 void		Module::OnSendWhoLine(User*, const std::vector<std::string>&, User*, Membership*, std::string&) { DetachEvent(I_OnSendWhoLine); }
 void		Module::OnSetUserIP(LocalUser*) { DetachEvent(I_OnSetUserIP); }
+ModResult	Module::OnNamesListCache(User*, Channel*, std::string&) { DetachEvent(I_OnNamesListCache); return MOD_RES_PASSTHRU; }
 
 #ifdef INSPIRCD_ENABLE_TESTSUITE
 void		Module::OnRunTestSuite() { }
@@ -193,6 +194,10 @@ bool ModuleManager::Attach(Implementation i, Module* mod)
 		return false;
 
 	EventHandlers[i].push_back(mod);
+	if ((i == I_OnNamesListItem) || (i == I_OnNamesListCache))
+		Channel::InvalidateAllNames();
+	else if (i == I_OnPreCommand)
+		ServerInstance->Parser->InvalidatePreCommandTable();
 	return true;
 }
 
@@ -204,9 +209,54 @@ bool ModuleManager::Detach(Implementation i, Module* mod)
 		return false;
 
 	EventHandlers[i].erase(x);
+	if ((i == I_OnNamesListItem) || (i == I_OnNamesListCache))
+		Channel::InvalidateAllNames();
+	else if (i == I_OnPreCommand)
+		ServerInstance->Parser->InvalidatePreCommandTable();
 	return true;
 }
 
+void ModuleManager::SetHookFilter(Implementation i, Module* mod, const HookFilter& filter)
+{
+	mod->hookfilters[i] = filter;
+}
+
+const char* ModuleManager::GetEventName(Implementation i)
+{
+	static const char* const names[I_END] = {
+		"", "OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart",
+		"OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnInfo", "OnWhois",
+		"OnUserPreInvite", "OnUserInvite", "OnUserPreMessage", "OnUserPreNick", "OnUserMessage", "OnMode",
+		"OnSyncUser", "OnSyncChannel", "OnDecodeMetaData", "OnAcceptConnection", "OnUserInit",
+		"OnChangeHost", "OnChangeName", "OnAddLine", "OnDelLine", "OnExpireLine", "OnUserPostNick",
+		"OnPreMode", "On005Numeric", "OnKill", "OnLoadModule", "OnUnloadModule", "OnBackgroundTimer",
+		"OnPreCommand", "OnCheckReady", "OnCheckInvite", "OnRawMode", "OnCheckKey", "OnCheckLimit",
+		"OnCheckBan", "OnCheckChannelBan", "OnExtBanCheck", "OnStats", "OnChangeLocalUserHost",
+		"OnPreTopicChange", "OnPostTopicChange", "OnEvent", "OnGlobalOper", "OnPostConnect",
+		"OnChangeLocalUserGECOS", "OnUserRegister", "OnChannelPreDelete", "OnChannelDelete", "OnPostOper",
+		"OnSyncNetwork", "OnSetAway", "OnPostCommand", "OnPostJoin", "OnWhoisLine", "OnBuildNeighborList",
+		"OnGarbageCollect", "OnSetConnectClass", "OnText", "OnPassCompare", "OnNamesListItem", "OnNumeric",
+		"OnPreRehash", "OnModuleRehash", "OnSendWhoLine", "OnChangeIdent", "OnSetUserIP",
+		"OnNamesListCache",
+	};
+	return (i < I_END) ? names[i] : "";
+}
+
+unsigned long HookTimer::Now()
+{
+#if defined _WIN32
+	return GetTickCount() * 1000UL;
+#elif defined HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+#endif
+}
+
 void ModuleManager::Attach(Implementation* i, Module* mod, size_t sz)
 {
 	for (size_t n = 0; n < sz; ++n)
@@ -316,6 +366,8 @@ swap_now:
 		// We are going to change positions; we'll need to run again to verify all requirements
 		if (prioritizationState == PRIO_STATE_LAST)
 			prioritizationState = PRIO_STATE_AGAIN;
+		if (i == I_OnPreCommand)
+			ServerInstance->Parser->InvalidatePreCommandTable();
 		/* Suggestion from Phoenix, "shuffle" the modules to better retain call order */
 		int incrmnt = 1;
 
@@ -440,6 +492,7 @@ void ModuleManager::DoSafeUnload(Module* mod)
 	dynamic_reference_base::reset_all();
 
 	DetachAll(mod);
+	ServerInstance->Parser->UnsubscribePreCommand(mod);
 
 	Modules.erase(modfind);
 	ServerInstance->GlobalCulls.AddItem(mod);
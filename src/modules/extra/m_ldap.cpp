@@ -428,9 +428,13 @@ class LDAPService : public LDAPProvider, public SocketThread
 							{
 								if (errcode != LDAP_COMPARE_TRUE)
 									ldap_result->error = ldap_err2string(errcode);
+								ldap_result->rejected = (errcode == LDAP_COMPARE_FALSE);
 							}
 							else if (errcode != LDAP_SUCCESS)
+							{
 								ldap_result->error = ldap_err2string(errcode);
+								ldap_result->rejected = (errcode == LDAP_INVALID_CREDENTIALS);
+							}
 						}
 						break;
 					}
@@ -44,8 +44,9 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asyncronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via class Thread, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
+ * Each <database> tag gets a pool of worker threads, each with its own connection and its own
+ * queue, and performs its mysql queries in these threads so a slow query only holds up the
+ * queries queued behind it on the same connection. There is a mutex on either end which prevents two threads
  * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
  * worker thread wakes up, and checks if there is a request at the head of its queue.
  * If there is, it processes this request, blocking the worker thread but leaving the ircd
@@ -74,21 +75,34 @@
 
 class SQLConnection;
 class MySQLresult;
-class DispatcherThread;
+class MySQLWorker;
 
 struct QQueueItem
 {
 	SQLQuery* q;
 	std::string query;
-	SQLConnection* c;
-	QQueueItem(SQLQuery* Q, const std::string& S, SQLConnection* C) : q(Q), query(S), c(C) {}
+	/** Time the query was submitted in milliseconds, for the latency statistics
+	 */
+	uint64_t queued;
+	/** Time after which the query is failed instead of sent, 0 if there is no timeout
+	 */
+	time_t deadline;
+	/** Whether to run the query as a cached prepared statement
+	 */
+	bool prepared;
+	/** Values to bind to the statement
+	 */
+	ParamL params;
+	QQueueItem(SQLQuery* Q, const std::string& S, uint64_t Queued, time_t Deadline) : q(Q), query(S), queued(Queued), deadline(Deadline), prepared(false) {}
+	QQueueItem(SQLQuery* Q, const std::string& S, const ParamL& P, uint64_t Queued, time_t Deadline) : q(Q), query(S), queued(Queued), deadline(Deadline), prepared(true), params(P) {}
 };
 
 struct RQueueItem
 {
 	SQLQuery* q;
 	MySQLresult* r;
-	RQueueItem(SQLQuery* Q, MySQLresult* R) : q(Q), r(R) {}
+	uint64_t queued;
+	RQueueItem(SQLQuery* Q, MySQLresult* R, uint64_t Queued) : q(Q), r(R), queued(Queued) {}
 };
 
 typedef std::map<std::string, SQLConnection*> ConnMap;
@@ -100,34 +114,32 @@ typedef std::deque<RQueueItem> ResultQueue;
 class ModuleSQL : public Module
 {
  public:
-	DispatcherThread* Dispatcher;
-	QueryQueue qq;       // MUST HOLD MUTEX
-	ResultQueue rq;      // MUST HOLD MUTEX
 	ConnMap connections; // main thread only
 
-	ModuleSQL();
 	void init() CXX11_OVERRIDE;
 	~ModuleSQL();
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
-};
 
-class DispatcherThread : public SocketThread
-{
- private:
-	ModuleSQL* const Parent;
- public:
-	DispatcherThread(ModuleSQL* CreatorModule) : Parent(CreatorModule) { }
-	~DispatcherThread() { }
-	void Run();
-	void OnNotify();
+	static uint64_t Now()
+	{
+		return (static_cast<uint64_t>(ServerInstance->Time()) * 1000) + (ServerInstance->Time_ns() / 1000000);
+	}
 };
 
 #if !defined(MYSQL_VERSION_ID) || MYSQL_VERSION_ID<32224
 #define mysql_field_count mysql_num_fields
 #endif
 
+// MySQL 8 dropped my_bool in favour of bool
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80001 && !defined(MARIADB_BASE_VERSION)
+typedef bool mysql_bool;
+#else
+typedef my_bool mysql_bool;
+#endif
+
 /** Represents a mysql result set
  */
 class MySQLresult : public SQLResult
@@ -182,6 +194,77 @@ class MySQLresult : public SQLResult
 		}
 	}
 
+	/** Read the rows of an executed prepared statement
+	 */
+	MySQLresult(MYSQL_STMT* stmt) : err(SQL_NO_ERROR), currentrow(0), rows(0)
+	{
+		MYSQL_RES* meta = mysql_stmt_result_metadata(stmt);
+		if (!meta)
+		{
+			// Not a statement which returns rows
+			int affected_rows = mysql_stmt_affected_rows(stmt);
+			if (affected_rows >= 1)
+			{
+				rows = affected_rows;
+				fieldlists.resize(rows);
+			}
+			return;
+		}
+
+		unsigned int cols = mysql_num_fields(meta);
+		MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+		for (unsigned int i = 0; i < cols; i++)
+			colnames.push_back(fields[i].name ? fields[i].name : "");
+
+		// Fetch only the lengths, then each value into a buffer of the right size
+		std::vector<MYSQL_BIND> bind(cols);
+		std::vector<unsigned long> lengths(cols);
+		// Not a vector, that is a std::vector<bool> when mysql_bool is bool
+		mysql_bool* nulls = new mysql_bool[cols]();
+		if (cols)
+		{
+			memset(&bind[0], 0, sizeof(MYSQL_BIND) * cols);
+			for (unsigned int i = 0; i < cols; i++)
+			{
+				bind[i].buffer_type = MYSQL_TYPE_STRING;
+				bind[i].length = &lengths[i];
+				bind[i].is_null = &nulls[i];
+			}
+			mysql_stmt_bind_result(stmt, &bind[0]);
+		}
+
+		int ret;
+		while (((ret = mysql_stmt_fetch(stmt)) == 0) || (ret == MYSQL_DATA_TRUNCATED))
+		{
+			fieldlists.resize(rows + 1);
+			SQLEntries& row = fieldlists[rows];
+			for (unsigned int i = 0; i < cols; i++)
+			{
+				if (nulls[i])
+				{
+					row.push_back(SQLEntry());
+					continue;
+				}
+
+				std::string value(lengths[i], '\0');
+				if (lengths[i])
+				{
+					MYSQL_BIND column = bind[i];
+					column.buffer = &value[0];
+					column.buffer_length = lengths[i];
+					mysql_stmt_fetch_column(stmt, &column, i, 0);
+				}
+				row.push_back(SQLEntry(value));
+			}
+			rows++;
+		}
+
+		if (ret != MYSQL_NO_DATA)
+			err = SQLerror(SQL_QREPLY_FAIL, ConvToStr(mysql_stmt_errno(stmt)) + ": " + mysql_stmt_error(stmt));
+		delete[] nulls;
+		mysql_free_result(meta);
+	}
+
 	MySQLresult(SQLerror& e) : err(e)
 	{
 
@@ -222,52 +305,35 @@ class MySQLresult : public SQLResult
 	}
 };
 
-/** Represents a connection to a mysql database
+/** A connection to a mysql database and the thread which runs its queries
  */
-class SQLConnection : public SQLProvider
+class MySQLWorker : public SocketThread
 {
- public:
-	reference<ConfigTag> config;
+	typedef std::map<std::string, MYSQL_STMT*> StatementMap;
+
+	SQLConnection* const pool;
 	MYSQL *connection;
-	Mutex lock;
 
-	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
-	SQLConnection(Module* p, ConfigTag* tag) : SQLProvider(p, "SQL/" + tag->getString("id")),
-		config(tag), connection(NULL)
-	{
-	}
+	/** Statements prepared on this connection by statement text
+	 */
+	StatementMap statements;
 
-	~SQLConnection()
+	void CloseStatements()
 	{
-		Close();
+		for (StatementMap::iterator i = statements.begin(); i != statements.end(); ++i)
+			mysql_stmt_close(i->second);
+		statements.clear();
 	}
 
-	// This method connects to the database using the credentials supplied to the constructor, and returns
+	// This method connects to the database using the credentials of the pool, and returns
 	// true upon success.
-	bool Connect()
-	{
-		unsigned int timeout = 1;
-		connection = mysql_init(connection);
-		mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
-		std::string host = config->getString("host");
-		std::string user = config->getString("user");
-		std::string pass = config->getString("pass");
-		std::string dbname = config->getString("name");
-		int port = config->getInt("port");
-		bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
-		if (!rv)
-			return rv;
-		std::string initquery;
-		if (config->readString("initialquery", initquery))
-		{
-			mysql_query(connection,initquery.c_str());
-		}
-		return true;
-	}
+	bool Connect();
 
-	ModuleSQL* Parent()
+	bool CheckConnection()
 	{
-		return (ModuleSQL*)(Module*)creator;
+		if (!connection || mysql_ping(connection) != 0)
+			return Connect();
+		return true;
 	}
 
 	MySQLresult* DoBlockingQuery(const std::string& query)
@@ -290,32 +356,218 @@ class SQLConnection : public SQLProvider
 		}
 	}
 
-	bool CheckConnection()
+	/** Run a cached prepared statement, preparing it on first use
+	 */
+	MySQLresult* DoPreparedQuery(const std::string& query, const ParamL& params)
 	{
-		if (!connection || mysql_ping(connection) != 0)
-			return Connect();
-		return true;
+		if (!CheckConnection())
+		{
+			SQLerror e(SQL_BAD_CONN, ConvToStr(mysql_errno(connection)) + ": " + mysql_error(connection));
+			return new MySQLresult(e);
+		}
+
+		StatementMap::iterator it = statements.find(query);
+		if (it == statements.end())
+		{
+			MYSQL_STMT* stmt = mysql_stmt_init(connection);
+			if (!stmt || mysql_stmt_prepare(stmt, query.data(), query.length()))
+			{
+				SQLerror e(SQL_QSEND_FAIL, ConvToStr(mysql_errno(connection)) + ": " + mysql_error(connection));
+				if (stmt)
+					mysql_stmt_close(stmt);
+				return new MySQLresult(e);
+			}
+			it = statements.insert(std::make_pair(query, stmt)).first;
+		}
+
+		MYSQL_STMT* stmt = it->second;
+		std::vector<MYSQL_BIND> bind(params.size());
+		std::vector<unsigned long> lengths(params.size());
+		if (!params.empty())
+		{
+			memset(&bind[0], 0, sizeof(MYSQL_BIND) * params.size());
+			for (unsigned int i = 0; i < params.size(); i++)
+			{
+				lengths[i] = params[i].length();
+				bind[i].buffer_type = MYSQL_TYPE_STRING;
+				bind[i].buffer = const_cast<char*>(params[i].data());
+				bind[i].buffer_length = lengths[i];
+				bind[i].length = &lengths[i];
+			}
+		}
+
+		if ((!params.empty() && mysql_stmt_bind_param(stmt, &bind[0])) || mysql_stmt_execute(stmt))
+		{
+			SQLerror e(SQL_QREPLY_FAIL, ConvToStr(mysql_stmt_errno(stmt)) + ": " + mysql_stmt_error(stmt));
+			// Prepare it again next time in case the failure left the statement unusable
+			mysql_stmt_close(stmt);
+			statements.erase(it);
+			return new MySQLresult(e);
+		}
+
+		MySQLresult* res = new MySQLresult(stmt);
+		mysql_stmt_free_result(stmt);
+		return res;
 	}
 
-	std::string GetError()
+ public:
+	QueryQueue qq;       // MUST HOLD MUTEX, the front query is the one running
+	ResultQueue rq;      // MUST HOLD MUTEX
+
+	/** Held by the worker thread while it is running a query
+	 */
+	Mutex lock;
+
+	MySQLWorker(SQLConnection* Pool) : pool(Pool), connection(NULL) { }
+
+	~MySQLWorker()
 	{
-		return mysql_error(connection);
+		CloseStatements();
+		if (connection)
+			mysql_close(connection);
 	}
 
-	void Close()
+	/** Fail and remove queued queries
+	 * @param mod Module whose queries to remove, NULL for all queries
+	 */
+	void CancelQueries(Module* mod);
+
+	void Run();
+	void OnNotify();
+};
+
+/** Represents a database, a pool of connections each with a worker thread
+ */
+class SQLConnection : public SQLProvider
+{
+	/** Recent query latencies in milliseconds, used as a ring buffer
+	 */
+	std::vector<unsigned int> latencies;
+	size_t latencypos;
+
+	unsigned int GetPercentile(std::vector<unsigned int>& sorted, unsigned int percent)
 	{
-		mysql_close(connection);
+		if (sorted.empty())
+			return 0;
+		std::vector<unsigned int>::iterator it = sorted.begin() + ((sorted.size() - 1) * percent / 100);
+		std::nth_element(sorted.begin(), it, sorted.end());
+		return *it;
+	}
+
+ public:
+	reference<ConfigTag> config;
+	std::vector<MySQLWorker*> workers;
+
+	/** Seconds a query may take to be sent and answered, 0 for no limit
+	 */
+	unsigned int timeout;
+
+	/** Number of queries which have completed
+	 */
+	unsigned long completed;
+
+	SQLConnection(Module* p, ConfigTag* tag) : SQLProvider(p, "SQL/" + tag->getString("id")),
+		latencypos(0), config(tag), completed(0), formats(false)
+	{
+		timeout = tag->getDuration("timeout", 0);
+		unsigned int poolsize = tag->getInt("poolsize", 1, 1, 64);
+		for (unsigned int i = 0; i < poolsize; ++i)
+		{
+			MySQLWorker* worker = new MySQLWorker(this);
+			workers.push_back(worker);
+			ServerInstance->Threads->Start(worker);
+		}
+	}
+
+	~SQLConnection()
+	{
+		for (std::vector<MySQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			MySQLWorker* worker = *i;
+			worker->join();
+			worker->CancelQueries(NULL);
+			worker->OnNotify();
+			delete worker;
+		}
+	}
+
+	void AddLatency(uint64_t latency)
+	{
+		completed++;
+		if (latencies.size() < 1024)
+			latencies.push_back(latency);
+		else
+		{
+			latencies[latencypos] = latency;
+			latencypos = (latencypos + 1) % latencies.size();
+		}
+	}
+
+	/** Conversions of query formats to statements, main thread only
+	 */
+	SQLFormatCache formats;
+
+	std::string GetStats()
+	{
+		unsigned int inflight = 0;
+		size_t queued = 0;
+		for (std::vector<MySQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			MySQLWorker* worker = *i;
+			worker->LockQueue();
+			if (!worker->qq.empty())
+			{
+				inflight++;
+				queued += worker->qq.size() - 1;
+			}
+			worker->UnlockQueue();
+		}
+
+		std::vector<unsigned int> sorted(latencies);
+		return "pool " + ConvToStr(workers.size()) + " in-flight " + ConvToStr(inflight) + " queued " + ConvToStr(queued)
+			+ " queries " + ConvToStr(completed) + " latency p50 " + ConvToStr(GetPercentile(sorted, 50))
+			+ "ms p99 " + ConvToStr(GetPercentile(sorted, 99)) + "ms";
+	}
+
+	void Queue(const QQueueItem& item)
+	{
+		// Queue on the connection with the least work so one slow query doesn't hold up the rest
+		MySQLWorker* best = NULL;
+		size_t bestsize = 0;
+		for (std::vector<MySQLWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			MySQLWorker* worker = *i;
+			worker->LockQueue();
+			size_t size = worker->qq.size();
+			worker->UnlockQueue();
+			if (!best || size < bestsize)
+			{
+				best = worker;
+				bestsize = size;
+			}
+		}
+
+		best->LockQueue();
+		best->qq.push_back(item);
+		best->UnlockQueueWakeup();
 	}
 
 	void submit(SQLQuery* q, const std::string& qs)
 	{
-		Parent()->Dispatcher->LockQueue();
-		Parent()->qq.push_back(QQueueItem(q, qs, this));
-		Parent()->Dispatcher->UnlockQueueWakeup();
+		Queue(QQueueItem(q, qs, ModuleSQL::Now(), timeout ? ServerInstance->Time() + timeout : 0));
 	}
 
 	void submit(SQLQuery* call, const std::string& q, const ParamL& p)
 	{
+		const SQLFormat& format = formats.Get(q, false);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			Queue(QQueueItem(call, format.statement, values, ModuleSQL::Now(), timeout ? ServerInstance->Time() + timeout : 0));
+			return;
+		}
+
 		std::string res;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
@@ -344,6 +596,15 @@ class SQLConnection : public SQLProvider
 
 	void submit(SQLQuery* call, const std::string& q, const ParamM& p)
 	{
+		const SQLFormat& format = formats.Get(q, true);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			Queue(QQueueItem(call, format.statement, values, ModuleSQL::Now(), timeout ? ServerInstance->Time() + timeout : 0));
+			return;
+		}
+
 		std::string res;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
@@ -372,29 +633,75 @@ class SQLConnection : public SQLProvider
 	}
 };
 
-ModuleSQL::ModuleSQL()
+bool MySQLWorker::Connect()
 {
-	Dispatcher = NULL;
+	// Statements don't survive the connection they were prepared on
+	CloseStatements();
+
+	ConfigTag* config = pool->config;
+	unsigned int connecttimeout = 1;
+	connection = mysql_init(connection);
+	mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&connecttimeout);
+	if (pool->timeout)
+	{
+		// Bounds the time spent waiting for the server to answer a query
+		mysql_options(connection, MYSQL_OPT_READ_TIMEOUT, (char*)&pool->timeout);
+		mysql_options(connection, MYSQL_OPT_WRITE_TIMEOUT, (char*)&pool->timeout);
+	}
+	std::string host = config->getString("host");
+	std::string user = config->getString("user");
+	std::string pass = config->getString("pass");
+	std::string dbname = config->getString("name");
+	int port = config->getInt("port");
+	bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
+	if (!rv)
+		return rv;
+	std::string initquery;
+	if (config->readString("initialquery", initquery))
+	{
+		mysql_query(connection,initquery.c_str());
+	}
+	return true;
+}
+
+void MySQLWorker::CancelQueries(Module* mod)
+{
+	SQLerror err(SQL_BAD_DBID);
+	LockQueue();
+	unsigned int i = qq.size();
+	while (i > 0)
+	{
+		i--;
+		if (!mod || qq[i].q->creator == mod)
+		{
+			if (i == 0)
+			{
+				// need to wait until the query is done
+				// (the result will be discarded)
+				lock.Lock();
+				lock.Unlock();
+			}
+			qq[i].q->OnError(err);
+			delete qq[i].q;
+			qq.erase(qq.begin() + i);
+		}
+	}
+	UnlockQueue();
 }
 
 void ModuleSQL::init()
 {
-	Dispatcher = new DispatcherThread(this);
-	ServerInstance->Threads->Start(Dispatcher);
+	// Must be done before any worker thread calls mysql_init()
+	mysql_library_init(0, NULL, NULL);
 }
 
 ModuleSQL::~ModuleSQL()
 {
-	if (Dispatcher)
-	{
-		Dispatcher->join();
-		Dispatcher->OnNotify();
-		delete Dispatcher;
-	}
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		delete i->second;
 	}
+	mysql_library_end();
 }
 
 void ModuleSQL::ReadConfig(ConfigStatus& status)
@@ -420,58 +727,37 @@ void ModuleSQL::ReadConfig(ConfigStatus& status)
 		}
 	}
 
-	// now clean up the deleted databases
-	Dispatcher->LockQueue();
-	SQLerror err(SQL_BAD_DBID);
+	// now clean up the deleted databases, their queries fail with SQL_BAD_DBID
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		ServerInstance->Modules->DelService(*i->second);
-		// it might be running a query on this database. Wait for that to complete
-		i->second->lock.Lock();
-		i->second->lock.Unlock();
-		// now remove all active queries to this DB
-		for (size_t j = qq.size(); j > 0; j--)
-		{
-			size_t k = j - 1;
-			if (qq[k].c == i->second)
-			{
-				qq[k].q->OnError(err);
-				delete qq[k].q;
-				qq.erase(qq.begin() + k);
-			}
-		}
-		// finally, nuke the connection
 		delete i->second;
 	}
-	Dispatcher->UnlockQueue();
 	connections.swap(conns);
 }
 
 void ModuleSQL::OnUnloadModule(Module* mod)
 {
-	SQLerror err(SQL_BAD_DBID);
-	Dispatcher->LockQueue();
-	unsigned int i = qq.size();
-	while (i > 0)
+	for (ConnMap::iterator i = connections.begin(); i != connections.end(); ++i)
 	{
-		i--;
-		if (qq[i].q->creator == mod)
+		SQLConnection* conn = i->second;
+		for (std::vector<MySQLWorker*>::iterator j = conn->workers.begin(); j != conn->workers.end(); ++j)
 		{
-			if (i == 0)
-			{
-				// need to wait until the query is done
-				// (the result will be discarded)
-				qq[i].c->lock.Lock();
-				qq[i].c->lock.Unlock();
-			}
-			qq[i].q->OnError(err);
-			delete qq[i].q;
-			qq.erase(qq.begin() + i);
+			(*j)->CancelQueries(mod);
+			// clean up any result queue entries
+			(*j)->OnNotify();
 		}
 	}
-	Dispatcher->UnlockQueue();
-	// clean up any result queue entries
-	Dispatcher->OnNotify();
+}
+
+ModResult ModuleSQL::OnStats(char symbol, User* user, string_list& results)
+{
+	if (symbol != 'Q')
+		return MOD_RES_PASSTHRU;
+
+	for (ConnMap::iterator i = connections.begin(); i != connections.end(); ++i)
+		results.push_back("249 " + user->nick + " :mysql " + i->first + " " + i->second->GetStats());
+	return MOD_RES_PASSTHRU;
 }
 
 Version ModuleSQL::GetVersion()
@@ -479,30 +765,36 @@ Version ModuleSQL::GetVersion()
 	return Version("MySQL support", VF_VENDOR);
 }
 
-void DispatcherThread::Run()
+void MySQLWorker::Run()
 {
 	this->LockQueue();
 	while (!this->GetExitFlag())
 	{
-		if (!Parent->qq.empty())
+		if (!qq.empty())
 		{
-			QQueueItem i = Parent->qq.front();
-			i.c->lock.Lock();
+			QQueueItem i = qq.front();
+			lock.Lock();
 			this->UnlockQueue();
-			MySQLresult* res = i.c->DoBlockingQuery(i.query);
-			i.c->lock.Unlock();
+			MySQLresult* res;
+			if (i.deadline && time(NULL) > i.deadline)
+			{
+				SQLerror e(SQL_QSEND_FAIL, "Query timed out while queued");
+				res = new MySQLresult(e);
+			}
+			else
+				res = (i.prepared ? DoPreparedQuery(i.query, i.params) : DoBlockingQuery(i.query));
+			lock.Unlock();
 
 			/*
 			 * At this point, the main thread could be working on:
-			 *  Rehash - delete i.c out from under us. We don't care about that.
 			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
 			 */
 
 			this->LockQueue();
-			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
+			if (!qq.empty() && qq.front().q == i.q)
 			{
-				Parent->qq.pop_front();
-				Parent->rq.push_back(RQueueItem(i.q, res));
+				qq.pop_front();
+				rq.push_back(RQueueItem(i.q, res, i.queued));
 				NotifyParent();
 			}
 			else
@@ -520,13 +812,15 @@ void DispatcherThread::Run()
 		}
 	}
 	this->UnlockQueue();
+	mysql_thread_end();
 }
 
-void DispatcherThread::OnNotify()
+void MySQLWorker::OnNotify()
 {
 	// this could unlock during the dispatch, but OnResult isn't expected to take that long
 	this->LockQueue();
-	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
+	const uint64_t now = ModuleSQL::Now();
+	for(ResultQueue::iterator i = rq.begin(); i != rq.end(); i++)
 	{
 		MySQLresult* res = i->r;
 		if (res->err.id == SQL_NO_ERROR)
@@ -535,8 +829,9 @@ void DispatcherThread::OnNotify()
 			i->q->OnError(res->err);
 		delete i->q;
 		delete i->r;
+		pool->AddLatency(now > i->queued ? now - i->queued : 0);
 	}
-	Parent->rq.clear();
+	rq.clear();
 	this->UnlockQueue();
 }
 
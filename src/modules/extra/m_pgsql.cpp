@@ -67,8 +67,20 @@ class ReconnectTimer : public Timer
 struct QueueItem
 {
 	SQLQuery* c;
+	/** The query, or the statement text if it is run as a prepared statement
+	 */
 	std::string q;
-	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q) {}
+	/** Whether to run the query as a cached prepared statement
+	 */
+	bool prepared;
+	/** Values to bind to the statement
+	 */
+	ParamL params;
+	/** Name of the statement while it is being prepared, before the query is sent
+	 */
+	std::string preparing;
+	QueueItem(SQLQuery* C, const std::string& Q) : c(C), q(Q), prepared(false) {}
+	QueueItem(SQLQuery* C, const std::string& Q, const ParamL& P) : c(C), q(Q), prepared(true), params(P) {}
 };
 
 /** PgSQLresult is a subclass of the mostly-pure-virtual class SQLresult.
@@ -139,6 +151,29 @@ class PgSQLresult : public SQLResult
  */
 class SQLConn : public SQLProvider, public EventHandler
 {
+	/** Names of the statements prepared in this session, by statement text
+	 */
+	std::map<std::string, std::string> statements;
+
+	/** Conversions of query formats to statements
+	 */
+	SQLFormatCache formats;
+
+	/** Send the query of a prepared statement
+	 */
+	bool SendPrepared(const QueueItem& req, const std::string& stmtname)
+	{
+		std::vector<const char*> values(req.params.size());
+		std::vector<int> lengths(req.params.size());
+		for (unsigned int i = 0; i < req.params.size(); i++)
+		{
+			values[i] = req.params[i].c_str();
+			lengths[i] = req.params[i].length();
+		}
+		return PQsendQueryPrepared(sql, stmtname.c_str(), values.size(), values.empty() ? NULL : &values[0],
+			lengths.empty() ? NULL : &lengths[0], NULL, 0);
+	}
+
  public:
 	reference<ConfigTag> conf;	/* The <database> entry */
 	std::deque<QueueItem> queue;
@@ -147,7 +182,7 @@ class SQLConn : public SQLProvider, public EventHandler
 	QueueItem		qinprog;	/* If there is currently a query in progress */
 
 	SQLConn(Module* Creator, ConfigTag* tag)
-	: SQLProvider(Creator, "SQL/" + tag->getString("id")), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, "")
+	: SQLProvider(Creator, "SQL/" + tag->getString("id")), formats(true), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, "")
 	{
 		if (!DoConnect())
 		{
@@ -307,6 +342,33 @@ restart:
 					result = temp;
 				}
 
+				if (!qinprog.preparing.empty())
+				{
+					/* The statement is ready, now send the query itself */
+					const std::string stmtname = qinprog.preparing;
+					qinprog.preparing.clear();
+					if (PQresultStatus(result) != PGRES_COMMAND_OK)
+					{
+						SQLerror err(SQL_QSEND_FAIL, PQresultErrorMessage(result));
+						qinprog.c->OnError(err);
+					}
+					else
+					{
+						statements[qinprog.q] = stmtname;
+						if (SendPrepared(qinprog, stmtname))
+						{
+							PQclear(result);
+							goto restart;
+						}
+						SQLerror err(SQL_QSEND_FAIL, PQerrorMessage(sql));
+						qinprog.c->OnError(err);
+					}
+					PQclear(result);
+					delete qinprog.c;
+					qinprog = QueueItem(NULL, "");
+					goto restart;
+				}
+
 				/* ..and the result */
 				PgSQLresult reply(result);
 				switch(PQresultStatus(result))
@@ -386,20 +448,34 @@ restart:
 	}
 
 	void submit(SQLQuery *req, const std::string& q)
+	{
+		submit(QueueItem(req, q));
+	}
+
+	void submit(const QueueItem& item)
 	{
 		if (qinprog.q.empty())
 		{
-			DoQuery(QueueItem(req,q));
+			DoQuery(item);
 		}
 		else
 		{
 			// wait your turn.
-			queue.push_back(QueueItem(req,q));
+			queue.push_back(item);
 		}
 	}
 
 	void submit(SQLQuery *req, const std::string& q, const ParamL& p)
 	{
+		const SQLFormat& format = formats.Get(q, false);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			submit(QueueItem(req, format.statement, values));
+			return;
+		}
+
 		std::string res;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
@@ -429,6 +505,15 @@ restart:
 
 	void submit(SQLQuery *req, const std::string& q, const ParamM& p)
 	{
+		const SQLFormat& format = formats.Get(q, true);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			submit(QueueItem(req, format.statement, values));
+			return;
+		}
+
 		std::string res;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
@@ -473,7 +558,33 @@ restart:
 			return;
 		}
 
-		if(PQsendQuery(sql, req.q.c_str()))
+		bool sent;
+		if (!req.prepared)
+		{
+			sent = PQsendQuery(sql, req.q.c_str());
+		}
+		else
+		{
+			std::map<std::string, std::string>::const_iterator it = statements.find(req.q);
+			if (it != statements.end())
+			{
+				sent = SendPrepared(req, it->second);
+			}
+			else
+			{
+				// Prepare the statement first, the query is sent once it is ready
+				std::string stmtname = "inspircd" + ConvToStr(statements.size() + 1);
+				sent = PQsendPrepare(sql, stmtname.c_str(), req.q.c_str(), req.params.size(), NULL);
+				if (sent)
+				{
+					qinprog = req;
+					qinprog.preparing = stmtname;
+					return;
+				}
+			}
+		}
+
+		if (sent)
 		{
 			qinprog = req;
 		}
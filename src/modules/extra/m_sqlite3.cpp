@@ -32,17 +32,23 @@
 /* $LinkerFlags: pkgconflibs("sqlite3","/libsqlite3.so","-lsqlite3") */
 
 class SQLConn;
+class DispatcherThread;
 typedef std::map<std::string, SQLConn*> ConnMap;
 
 class SQLite3Result : public SQLResult
 {
  public:
+	SQLerror err;
 	int currentrow;
 	int rows;
 	std::vector<std::string> columns;
 	std::vector<SQLEntries> fieldlists;
 
-	SQLite3Result() : currentrow(0), rows(0)
+	SQLite3Result() : err(SQL_NO_ERROR), currentrow(0), rows(0)
+	{
+	}
+
+	SQLite3Result(const SQLerror& e) : err(e), currentrow(0), rows(0)
 	{
 	}
 
@@ -72,84 +78,223 @@ class SQLite3Result : public SQLResult
 	}
 };
 
-class SQLConn : public SQLProvider
+struct QQueueItem
 {
-	sqlite3* conn;
-	reference<ConfigTag> config;
+	SQLQuery* q;
+	/** The query, or the statement text if it is run as a prepared statement
+	 */
+	std::string query;
+	SQLConn* c;
+	/** Time the query was submitted in milliseconds, for the latency statistics
+	 */
+	uint64_t queued;
+	/** Whether to run the query as a cached prepared statement
+	 */
+	bool prepared;
+	/** Values to bind to the statement
+	 */
+	ParamL params;
+	QQueueItem(SQLQuery* Q, const std::string& S, SQLConn* C, uint64_t Queued) : q(Q), query(S), c(C), queued(Queued), prepared(false) {}
+	QQueueItem(SQLQuery* Q, const std::string& S, const ParamL& P, SQLConn* C, uint64_t Queued) : q(Q), query(S), c(C), queued(Queued), prepared(true), params(P) {}
+};
+
+struct RQueueItem
+{
+	SQLQuery* q;
+	SQLite3Result* r;
+	uint64_t queued;
+	RQueueItem(SQLQuery* Q, SQLite3Result* R, uint64_t Queued) : q(Q), r(R), queued(Queued) {}
+};
+
+typedef std::deque<QQueueItem> QueryQueue;
+typedef std::deque<RQueueItem> ResultQueue;
 
+/** SQLite3 module, queries are run on a worker thread so disk I/O doesn't block the server
+ */
+class ModuleSQLite3 : public Module
+{
  public:
-	SQLConn(Module* Parent, ConfigTag* tag) : SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag)
-	{
-		std::string host = tag->getString("hostname");
-		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
-			conn = NULL;
-		}
-	}
+	DispatcherThread* Dispatcher;
+	QueryQueue qq;       // MUST HOLD MUTEX
+	ResultQueue rq;      // MUST HOLD MUTEX
+	ConnMap conns;       // main thread only
 
-	~SQLConn()
+	/** Statistics, main thread only
+	 */
+	unsigned long peakqueue;
+	unsigned long completed;
+	uint64_t totallatency;
+	uint64_t maxlatency;
+
+	ModuleSQLite3();
+	void init() CXX11_OVERRIDE;
+	~ModuleSQLite3();
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE;
+	Version GetVersion() CXX11_OVERRIDE;
+
+	static uint64_t Now()
 	{
-		sqlite3_interrupt(conn);
-		sqlite3_close(conn);
+		return (static_cast<uint64_t>(ServerInstance->Time()) * 1000) + (ServerInstance->Time_ns() / 1000000);
 	}
+};
+
+class DispatcherThread : public SocketThread
+{
+ private:
+	ModuleSQLite3* const Parent;
+ public:
+	DispatcherThread(ModuleSQLite3* CreatorModule) : Parent(CreatorModule) { }
+	~DispatcherThread() { }
+	void Run();
+	void OnNotify();
+};
+
+class SQLConn : public SQLProvider
+{
+	typedef std::map<std::string, sqlite3_stmt*> StatementMap;
+
+	sqlite3* conn;
+	reference<ConfigTag> config;
+
+	/** Prepared statements by statement text, dispatcher thread only
+	 */
+	StatementMap statements;
 
-	void Query(SQLQuery* query, const std::string& q)
+	/** Conversions of query formats to statements, main thread only
+	 */
+	SQLFormatCache formats;
+
+	/** Read the rows of an executed statement
+	 */
+	SQLite3Result* Fetch(sqlite3_stmt* stmt)
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
-		{
-			SQLerror error(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
-			return;
-		}
+		SQLite3Result* res = new SQLite3Result;
 		int cols = sqlite3_column_count(stmt);
-		res.columns.resize(cols);
+		res->columns.resize(cols);
 		for(int i=0; i < cols; i++)
 		{
-			res.columns[i] = sqlite3_column_name(stmt, i);
+			res->columns[i] = sqlite3_column_name(stmt, i);
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
-				res.fieldlists.resize(res.rows + 1);
-				res.fieldlists[res.rows].resize(cols);
+				res->fieldlists.resize(res->rows + 1);
+				res->fieldlists[res->rows].resize(cols);
 				for(int i=0; i < cols; i++)
 				{
 					const char* txt = (const char*)sqlite3_column_text(stmt, i);
 					if (txt)
-						res.fieldlists[res.rows][i] = SQLEntry(txt);
+						res->fieldlists[res->rows][i] = SQLEntry(txt);
 				}
-				res.rows++;
+				res->rows++;
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQLerror error(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				res->err = SQLerror(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
 				break;
 			}
 		}
+		return res;
+	}
+
+	void Queue(const QQueueItem& item);
+
+ public:
+	/** Held by the dispatcher thread while it is using the connection
+	 */
+	Mutex lock;
+
+	SQLConn(Module* Parent, ConfigTag* tag) : SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag), formats(false)
+	{
+		std::string host = tag->getString("hostname");
+		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
+			conn = NULL;
+		}
+	}
+
+	~SQLConn()
+	{
+		for (StatementMap::iterator i = statements.begin(); i != statements.end(); ++i)
+			sqlite3_finalize(i->second);
+		sqlite3_interrupt(conn);
+		sqlite3_close(conn);
+	}
+
+	ModuleSQLite3* Parent()
+	{
+		return (ModuleSQLite3*)(Module*)creator;
+	}
+
+	/** Run a query, called from the dispatcher thread with lock held
+	 */
+	SQLite3Result* DoBlockingQuery(const std::string& q)
+	{
+		if (!conn)
+			return new SQLite3Result(SQLerror(SQL_BAD_CONN, "Database is not open"));
+
+		sqlite3_stmt *stmt;
+		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
+		if (err != SQLITE_OK)
+			return new SQLite3Result(SQLerror(SQL_QSEND_FAIL, sqlite3_errmsg(conn)));
+
+		SQLite3Result* res = Fetch(stmt);
 		sqlite3_finalize(stmt);
+		return res;
+	}
+
+	/** Run a cached prepared statement, preparing it on first use. Called from the dispatcher thread with lock held
+	 */
+	SQLite3Result* DoPreparedQuery(const std::string& q, const ParamL& p)
+	{
+		if (!conn)
+			return new SQLite3Result(SQLerror(SQL_BAD_CONN, "Database is not open"));
+
+		StatementMap::iterator it = statements.find(q);
+		if (it == statements.end())
+		{
+			sqlite3_stmt *stmt;
+			if (sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL) != SQLITE_OK)
+				return new SQLite3Result(SQLerror(SQL_QSEND_FAIL, sqlite3_errmsg(conn)));
+			it = statements.insert(std::make_pair(q, stmt)).first;
+		}
+
+		sqlite3_stmt* stmt = it->second;
+		for (unsigned int i = 0; i < p.size(); i++)
+			sqlite3_bind_text(stmt, i + 1, p[i].data(), p[i].length(), SQLITE_TRANSIENT);
+
+		SQLite3Result* res = Fetch(stmt);
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		return res;
 	}
 
 	void submit(SQLQuery* query, const std::string& q)
 	{
-		Query(query, q);
-		delete query;
+		Queue(QQueueItem(query, q, this, ModuleSQLite3::Now()));
 	}
 
 	void submit(SQLQuery* query, const std::string& q, const ParamL& p)
 	{
+		const SQLFormat& format = formats.Get(q, false);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			Queue(QQueueItem(query, format.statement, values, this, ModuleSQLite3::Now()));
+			return;
+		}
+
 		std::string res;
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
@@ -171,6 +316,15 @@ class SQLConn : public SQLProvider
 
 	void submit(SQLQuery* query, const std::string& q, const ParamM& p)
 	{
+		const SQLFormat& format = formats.Get(q, true);
+		if (format.preparable)
+		{
+			ParamL values;
+			format.GetValues(p, values);
+			Queue(QQueueItem(query, format.statement, values, this, ModuleSQLite3::Now()));
+			return;
+		}
+
 		std::string res;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
@@ -197,45 +351,201 @@ class SQLConn : public SQLProvider
 	}
 };
 
-class ModuleSQLite3 : public Module
+void SQLConn::Queue(const QQueueItem& item)
 {
-	ConnMap conns;
+	Parent()->Dispatcher->LockQueue();
+	Parent()->qq.push_back(item);
+	Parent()->peakqueue = std::max<unsigned long>(Parent()->peakqueue, Parent()->qq.size());
+	Parent()->Dispatcher->UnlockQueueWakeup();
+}
 
- public:
-	~ModuleSQLite3()
+ModuleSQLite3::ModuleSQLite3()
+	: Dispatcher(NULL), peakqueue(0), completed(0), totallatency(0), maxlatency(0)
+{
+}
+
+void ModuleSQLite3::init()
+{
+	Dispatcher = new DispatcherThread(this);
+	ServerInstance->Threads->Start(Dispatcher);
+}
+
+ModuleSQLite3::~ModuleSQLite3()
+{
+	if (Dispatcher)
+	{
+		Dispatcher->join();
+		Dispatcher->OnNotify();
+		delete Dispatcher;
+	}
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		ClearConns();
+		delete i->second;
 	}
+}
 
-	void ClearConns()
+void ModuleSQLite3::ReadConfig(ConfigStatus& status)
+{
+	ConnMap newconns;
+	ConfigTagList tags = ServerInstance->Config->ConfTags("database");
+	for(ConfigIter i = tags.first; i != tags.second; i++)
 	{
-		for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+		if (i->second->getString("module", "sqlite") != "sqlite")
+			continue;
+		std::string id = i->second->getString("id");
+		ConnMap::iterator curr = conns.find(id);
+		if (curr == conns.end())
 		{
-			SQLConn* conn = i->second;
-			ServerInstance->Modules->DelService(*conn);
-			delete conn;
+			SQLConn* conn = new SQLConn(this, i->second);
+			newconns.insert(std::make_pair(id, conn));
+			ServerInstance->Modules->AddService(*conn);
+		}
+		else
+		{
+			newconns.insert(*curr);
+			conns.erase(curr);
 		}
-		conns.clear();
 	}
 
-	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	// now clean up the deleted databases
+	Dispatcher->LockQueue();
+	SQLerror err(SQL_BAD_DBID);
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		ClearConns();
-		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
-		for(ConfigIter i = tags.first; i != tags.second; i++)
+		ServerInstance->Modules->DelService(*i->second);
+		// it might be running a query on this database. Wait for that to complete
+		i->second->lock.Lock();
+		i->second->lock.Unlock();
+		// now remove all active queries to this DB
+		for (size_t j = qq.size(); j > 0; j--)
 		{
-			if (i->second->getString("module", "sqlite") != "sqlite")
-				continue;
-			SQLConn* conn = new SQLConn(this, i->second);
-			conns.insert(std::make_pair(i->second->getString("id"), conn));
-			ServerInstance->Modules->AddService(*conn);
+			size_t k = j - 1;
+			if (qq[k].c == i->second)
+			{
+				qq[k].q->OnError(err);
+				delete qq[k].q;
+				qq.erase(qq.begin() + k);
+			}
 		}
+		// finally, nuke the connection
+		delete i->second;
 	}
+	Dispatcher->UnlockQueue();
+	conns.swap(newconns);
+}
 
-	Version GetVersion() CXX11_OVERRIDE
+void ModuleSQLite3::OnUnloadModule(Module* mod)
+{
+	SQLerror err(SQL_BAD_DBID);
+	Dispatcher->LockQueue();
+	unsigned int i = qq.size();
+	while (i > 0)
 	{
-		return Version("sqlite3 provider", VF_VENDOR);
+		i--;
+		if (qq[i].q->creator == mod)
+		{
+			if (i == 0)
+			{
+				// need to wait until the query is done
+				// (the result will be discarded)
+				qq[i].c->lock.Lock();
+				qq[i].c->lock.Unlock();
+			}
+			qq[i].q->OnError(err);
+			delete qq[i].q;
+			qq.erase(qq.begin() + i);
+		}
 	}
-};
+	Dispatcher->UnlockQueue();
+	// clean up any result queue entries
+	Dispatcher->OnNotify();
+}
+
+ModResult ModuleSQLite3::OnStats(char symbol, User* user, string_list& results)
+{
+	if (symbol != 'Q')
+		return MOD_RES_PASSTHRU;
+
+	Dispatcher->LockQueue();
+	const size_t queued = qq.size();
+	Dispatcher->UnlockQueue();
+
+	results.push_back("249 " + user->nick + " :sqlite3 queue " + ConvToStr(queued) + " peak " + ConvToStr(peakqueue)
+		+ " queries " + ConvToStr(completed) + " latency avg " + ConvToStr(completed ? totallatency / completed : 0)
+		+ "ms max " + ConvToStr(maxlatency) + "ms");
+	return MOD_RES_PASSTHRU;
+}
+
+Version ModuleSQLite3::GetVersion()
+{
+	return Version("sqlite3 provider", VF_VENDOR);
+}
+
+void DispatcherThread::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (!Parent->qq.empty())
+		{
+			QQueueItem i = Parent->qq.front();
+			i.c->lock.Lock();
+			this->UnlockQueue();
+			SQLite3Result* res = (i.prepared ? i.c->DoPreparedQuery(i.query, i.params) : i.c->DoBlockingQuery(i.query));
+			i.c->lock.Unlock();
+
+			/*
+			 * At this point, the main thread could be working on:
+			 *  Rehash - delete i.c out from under us. We don't care about that.
+			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
+			 */
+
+			this->LockQueue();
+			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
+			{
+				Parent->qq.pop_front();
+				Parent->rq.push_back(RQueueItem(i.q, res, i.queued));
+				NotifyParent();
+			}
+			else
+			{
+				// UnloadModule ate the query
+				delete res;
+			}
+		}
+		else
+		{
+			/* We know the queue is empty, we can safely hang this thread until
+			 * something happens
+			 */
+			this->WaitForQueue();
+		}
+	}
+	this->UnlockQueue();
+}
+
+void DispatcherThread::OnNotify()
+{
+	// this could unlock during the dispatch, but OnResult isn't expected to take that long
+	this->LockQueue();
+	const uint64_t now = ModuleSQLite3::Now();
+	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
+	{
+		SQLite3Result* res = i->r;
+		if (res->err.id == SQL_NO_ERROR)
+			i->q->OnResult(*res);
+		else
+			i->q->OnError(res->err);
+		delete i->q;
+		delete i->r;
+
+		const uint64_t latency = (now > i->queued ? now - i->queued : 0);
+		Parent->completed++;
+		Parent->totallatency += latency;
+		Parent->maxlatency = std::max(Parent->maxlatency, latency);
+	}
+	Parent->rq.clear();
+	this->UnlockQueue();
+}
 
 MODULE_INIT(ModuleSQLite3)
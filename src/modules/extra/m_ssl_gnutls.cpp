@@ -64,6 +64,15 @@
 #define GNUTLS_NEW_PRIO_API
 #endif
 
+#if (GNUTLS_VERSION_MAJOR > 2 || (GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR >= 10))
+#define GNUTLS_HAS_SESSION_TICKETS
+#endif
+
+// Older versions need thread callbacks set up by the application
+#if (GNUTLS_VERSION_MAJOR >= 3)
+#define GNUTLS_HAS_THREADS
+#endif
+
 #if(GNUTLS_VERSION_MAJOR < 2)
 typedef gnutls_certificate_credentials_t gnutls_certificate_credentials;
 typedef gnutls_dh_params_t gnutls_dh_params;
@@ -78,6 +87,9 @@ typedef gnutls_retr2_st cert_cb_last_param_type;
 typedef gnutls_retr_st cert_cb_last_param_type;
 #endif
 
+/** Runs the handshakes of inbound sessions if enabled, NULL otherwise */
+static SSLHandshakePool* HandshakePool = NULL;
+
 class RandGen : public HandlerBase2<void, char*, size_t>
 {
  public:
@@ -446,6 +458,173 @@ namespace GnuTLS
 		}
 	};
 
+	/** Server side session cache used to resume sessions by their id.
+	 * When full, the oldest entries are dropped first; GnuTLS checks expiry itself.
+	 */
+	class SessionCache
+	{
+		typedef std::map<std::string, std::string> EntryMap;
+
+		/** Session data indexed by session id
+		 */
+		EntryMap entries;
+
+		/** Session ids in the order they were stored
+		 */
+		std::deque<std::string> order;
+
+		/** Maximum number of sessions to store, 0 to disable the cache
+		 */
+		const unsigned long maxsize;
+
+		/** Sessions can be stored and resumed by the handshake threads
+		 */
+		Mutex lock;
+
+		static std::string ToString(const gnutls_datum_t& datum)
+		{
+			return std::string(reinterpret_cast<const char*>(datum.data), datum.size);
+		}
+
+		static int Store(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+		{
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			const std::string id = ToString(key);
+			cache->lock.Lock();
+			if (cache->entries.find(id) == cache->entries.end())
+			{
+				while (cache->order.size() >= cache->maxsize)
+				{
+					cache->entries.erase(cache->order.front());
+					cache->order.pop_front();
+				}
+				cache->order.push_back(id);
+			}
+			cache->entries[id] = ToString(data);
+			cache->lock.Unlock();
+			return 0;
+		}
+
+		static gnutls_datum_t Retrieve(void* ptr, gnutls_datum_t key)
+		{
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			gnutls_datum_t ret = { NULL, 0 };
+			cache->lock.Lock();
+			EntryMap::const_iterator it = cache->entries.find(ToString(key));
+			if (it != cache->entries.end())
+			{
+				// GnuTLS takes ownership of the returned data
+				ret.data = static_cast<unsigned char*>(gnutls_malloc(it->second.size()));
+				if (ret.data)
+				{
+					memcpy(ret.data, it->second.data(), it->second.size());
+					ret.size = it->second.size();
+				}
+			}
+			cache->lock.Unlock();
+			return ret;
+		}
+
+		static int Remove(void* ptr, gnutls_datum_t key)
+		{
+			SessionCache* cache = static_cast<SessionCache*>(ptr);
+			const std::string id = ToString(key);
+			int ret = -1;
+			cache->lock.Lock();
+			if (cache->entries.erase(id))
+			{
+				cache->order.erase(std::find(cache->order.begin(), cache->order.end(), id));
+				ret = 0;
+			}
+			cache->lock.Unlock();
+			return ret;
+		}
+
+	 public:
+		SessionCache(unsigned long size, unsigned int timeout)
+			: maxsize(size)
+			, expiration(timeout)
+		{
+		}
+
+		/** How long sessions can be resumed for, in seconds
+		 */
+		const unsigned int expiration;
+
+		/** Let the given server session be stored in and resumed from this cache
+		 */
+		void SetupSession(gnutls_session_t sess)
+		{
+			gnutls_db_set_cache_expiration(sess, expiration);
+			if (!maxsize)
+				return;
+
+			gnutls_db_set_ptr(sess, this);
+			gnutls_db_set_store_function(sess, Store);
+			gnutls_db_set_retrieve_function(sess, Retrieve);
+			gnutls_db_set_remove_function(sess, Remove);
+		}
+
+		size_t size()
+		{
+			lock.Lock();
+			size_t ret = entries.size();
+			lock.Unlock();
+			return ret;
+		}
+	};
+
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+	/** Key used to encrypt session tickets, replaced after a configurable time.
+	 * GnuTLS uses a single key per session so tickets issued with an old key are
+	 * no longer accepted once it is replaced.
+	 */
+	class TicketKey
+	{
+		gnutls_datum_t key;
+
+		/** When the key was made */
+		time_t created;
+
+		/** How long a key is used for, in seconds */
+		const long lifetime;
+
+		void Generate()
+		{
+			gnutls_datum_t newkey;
+			if (gnutls_session_ticket_key_generate(&newkey) < 0)
+				return;
+
+			gnutls_free(key.data);
+			key = newkey;
+			created = ServerInstance->Time();
+		}
+
+	 public:
+		TicketKey(long rotate)
+			: created(ServerInstance->Time())
+			, lifetime(rotate)
+		{
+			ThrowOnError(gnutls_session_ticket_key_generate(&key), "Unable to generate session ticket key");
+		}
+
+		~TicketKey()
+		{
+			gnutls_free(key.data);
+		}
+
+		/** Enable tickets on the given server session, rotating the key first if it is too old.
+		 * If a new key can't be made the current one stays in use.
+		 */
+		void SetupSession(gnutls_session_t sess)
+		{
+			if (ServerInstance->Time() - created >= lifetime)
+				Generate();
+			gnutls_session_ticket_enable_server(sess, &key);
+		}
+	};
+#endif
+
 	class Profile : public refcountbase
 	{
 		/** Name of this profile
@@ -468,15 +647,38 @@ namespace GnuTLS
 		 */
 		Priority priority;
 
+		/** Sessions that clients can resume by id
+		 */
+		SessionCache sessioncache;
+
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+		/** Session ticket key, NULL if tickets are disabled
+		 */
+		std::auto_ptr<TicketKey> ticketkey;
+#endif
+
+		/** Number of inbound handshakes done in full and by resuming an earlier session
+		 */
+		unsigned long fullhandshakes;
+		unsigned long resumed;
+
 		Profile(const std::string& profilename, const std::string& certstr, const std::string& keystr,
 				std::auto_ptr<DHParams>& DH, unsigned int mindh, const std::string& hashstr,
-				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL)
+				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL,
+				unsigned long cachesize, unsigned int cachetimeout, bool tickets, long ticketrotate)
 			: name(profilename)
 			, x509cred(certstr, keystr)
 			, min_dh_bits(mindh)
 			, hash(hashstr)
 			, priority(priostr)
+			, sessioncache(cachesize, cachetimeout)
+			, fullhandshakes(0)
+			, resumed(0)
 		{
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			if (tickets)
+				ticketkey.reset(new TicketKey(ticketrotate));
+#endif
 			x509cred.SetDH(DH);
 			x509cred.SetCA(CA, CRL);
 		}
@@ -524,7 +726,13 @@ namespace GnuTLS
 					crl.reset(new X509CRL(ReadFile(filename)));
 			}
 
-			return new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl);
+			// Let clients skip the full handshake when reconnecting, either from the session cache or with a ticket
+			unsigned long cachesize = tag->getInt("sessioncache", 20480, 0);
+			unsigned int cachetimeout = tag->getDuration("sessiontimeout", 300, 1);
+			bool tickets = tag->getBool("tickets", true);
+			long ticketrotate = tag->getDuration("ticketrotate", 3600, 60);
+
+			return new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl, cachesize, cachetimeout, tickets, ticketrotate);
 		}
 
 		/** Set up the given session with the settings in this profile
@@ -536,19 +744,55 @@ namespace GnuTLS
 			gnutls_dh_set_prime_bits(sess, min_dh_bits);
 		}
 
+		/** Set up session resumption on the given server session
+		 */
+		void SetupServerSession(gnutls_session_t sess)
+		{
+			sessioncache.SetupSession(sess);
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			if (ticketkey.get())
+				ticketkey->SetupSession(sess);
+#endif
+		}
+
+		void CountHandshake(bool reused)
+		{
+			if (reused)
+				resumed++;
+			else
+				fullhandshakes++;
+		}
+
+		std::string GetStats()
+		{
+			return "full handshakes " + ConvToStr(fullhandshakes) + " resumed " + ConvToStr(resumed) + " cached sessions " + ConvToStr(sessioncache.size());
+		}
+
 		const std::string& GetName() const { return name; }
 		X509Credentials& GetX509Credentials() { return x509cred; }
 		gnutls_digest_algorithm_t GetHash() const { return hash.get(); }
 	};
 }
 
-class GnuTLSIOHook : public SSLIOHook
+class GnuTLSIOHook : public SSLIOHook, public SSLHandshakeJob
 {
  private:
 	gnutls_session_t sess;
 	issl_status status;
 	reference<GnuTLS::Profile> profile;
 
+	/** True if the session was accepted by us, false if we connected out
+	 */
+	const bool inbound;
+
+	/** Socket whose handshake is running on a handshake thread
+	 */
+	StreamSocket* handshakesock;
+
+	/** Return value of the last handshake step
+	 */
+	int handshakeret;
+
 	void InitSession(StreamSocket* user, bool me_server)
 	{
 		gnutls_init(&sess, me_server ? GNUTLS_SERVER : GNUTLS_CLIENT);
@@ -559,7 +803,10 @@ class GnuTLSIOHook : public SSLIOHook
 		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
 
 		if (me_server)
+		{
 			gnutls_certificate_server_set_request(sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
+			profile->SetupServerSession(sess);
+		}
 	}
 
 	void CloseSession()
@@ -576,8 +823,29 @@ class GnuTLSIOHook : public SSLIOHook
 
 	bool Handshake(StreamSocket* user)
 	{
-		int ret = gnutls_handshake(this->sess);
+#ifdef GNUTLS_HAS_THREADS
+		// Only inbound handshakes are sent to the handshake threads, they're what arrives in storms
+		if ((HandshakePool) && (inbound) && (HandshakePool->Queue(this)))
+		{
+			handshakesock = user;
+			if (this->status == ISSL_NONE)
+				this->status = ISSL_HANDSHAKING_READ;
+			gnutls_transport_set_push_function(sess, gnutls_push_direct);
+			gnutls_transport_set_pull_function(sess, gnutls_pull_direct);
+			SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+			return false;
+		}
+#endif
+
+		Run();
+		return HandshakeDone(user);
+	}
 
+	/** Act on the result of the last handshake step
+	 */
+	bool HandshakeDone(StreamSocket* user)
+	{
+		int ret = handshakeret;
 		if (ret < 0)
 		{
 			if(ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
@@ -611,6 +879,9 @@ class GnuTLSIOHook : public SSLIOHook
 			// Change the seesion state
 			this->status = ISSL_HANDSHAKEN;
 
+			if (inbound)
+				profile->CountHandshake(gnutls_session_is_resumed(sess));
+
 			VerifyCertificate();
 
 			// Finish writing, if any left
@@ -789,20 +1060,72 @@ info_done_dealloc:
 		return rv;
 	}
 
+	/* Transport functions used while a handshake thread runs the session, these must not use the socket engine */
+	static ssize_t gnutls_pull_direct(gnutls_transport_ptr_t session_wrap, void* buffer, size_t size)
+	{
+		StreamSocket* sock = reinterpret_cast<StreamSocket*>(session_wrap);
+		int rv = recv(sock->GetFd(), reinterpret_cast<char*>(buffer), size, 0);
+#ifdef _WIN32
+		if (rv < 0)
+		{
+			GnuTLSIOHook* session = static_cast<GnuTLSIOHook*>(sock->GetIOHook());
+			gnutls_transport_set_errno(session->sess, SocketEngine::IgnoreError() ? EAGAIN : errno);
+		}
+#endif
+		return rv;
+	}
+
+	static ssize_t gnutls_push_direct(gnutls_transport_ptr_t session_wrap, const void* buffer, size_t size)
+	{
+		StreamSocket* sock = reinterpret_cast<StreamSocket*>(session_wrap);
+		int rv = send(sock->GetFd(), reinterpret_cast<const char*>(buffer), size, 0);
+#ifdef _WIN32
+		if (rv < 0)
+		{
+			GnuTLSIOHook* session = static_cast<GnuTLSIOHook*>(sock->GetIOHook());
+			gnutls_transport_set_errno(session->sess, SocketEngine::IgnoreError() ? EAGAIN : errno);
+		}
+#endif
+		return rv;
+	}
+
  public:
 	GnuTLSIOHook(IOHookProvider* hookprov, StreamSocket* sock, bool outbound, const reference<GnuTLS::Profile>& sslprofile)
 		: SSLIOHook(hookprov)
 		, sess(NULL)
 		, status(ISSL_NONE)
 		, profile(sslprofile)
+		, inbound(outbound)
+		, handshakesock(NULL)
+		, handshakeret(0)
 	{
 		InitSession(sock, outbound);
 		sock->AddIOHook(this);
 		Handshake(sock);
 	}
 
+	void Run() CXX11_OVERRIDE
+	{
+		handshakeret = gnutls_handshake(this->sess);
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		StreamSocket* user = handshakesock;
+		handshakesock = NULL;
+		gnutls_transport_set_push_function(sess, gnutls_push_wrapper);
+		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
+		HandshakeDone(user);
+
+		// The error has been set on the socket, let it act on it
+		if (this->status == ISSL_CLOSING)
+			user->OnError(I_ERR_OTHER);
+	}
+
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
 	{
+		if (HandshakePool)
+			HandshakePool->Cancel(this);
 		CloseSession();
 	}
 
@@ -815,6 +1138,10 @@ info_done_dealloc:
 			return -1;
 		}
 
+		// A handshake thread owns the session right now
+		if (IsQueued())
+			return 0;
+
 		if (this->status == ISSL_HANDSHAKING_READ || this->status == ISSL_HANDSHAKING_WRITE)
 		{
 			// The handshake isn't finished, try to finish it.
@@ -862,7 +1189,19 @@ info_done_dealloc:
 		return 0;
 	}
 
-	int OnStreamSocketWrite(StreamSocket* user, std::string& sendq) CXX11_OVERRIDE
+	int OnStreamSocketWrite(StreamSocket* user, std::string& buffer) CXX11_OVERRIDE
+	{
+		SendQueue sendq(1);
+		sendq.front().str().swap(buffer);
+		size_t written = 0;
+		int ret = OnStreamSocketWriteV(user, sendq, 0, written);
+		sendq.front().str().swap(buffer);
+		if (ret == 0)
+			buffer.erase(0, written);
+		return ret;
+	}
+
+	int OnStreamSocketWriteV(StreamSocket* user, const SendQueue& sendq, size_t offset, size_t& written) CXX11_OVERRIDE
 	{
 		if (!this->sess)
 		{
@@ -871,6 +1210,9 @@ info_done_dealloc:
 			return -1;
 		}
 
+		if (IsQueued())
+			return 0;
+
 		if (this->status == ISSL_HANDSHAKING_WRITE || this->status == ISSL_HANDSHAKING_READ)
 		{
 			// The handshake isn't finished, try to finish it.
@@ -880,33 +1222,37 @@ info_done_dealloc:
 			return -1;
 		}
 
-		int ret = 0;
-
 		if (this->status == ISSL_HANDSHAKEN)
 		{
-			ret = gnutls_record_send(this->sess, sendq.data(), sendq.length());
-
-			if (ret == (int)sendq.length())
-			{
-				SocketEngine::ChangeEventMask(user, FD_WANT_NO_WRITE);
-				return 1;
-			}
-			else if (ret > 0)
-			{
-				sendq = sendq.substr(ret);
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED || ret == 0)
-			{
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else // (ret < 0)
+			// Hand gnutls_record_send() up to a full record at a time, joining small sendq items
+			SendQueueReader reader(sendq, offset);
+			while (true)
 			{
-				user->SetError(gnutls_strerror(ret));
-				CloseSession();
-				return -1;
+				size_t len;
+				const char* data = reader.Peek(len);
+				if (!len)
+				{
+					SocketEngine::ChangeEventMask(user, FD_WANT_NO_WRITE);
+					return 1;
+				}
+
+				int ret = gnutls_record_send(this->sess, data, len);
+				if (ret > 0)
+				{
+					reader.Skip(ret);
+					written += ret;
+				}
+				else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED || ret == 0)
+				{
+					SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
+					return 0;
+				}
+				else // (ret < 0)
+				{
+					user->SetError(gnutls_strerror(ret));
+					CloseSession();
+					return -1;
+				}
 			}
 		}
 
@@ -978,6 +1324,8 @@ class GnuTLSIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new GnuTLSIOHook(this, sock, false, profile);
 	}
+
+	GnuTLS::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLGnuTLS : public Module
@@ -1058,6 +1406,18 @@ class ModuleSSLGnuTLS : public Module
 	{
 		ReadProfiles();
 		ServerInstance->GenRandom = &randhandler;
+
+		// Handshake threads can only be set up on load as sessions may be queued on them
+		ConfigTag* tag = ServerInstance->Config->ConfValue("gnutls");
+		unsigned int threads = tag->getInt("handshakethreads", 0, 0, 64);
+		if (threads)
+		{
+#ifdef GNUTLS_HAS_THREADS
+			HandshakePool = new SSLHandshakePool(threads, tag->getInt("maxhandshakes", 1024, 1));
+#else
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Handshake threads need GnuTLS 3.0 or newer, running handshakes on the main thread");
+#endif
+		}
 	}
 
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
@@ -1077,6 +1437,8 @@ class ModuleSSLGnuTLS : public Module
 
 	~ModuleSSLGnuTLS()
 	{
+		delete HandshakePool;
+		HandshakePool = NULL;
 		ServerInstance->GenRandom = &ServerInstance->HandleGenRandom;
 	}
 
@@ -1100,6 +1462,23 @@ class ModuleSSLGnuTLS : public Module
 		return Version("Provides SSL support for clients", VF_VENDOR);
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 't')
+			return MOD_RES_PASSTHRU;
+
+		if (HandshakePool)
+			results.push_back("249 " + user->nick + " :gnutls " + HandshakePool->GetStats());
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			GnuTLS::Profile* profile = (*i)->GetProfile();
+			results.push_back("249 " + user->nick + " :gnutls profile " + profile->GetName() + " " + profile->GetStats());
+		}
+
+		// Let other SSL modules add their statistics as well
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
 		IOHook* hook = user->eh.GetIOHook();
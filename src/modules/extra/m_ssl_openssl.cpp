@@ -34,6 +34,12 @@
 #include "iohook.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#else
+# include <openssl/hmac.h>
+#endif
 #include "modules/ssl.h"
 
 #ifdef _WIN32
@@ -53,7 +59,25 @@
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
+/** Number of sessions currently using kernel TLS for sending, and the total since the module was loaded */
+static unsigned long KTLSSessions = 0;
+static unsigned long KTLSTotal = 0;
+
+/** Runs the handshakes of inbound sessions if enabled, NULL otherwise */
+static SSLHandshakePool* HandshakePool = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/** Locks OpenSSL needs before 1.1.0 to be used from the handshake threads */
+static Mutex* CryptoLocks = NULL;
+
+static void OnCryptoLock(int mode, int n, const char* file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		CryptoLocks[n].Lock();
+	else
+		CryptoLocks[n].Unlock();
+}
+#endif
 
 char* get_error()
 {
@@ -62,6 +86,13 @@ char* get_error()
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX* ctx);
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketHMACContext;
+#else
+typedef HMAC_CTX TicketHMACContext;
+#endif
+static int OnTicketKey(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cctx, TicketHMACContext* hctx, int enc);
+
 namespace OpenSSL
 {
 	class Exception : public ModuleException
@@ -99,6 +130,91 @@ namespace OpenSSL
 		}
 	};
 
+	/** Keys used to encrypt session tickets. Tickets are issued with the newest key,
+	 * which is replaced after a configurable time; tickets made with the key before
+	 * it are still accepted, but the client is sent a new one.
+	 */
+	class TicketKeys
+	{
+	 public:
+		struct Key
+		{
+			unsigned char name[16];
+			unsigned char aeskey[32];
+			unsigned char hmackey[32];
+		};
+
+	 private:
+		/** The current key and the one before it */
+		Key keys[2];
+
+		/** When the current key was made */
+		time_t created;
+
+		/** How long a key is used to issue tickets, in seconds */
+		const long lifetime;
+
+		/** Tickets can be issued and checked by the handshake threads */
+		Mutex lock;
+
+		static bool Generate(Key& key)
+		{
+			return ((RAND_bytes(key.name, sizeof(key.name)) > 0) && (RAND_bytes(key.aeskey, sizeof(key.aeskey)) > 0)
+				&& (RAND_bytes(key.hmackey, sizeof(key.hmackey)) > 0));
+		}
+
+	 public:
+		TicketKeys(long rotate)
+			: created(ServerInstance->Time())
+			, lifetime(rotate)
+		{
+			if ((!Generate(keys[0])) || (!Generate(keys[1])))
+				throw Exception("Couldn't generate session ticket keys");
+		}
+
+		/** Get the key to issue new tickets with, rotating keys first if the current one is too old.
+		 * Called from OpenSSL, so if a new key can't be made the current one stays in use.
+		 */
+		Key GetCurrent()
+		{
+			lock.Lock();
+			Key next;
+			if ((ServerInstance->Time() - created >= lifetime) && (Generate(next)))
+			{
+				keys[1] = keys[0];
+				keys[0] = next;
+				created = ServerInstance->Time();
+			}
+			next = keys[0];
+			lock.Unlock();
+			return next;
+		}
+
+		/** Find the key a ticket was issued with
+		 * @param keyname Name of the key, from the ticket
+		 * @param key Set to the key if it is found
+		 * @param current Set to true if the key is the one new tickets are issued with
+		 * @return True if the key was found, false if it is unknown or has been rotated out
+		 */
+		bool Find(const unsigned char* keyname, Key& key, bool& current)
+		{
+			lock.Lock();
+			bool found = false;
+			for (size_t i = 0; i < 2; ++i)
+			{
+				if (!memcmp(keys[i].name, keyname, sizeof(keys[i].name)))
+				{
+					key = keys[i];
+					current = (i == 0);
+					found = true;
+					break;
+				}
+			}
+			lock.Unlock();
+			return found;
+		}
+	};
+
 	class Context
 	{
 		SSL_CTX* const ctx;
@@ -144,6 +260,52 @@ namespace OpenSSL
 			return SSL_CTX_load_verify_locations(ctx, filename.c_str(), 0);
 		}
 
+		bool EnableKTLS()
+		{
+#ifdef SSL_OP_ENABLE_KTLS
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		void SetSessionCache(unsigned long size, long timeout)
+		{
+			if (size)
+			{
+				SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+				SSL_CTX_sess_set_cache_size(ctx, size);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+				// Most clients just close the connection; don't let that evict their session from the cache
+				SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+			}
+			else
+				SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+			SSL_CTX_set_timeout(ctx, timeout);
+		}
+
+		void SetTicketKeys(TicketKeys* keys)
+		{
+			SSL_CTX_set_app_data(ctx, keys);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, OnTicketKey);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, OnTicketKey);
+#endif
+		}
+
+		void DisableTickets()
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		}
+
+		long GetCachedSessions()
+		{
+			return SSL_CTX_sess_number(ctx);
+		}
+
 		SSL* CreateSession()
 		{
 			return SSL_new(ctx);
@@ -160,11 +322,20 @@ namespace OpenSSL
 		 */
 		DHParams dh;
 
+		/** Session ticket keys, must outlive the contexts
+		 */
+		TicketKeys ticketkeys;
+
 		/** OpenSSL makes us have two contexts, one for servers and one for clients
 		 */
 		Context ctx;
 		Context clictx;
 
+		/** Number of inbound handshakes done in full and by resuming an earlier session
+		 */
+		unsigned long fullhandshakes;
+		unsigned long resumed;
+
 		/** Digest to use when generating fingerprints
 		 */
 		const EVP_MD* digest;
@@ -184,8 +355,11 @@ namespace OpenSSL
 		Profile(const std::string& profilename, ConfigTag* tag)
 			: name(profilename)
 			, dh(ServerInstance->Config->Paths.PrependConfig(tag->getString("dhfile", "dh.pem")))
+			, ticketkeys(tag->getDuration("ticketrotate", 3600, 60))
 			, ctx(SSL_CTX_new(SSLv23_server_method()))
 			, clictx(SSL_CTX_new(SSLv23_client_method()))
+			, fullhandshakes(0)
+			, resumed(0)
 		{
 			if ((!ctx.SetDH(dh)) || (!clictx.SetDH(dh)))
 				throw Exception("Couldn't set DH parameters");
@@ -229,6 +403,30 @@ namespace OpenSSL
 				ERR_print_errors_cb(error_callback, this);
 				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Can't read CA list from %s. This is only a problem if you want to verify client certificates, otherwise it's safe to ignore this message. Error: %s", filename.c_str(), lasterr.c_str());
 			}
+
+			// Let clients skip the full handshake when reconnecting, either from the session cache or with a ticket
+			ctx.SetSessionCache(tag->getInt("sessioncache", 20480, 0), tag->getDuration("sessiontimeout", 300, 1));
+			if (tag->getBool("tickets", true))
+				ctx.SetTicketKeys(&ticketkeys);
+			else
+				ctx.DisableTickets();
+
+			// Let the kernel encrypt outgoing data once the handshake is done, if the cipher allows it
+			if ((tag->getBool("ktls")) && ((!ctx.EnableKTLS()) || (!clictx.EnableKTLS())))
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Kernel TLS was requested for profile %s but this OpenSSL version does not support it", name.c_str());
+		}
+
+		void CountHandshake(bool reused)
+		{
+			if (reused)
+				resumed++;
+			else
+				fullhandshakes++;
+		}
+
+		std::string GetStats()
+		{
+			return "full handshakes " + ConvToStr(fullhandshakes) + " resumed " + ConvToStr(resumed) + " cached sessions " + ConvToStr(ctx.GetCachedSessions());
 		}
 
 		const std::string& GetName() const { return name; }
@@ -238,6 +436,48 @@ namespace OpenSSL
 	};
 }
 
+static void SetTicketHMACKey(TicketHMACContext* hctx, const unsigned char* key, size_t keylen)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char digest[] = "SHA256";
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char*>(key), keylen);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+	params[2] = OSSL_PARAM_construct_end();
+	EVP_MAC_CTX_set_params(hctx, params);
+#else
+	HMAC_Init_ex(hctx, key, keylen, EVP_sha256(), NULL);
+#endif
+}
+
+static int OnTicketKey(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cctx, TicketHMACContext* hctx, int enc)
+{
+	OpenSSL::TicketKeys* keys = static_cast<OpenSSL::TicketKeys*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	if (enc)
+	{
+		// Issuing a new ticket
+		const OpenSSL::TicketKeys::Key key = keys->GetCurrent();
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+
+		memcpy(keyname, key.name, sizeof(key.name));
+		EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv);
+		SetTicketHMACKey(hctx, key.hmackey, sizeof(key.hmackey));
+		return 1;
+	}
+
+	// Resuming from a ticket, 0 makes OpenSSL fall back to a full handshake
+	OpenSSL::TicketKeys::Key key;
+	bool current;
+	if (!keys->Find(keyname, key, current))
+		return 0;
+
+	SetTicketHMACKey(hctx, key.hmackey, sizeof(key.hmackey));
+	EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv);
+	// Ask for the ticket to be renewed if it was made with the previous key
+	return (current ? 1 : 2);
+}
+
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 {
 	/* XXX: This will allow self signed certificates.
@@ -245,14 +485,10 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 * we can just return preverify_ok here, and openssl
 	 * will boot off self-signed and invalid peer certs.
 	 */
-	int ve = X509_STORE_CTX_get_error(ctx);
-
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
-
 	return 1;
 }
 
-class OpenSSLIOHook : public SSLIOHook
+class OpenSSLIOHook : public SSLIOHook, public SSLHandshakeJob
 {
  private:
 	SSL* sess;
@@ -261,18 +497,38 @@ class OpenSSLIOHook : public SSLIOHook
 	bool data_to_write;
 	reference<OpenSSL::Profile> profile;
 
+	/** Socket whose handshake is running on a handshake thread
+	 */
+	StreamSocket* handshakesock;
+
+	/** Return value of the last handshake step and the error from SSL_get_error() if it failed
+	 */
+	int handshakeret;
+	int handshakeerr;
+
 	bool Handshake(StreamSocket* user)
 	{
-		int ret;
+		// Only inbound handshakes are sent to the handshake threads, they're what arrives in storms
+		if ((HandshakePool) && (!outbound) && (HandshakePool->Queue(this)))
+		{
+			handshakesock = user;
+			status = ISSL_HANDSHAKING;
+			SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+			return true;
+		}
 
-		if (outbound)
-			ret = SSL_connect(sess);
-		else
-			ret = SSL_accept(sess);
+		Run();
+		return HandshakeDone(user);
+	}
 
+	/** Act on the result of the last handshake step
+	 */
+	bool HandshakeDone(StreamSocket* user)
+	{
+		int ret = handshakeret;
 		if (ret < 0)
 		{
-			int err = SSL_get_error(sess, ret);
+			int err = handshakeerr;
 
 			if (err == SSL_ERROR_WANT_READ)
 			{
@@ -298,8 +554,21 @@ class OpenSSLIOHook : public SSLIOHook
 			// Handshake complete.
 			VerifyCertificate();
 
+			if (!outbound)
+				profile->CountHandshake(SSL_session_reused(sess));
+
 			status = ISSL_OPEN;
 
+#if defined SSL_OP_ENABLE_KTLS && defined BIO_get_ktls_send
+			// If the kernel took over encryption of outgoing records the core can write to the socket directly
+			if (BIO_get_ktls_send(SSL_get_wbio(sess)) > 0)
+			{
+				writethrough = true;
+				KTLSSessions++;
+				KTLSTotal++;
+			}
+#endif
+
 			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
 
 			return true;
@@ -315,6 +584,11 @@ class OpenSSLIOHook : public SSLIOHook
 
 	void CloseSession()
 	{
+		if (writethrough)
+		{
+			writethrough = false;
+			KTLSSessions--;
+		}
 		if (sess)
 		{
 			SSL_shutdown(sess);
@@ -344,7 +618,8 @@ class OpenSSLIOHook : public SSLIOHook
 
 		certinfo->invalid = (SSL_get_verify_result(sess) != X509_V_OK);
 
-		if (!SelfSigned)
+		// This is checked here rather than in OnVerify() as the handshake may run on another thread
+		if (SSL_get_verify_result(sess) != X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -386,6 +661,9 @@ class OpenSSLIOHook : public SSLIOHook
 		, outbound(is_outbound)
 		, data_to_write(false)
 		, profile(sslprofile)
+		, handshakesock(NULL)
+		, handshakeret(0)
+		, handshakeerr(SSL_ERROR_NONE)
 	{
 		if (sess == NULL)
 			return;
@@ -396,8 +674,33 @@ class OpenSSLIOHook : public SSLIOHook
 		Handshake(sock);
 	}
 
+	void Run() CXX11_OVERRIDE
+	{
+		ERR_clear_error();
+		if (outbound)
+			handshakeret = SSL_connect(sess);
+		else
+			handshakeret = SSL_accept(sess);
+
+		// The error queue is per thread so this has to be looked at here
+		handshakeerr = (handshakeret < 0 ? SSL_get_error(sess, handshakeret) : SSL_ERROR_NONE);
+	}
+
+	void OnComplete() CXX11_OVERRIDE
+	{
+		StreamSocket* user = handshakesock;
+		handshakesock = NULL;
+		HandshakeDone(user);
+
+		// Have the socket report the error if the handshake failed
+		if (!sess)
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+	}
+
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
 	{
+		if (HandshakePool)
+			HandshakePool->Cancel(this);
 		CloseSession();
 	}
 
@@ -409,6 +712,10 @@ class OpenSSLIOHook : public SSLIOHook
 			return -1;
 		}
 
+		// A handshake thread owns the session right now
+		if (IsQueued())
+			return 0;
+
 		if (status == ISSL_HANDSHAKING)
 		{
 			// The handshake isn't finished and it wants to read, try to finish it.
@@ -469,6 +776,18 @@ class OpenSSLIOHook : public SSLIOHook
 	}
 
 	int OnStreamSocketWrite(StreamSocket* user, std::string& buffer) CXX11_OVERRIDE
+	{
+		SendQueue sendq(1);
+		sendq.front().str().swap(buffer);
+		size_t written = 0;
+		int ret = OnStreamSocketWriteV(user, sendq, 0, written);
+		sendq.front().str().swap(buffer);
+		if (ret == 0)
+			buffer.erase(0, written);
+		return ret;
+	}
+
+	int OnStreamSocketWriteV(StreamSocket* user, const SendQueue& sendq, size_t offset, size_t& written) CXX11_OVERRIDE
 	{
 		if (!sess)
 		{
@@ -478,6 +797,9 @@ class OpenSSLIOHook : public SSLIOHook
 
 		data_to_write = true;
 
+		if (IsQueued())
+			return 0;
+
 		if (status == ISSL_HANDSHAKING)
 		{
 			if (!Handshake(user))
@@ -491,43 +813,50 @@ class OpenSSLIOHook : public SSLIOHook
 
 		if (status == ISSL_OPEN)
 		{
-			int ret = SSL_write(sess, buffer.data(), buffer.size());
-			if (ret == (int)buffer.length())
-			{
-				data_to_write = false;
-				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
-				return 1;
-			}
-			else if (ret > 0)
+			// Hand SSL_write() up to a full record at a time, joining small sendq items
+			SendQueueReader reader(sendq, offset);
+			while (true)
 			{
-				buffer = buffer.substr(ret);
-				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-				return 0;
-			}
-			else if (ret == 0)
-			{
-				CloseSession();
-				return -1;
-			}
-			else if (ret < 0)
-			{
-				int err = SSL_get_error(sess, ret);
-
-				if (err == SSL_ERROR_WANT_WRITE)
+				size_t len;
+				const char* data = reader.Peek(len);
+				if (!len)
 				{
-					SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
-					return 0;
+					data_to_write = false;
+					SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+					return 1;
 				}
-				else if (err == SSL_ERROR_WANT_READ)
+
+				int ret = SSL_write(sess, data, len);
+				if (ret > 0)
 				{
-					SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ);
-					return 0;
+					reader.Skip(ret);
+					written += ret;
 				}
-				else
+				else if (ret == 0)
 				{
 					CloseSession();
 					return -1;
 				}
+				else
+				{
+					int err = SSL_get_error(sess, ret);
+
+					if (err == SSL_ERROR_WANT_WRITE)
+					{
+						SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
+						return 0;
+					}
+					else if (err == SSL_ERROR_WANT_READ)
+					{
+						SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ);
+						return 0;
+					}
+					else
+					{
+						CloseSession();
+						return -1;
+					}
+				}
 			}
 		}
 		return 0;
@@ -573,6 +902,8 @@ class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new OpenSSLIOHook(this, sock, true, profile->CreateClientSession(), profile);
 	}
+
+	OpenSSL::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLOpenSSL : public Module
@@ -643,6 +974,32 @@ class ModuleSSLOpenSSL : public Module
 	void init() CXX11_OVERRIDE
 	{
 		ReadProfiles();
+
+		// Handshake threads can only be set up on load as sessions may be queued on them
+		ConfigTag* tag = ServerInstance->Config->ConfValue("openssl");
+		unsigned int threads = tag->getInt("handshakethreads", 0, 0, 64);
+		if (threads)
+		{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+			CryptoLocks = new Mutex[CRYPTO_num_locks()];
+			CRYPTO_set_locking_callback(OnCryptoLock);
+#endif
+			HandshakePool = new SSLHandshakePool(threads, tag->getInt("maxhandshakes", 1024, 1));
+		}
+	}
+
+	~ModuleSSLOpenSSL()
+	{
+		delete HandshakePool;
+		HandshakePool = NULL;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		if (CryptoLocks)
+		{
+			CRYPTO_set_locking_callback(NULL);
+			delete[] CryptoLocks;
+			CryptoLocks = NULL;
+		}
+#endif
 	}
 
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
@@ -660,6 +1017,24 @@ class ModuleSSLOpenSSL : public Module
 		}
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 't')
+			return MOD_RES_PASSTHRU;
+
+		results.push_back("249 " + user->nick + " :openssl kernel TLS sessions " + ConvToStr(KTLSSessions) + " total " + ConvToStr(KTLSTotal));
+		if (HandshakePool)
+			results.push_back("249 " + user->nick + " :openssl " + HandshakePool->GetStats());
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			OpenSSL::Profile* profile = (*i)->GetProfile();
+			results.push_back("249 " + user->nick + " :openssl profile " + profile->GetName() + " " + profile->GetStats());
+		}
+
+		// Let other SSL modules add their statistics as well
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
 		IOHook* hook = user->eh.GetIOHook();
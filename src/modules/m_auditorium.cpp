@@ -100,6 +100,12 @@ class ModuleAuditorium : public Module
 		nick.clear();
 	}
 
+	ModResult OnNamesListCache(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE
+	{
+		// Who can see whom depends on the issuer
+		return (chan->IsModeSet(aum) ? MOD_RES_DENY : MOD_RES_PASSTHRU);
+	}
+
 	/** Build CUList for showing this join/part/kick */
 	void BuildExcept(Membership* memb, CUList& excepts)
 	{
@@ -129,8 +135,9 @@ class ModuleAuditorium : public Module
 		BuildExcept(memb, excepts);
 	}
 
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE
+	void OnBuildNeighborList(User* source, NeighborList& neighbors) CXX11_OVERRIDE
 	{
+		IncludeChanList& include = neighbors.chans;
 		for (IncludeChanList::iterator i = include.begin(); i != include.end(); )
 		{
 			Membership* memb = *i;
@@ -147,7 +154,7 @@ class ModuleAuditorium : public Module
 			for(UserMembCIter j = users->begin(); j != users->end(); j++)
 			{
 				if (IS_LOCAL(j->first) && CanSee(j->first, memb))
-					exception[j->first] = true;
+					neighbors.Include(j->first);
 			}
 		}
 	}
@@ -80,6 +80,12 @@ class ModuleBlockAmsg : public Module
 			action = IBLOCK_KILLOPERS;
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "PRIVMSG");
+		ServerInstance->Parser->SubscribePreCommand(this, "NOTICE");
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line) CXX11_OVERRIDE
 	{
 		// Don't do anything with unregistered users
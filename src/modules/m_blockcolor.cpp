@@ -40,6 +40,11 @@ class ModuleBlockColor : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL));
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('c');
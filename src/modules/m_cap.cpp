@@ -39,6 +39,36 @@ CAP END
  */
 class CommandCAP : public Command
 {
+	typedef std::multimap<std::string, ServiceProvider*>::const_iterator ProviderIter;
+
+	/** Find a capability which is offered to clients
+	 * @param name Name of the capability
+	 * @return The capability or NULL if there is no such active capability
+	 */
+	static GenericCap* FindCap(const std::string& name)
+	{
+		GenericCap* cap = ServerInstance->Modules->FindDataService<GenericCap>("cap/" + name);
+		return ((cap && cap->IsActive()) ? cap : NULL);
+	}
+
+	/** Get all capabilities which are offered to clients
+	 * @param caps List to add the capabilities to
+	 */
+	static void GetCaps(std::vector<GenericCap*>& caps)
+	{
+		// Services with a '/' in their name are also indexed by the part before it
+		std::pair<ProviderIter, ProviderIter> range = ServerInstance->Modules->DataProviders.equal_range("cap");
+		for (ProviderIter i = range.first; i != range.second; ++i)
+		{
+			if (i->second->name.compare(0, 4, "cap/"))
+				continue;
+
+			GenericCap* cap = static_cast<GenericCap*>(i->second);
+			if (cap->IsActive())
+				caps.push_back(cap);
+		}
+	}
+
  public:
 	LocalIntExt reghold;
 	CommandCAP (Module* mod) : Command(mod, "CAP", 1),
@@ -49,6 +79,10 @@ class CommandCAP : public Command
 
 	CmdResult Handle (const std::vector<std::string> &parameters, User *user)
 	{
+		LocalUser* localuser = IS_LOCAL(user);
+		if (!localuser)
+			return CMD_FAILURE;
+
 		std::string subcommand(parameters[0].length(), ' ');
 		std::transform(parameters[0].begin(), parameters[0].end(), subcommand.begin(), ::toupper);
 
@@ -57,7 +91,8 @@ class CommandCAP : public Command
 			if (parameters.size() < 2)
 				return CMD_FAILURE;
 
-			CapEvent Data(creator, user, CapEvent::CAPEVENT_REQ);
+			std::vector<std::string> ack;
+			std::vector<std::string> nak;
 
 			// tokenize the input into a nice list of requested caps
 			std::string cap_;
@@ -66,21 +101,28 @@ class CommandCAP : public Command
 			while (cap_stream.GetToken(cap_))
 			{
 				std::transform(cap_.begin(), cap_.end(), cap_.begin(), ::tolower);
-				Data.wanted.push_back(cap_);
+				bool enablecap = ((cap_.empty()) || (cap_[0] != '-'));
+				GenericCap* cap = FindCap(enablecap ? cap_ : cap_.substr(1));
+				if (cap)
+				{
+					cap->set(localuser, enablecap);
+					ack.push_back(cap_);
+				}
+				else
+					nak.push_back(cap_);
 			}
 
 			reghold.set(user, 1);
-			Data.Send();
 
-			if (Data.ack.size() > 0)
+			if (ack.size() > 0)
 			{
-				std::string AckResult = irc::stringjoiner(Data.ack);
+				std::string AckResult = irc::stringjoiner(ack);
 				user->WriteCommand("CAP", "ACK :" + AckResult);
 			}
 
-			if (Data.wanted.size() > 0)
+			if (nak.size() > 0)
 			{
-				std::string NakResult = irc::stringjoiner(Data.wanted);
+				std::string NakResult = irc::stringjoiner(nak);
 				user->WriteCommand("CAP", "NAK :" + NakResult);
 			}
 		}
@@ -90,22 +132,36 @@ class CommandCAP : public Command
 		}
 		else if ((subcommand == "LS") || (subcommand == "LIST"))
 		{
-			CapEvent Data(creator, user, subcommand == "LS" ? CapEvent::CAPEVENT_LS : CapEvent::CAPEVENT_LIST);
+			std::vector<GenericCap*> caps;
+			GetCaps(caps);
+
+			std::vector<std::string> names;
+			for (std::vector<GenericCap*>::const_iterator i = caps.begin(); i != caps.end(); ++i)
+			{
+				if ((subcommand == "LS") || ((*i)->get(localuser)))
+					names.push_back((*i)->cap);
+			}
 
 			reghold.set(user, 1);
-			Data.Send();
 
-			std::string Result = irc::stringjoiner(Data.wanted);
+			std::string Result = irc::stringjoiner(names);
 			user->WriteCommand("CAP", subcommand + " :" + Result);
 		}
 		else if (subcommand == "CLEAR")
 		{
-			CapEvent Data(creator, user, CapEvent::CAPEVENT_CLEAR);
+			std::vector<GenericCap*> caps;
+			GetCaps(caps);
+
+			std::vector<std::string> ack;
+			for (std::vector<GenericCap*>::const_iterator i = caps.begin(); i != caps.end(); ++i)
+			{
+				(*i)->set(localuser, false);
+				ack.push_back("-" + (*i)->cap);
+			}
 
 			reghold.set(user, 1);
-			Data.Send();
 
-			std::string Result = irc::stringjoiner(Data.ack);
+			std::string Result = irc::stringjoiner(ack);
 			user->WriteCommand("CAP", "ACK :" + Result);
 		}
 		else
@@ -72,6 +72,11 @@ class ModuleChanFilter : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL));
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		hidemask = ServerInstance->Config->ConfValue("chanfilter")->getBool("hidemask");
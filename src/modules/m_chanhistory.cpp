@@ -19,23 +19,262 @@
 
 #include "inspircd.h"
 
-struct HistoryItem
+struct HistoryList;
+
+/** A line of history. The source mask and the text of the message are stored
+ * directly after it, the line is formatted when it is replayed.
+ */
+struct HistoryLine : public intrusive_list_node<HistoryLine>
+{
+	/** The history list this line belongs to
+	 */
+	HistoryList* const list;
+
+	/** Time the line was sent
+	 */
+	const time_t ts;
+
+	/** Length of the source mask
+	 */
+	const unsigned int masklen;
+
+	/** Length of the message text
+	 */
+	const unsigned int textlen;
+
+	/** Size of the block holding this line
+	 */
+	const size_t blocksize;
+
+	HistoryLine(HistoryList* List, size_t Blocksize, const std::string& mask, const std::string& text)
+		: list(List), ts(ServerInstance->Time()), masklen(mask.length()), textlen(text.length()), blocksize(Blocksize)
+	{
+		memcpy(GetData(), mask.data(), masklen);
+		memcpy(GetData() + masklen, text.data(), textlen);
+	}
+
+	char* GetData() { return reinterpret_cast<char*>(this + 1); }
+	const char* GetMask() const { return reinterpret_cast<const char*>(this + 1); }
+	const char* GetText() const { return GetMask() + masklen; }
+};
+
+/** Hands out blocks for history lines from large chunks shared by all channels. Blocks are
+ * rounded up to a size class and freed blocks are kept on a list for that class, so lines
+ * coming and going don't fragment the heap.
+ */
+class LineAllocator
 {
-	time_t ts;
-	std::string line;
-	HistoryItem(const std::string& Line) : ts(ServerInstance->Time()), line(Line) {}
+	/** Blocks are a multiple of this size
+	 */
+	static const size_t Granularity = 64;
+
+	/** Size of the chunks blocks are carved from
+	 */
+	static const size_t ChunkSize = 64 * 1024;
+
+	/** Free blocks for each size class, linked through their first word
+	 */
+	std::vector<void*> freelists;
+
+	/** Chunks allocated so far
+	 */
+	std::vector<char*> chunks;
+
+	/** Bytes of the newest chunk which have been handed out
+	 */
+	size_t chunkused;
+
+	/** Bytes in blocks which are in use
+	 */
+	size_t used;
+
+ public:
+	LineAllocator() : chunkused(ChunkSize), used(0) { }
+
+	~LineAllocator()
+	{
+		for (std::vector<char*>::const_iterator i = chunks.begin(); i != chunks.end(); ++i)
+			delete[] *i;
+	}
+
+	static size_t GetBlockSize(size_t size)
+	{
+		return ((size + Granularity - 1) / Granularity) * Granularity;
+	}
+
+	void* Allocate(size_t blocksize)
+	{
+		used += blocksize;
+		if (blocksize > ChunkSize)
+			return ::operator new(blocksize);
+
+		const size_t sizeclass = (blocksize / Granularity) - 1;
+		if ((sizeclass < freelists.size()) && (freelists[sizeclass]))
+		{
+			void* block = freelists[sizeclass];
+			freelists[sizeclass] = *static_cast<void**>(block);
+			return block;
+		}
+
+		if (chunkused + blocksize > ChunkSize)
+		{
+			chunks.push_back(new char[ChunkSize]);
+			chunkused = 0;
+		}
+
+		void* block = chunks.back() + chunkused;
+		chunkused += blocksize;
+		return block;
+	}
+
+	void Free(void* block, size_t blocksize)
+	{
+		used -= blocksize;
+		if (blocksize > ChunkSize)
+		{
+			::operator delete(block);
+			return;
+		}
+
+		const size_t sizeclass = (blocksize / Granularity) - 1;
+		if (sizeclass >= freelists.size())
+			freelists.resize(sizeclass + 1, NULL);
+
+		*static_cast<void**>(block) = freelists[sizeclass];
+		freelists[sizeclass] = block;
+	}
+
+	size_t GetUsed() const { return used; }
+	size_t GetReserved() const { return chunks.size() * ChunkSize; }
+};
+
+/** Owns the lines of all channels and enforces the global memory limit
+ */
+class HistoryStore
+{
+	LineAllocator allocator;
+
+	/** Lines of every channel, oldest first
+	 */
+	intrusive_list_tail<HistoryLine> lines;
+
+ public:
+	/** Maximum number of bytes lines may use in total, 0 for no limit
+	 */
+	size_t maxmemory;
+
+	HistoryStore() : maxmemory(0) { }
+
+	HistoryLine* Create(HistoryList* list, const std::string& mask, const std::string& text)
+	{
+		const size_t blocksize = LineAllocator::GetBlockSize(sizeof(HistoryLine) + mask.length() + text.length());
+		HistoryLine* line = new(allocator.Allocate(blocksize)) HistoryLine(list, blocksize, mask, text);
+		lines.push_back(line);
+		return line;
+	}
+
+	void Destroy(HistoryLine* line)
+	{
+		const size_t blocksize = line->blocksize;
+		lines.erase(line);
+		line->~HistoryLine();
+		allocator.Free(line, blocksize);
+	}
+
+	/** Drop the oldest lines of any channel until the memory limit is met
+	 * @param keep A line which must not be dropped
+	 */
+	void Trim(HistoryLine* keep);
+
+	size_t GetLineCount() const { return lines.size(); }
+	size_t GetUsed() const { return allocator.GetUsed(); }
+	size_t GetReserved() const { return allocator.GetReserved(); }
 };
 
+/** History of a channel, a ring buffer holding up to maxlen lines
+ */
 struct HistoryList
 {
-	std::deque<HistoryItem> lines;
-	unsigned int maxlen, maxtime;
+	HistoryStore& store;
+
+	/** Lines, the oldest at index head
+	 */
+	std::vector<HistoryLine*> ring;
+	size_t head;
+	size_t count;
+
+	/** Bytes used by the lines of this channel
+	 */
+	size_t bytes;
+
+	unsigned int maxtime;
 	std::string param;
 
-	HistoryList(unsigned int len, unsigned int time, const std::string& oparam)
-		: maxlen(len), maxtime(time), param(oparam) { }
+	HistoryList(HistoryStore& Store, unsigned int len, unsigned int time, const std::string& oparam)
+		: store(Store), ring(len), head(0), count(0), bytes(0), maxtime(time), param(oparam) { }
+
+	~HistoryList()
+	{
+		while (count)
+			PopFront();
+	}
+
+	unsigned int GetMaxLen() const { return ring.size(); }
+
+	/** Get a line, 0 being the oldest */
+	HistoryLine* Get(size_t index) const { return ring[(head + index) % ring.size()]; }
+
+	void PopFront()
+	{
+		HistoryLine* line = ring[head];
+		ring[head] = NULL;
+		head = (head + 1) % ring.size();
+		count--;
+		bytes -= line->blocksize;
+		store.Destroy(line);
+	}
+
+	void Add(const std::string& mask, const std::string& text)
+	{
+		// Lines too old to be replayed are at the front, drop them early to save memory
+		if (maxtime)
+		{
+			const time_t mintime = ServerInstance->Time() - maxtime;
+			while (count && Get(0)->ts < mintime)
+				PopFront();
+		}
+
+		if (count == ring.size())
+			PopFront();
+
+		HistoryLine* line = store.Create(this, mask, text);
+		ring[(head + count) % ring.size()] = line;
+		count++;
+		bytes += line->blocksize;
+		store.Trim(line);
+	}
+
+	void Resize(unsigned int len)
+	{
+		// Drop the oldest lines which no longer fit
+		while (count > len)
+			PopFront();
+
+		std::vector<HistoryLine*> newring(len);
+		for (size_t i = 0; i < count; ++i)
+			newring[i] = Get(i);
+		ring.swap(newring);
+		head = 0;
+	}
 };
 
+void HistoryStore::Trim(HistoryLine* keep)
+{
+	// The oldest line overall is always the oldest line of its own channel
+	while ((maxmemory) && (allocator.GetUsed() > maxmemory) && (lines.front() != keep))
+		lines.front()->list->PopFront();
+}
+
 class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 {
 	bool IsValidDuration(const std::string& duration)
@@ -54,8 +293,11 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 
  public:
 	unsigned int maxlines;
-	HistoryMode(Module* Creator)
+	HistoryStore& store;
+
+	HistoryMode(Module* Creator, HistoryStore& Store)
 		: ParamMode<HistoryMode, SimpleExtItem<HistoryList> >(Creator, "history", 'H')
+		, store(Store)
 	{
 	}
 
@@ -81,17 +323,15 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 		HistoryList* history = ext.get(channel);
 		if (history)
 		{
-			// Shrink the list if the new line number limit is lower than the old one
-			if (len < history->lines.size())
-				history->lines.erase(history->lines.begin(), history->lines.begin() + (history->lines.size() - len));
+			if (len != history->GetMaxLen())
+				history->Resize(len);
 
-			history->maxlen = len;
 			history->maxtime = time;
 			history->param = parameter;
 		}
 		else
 		{
-			ext.set(channel, new HistoryList(len, time, parameter));
+			ext.set(channel, new HistoryList(store, len, time, parameter));
 		}
 		return MODEACTION_ALLOW;
 	}
@@ -104,13 +344,19 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 
 class ModuleChanHistory : public Module
 {
+	HistoryStore store;
 	HistoryMode m;
 	bool sendnotice;
 	UserModeReference botmode;
 	bool dobots;
  public:
-	ModuleChanHistory() : m(this), botmode(this, "bot")
+	ModuleChanHistory() : m(this, store), botmode(this, "bot")
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserMessage, this, HookFilter(TYPE_CHANNEL, &m));
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -119,6 +365,7 @@ class ModuleChanHistory : public Module
 		m.maxlines = tag->getInt("maxlines", 50);
 		sendnotice = tag->getBool("notice", true);
 		dobots = tag->getBool("bots", true);
+		store.maxmemory = tag->getInt("maxmemory", 0, 0) * 1024;
 	}
 
 	void OnUserMessage(User* user, void* dest, int target_type, const std::string &text, char status, const CUList&, MessageType msgtype) CXX11_OVERRIDE
@@ -128,21 +375,17 @@ class ModuleChanHistory : public Module
 			Channel* c = (Channel*)dest;
 			HistoryList* list = m.ext.get(c);
 			if (list)
-			{
-				const std::string line = ":" + user->GetFullHost() + " PRIVMSG " + c->name + " :" + text;
-				list->lines.push_back(HistoryItem(line));
-				if (list->lines.size() > list->maxlen)
-					list->lines.pop_front();
-			}
+				list->Add(user->GetFullHost(), text);
 		}
 	}
 
 	void OnPostJoin(Membership* memb) CXX11_OVERRIDE
 	{
-		if (IS_REMOTE(memb->user))
+		LocalUser* user = IS_LOCAL(memb->user);
+		if (!user)
 			return;
 
-		if (memb->user->IsModeSet(botmode) && !dobots)
+		if (user->IsModeSet(botmode) && !dobots)
 			return;
 
 		HistoryList* list = m.ext.get(memb->chan);
@@ -154,14 +397,61 @@ class ModuleChanHistory : public Module
 
 		if (sendnotice)
 		{
-			memb->user->WriteNotice("Replaying up to " + ConvToStr(list->maxlen) + " lines of pre-join history spanning up to " + ConvToStr(list->maxtime) + " seconds");
+			user->WriteNotice("Replaying up to " + ConvToStr(list->GetMaxLen()) + " lines of pre-join history spanning up to " + ConvToStr(list->maxtime) + " seconds");
+		}
+
+		// Format all lines into one buffer and send them with a single write
+		const std::string::size_type maxline = ServerInstance->Config->Limits.MaxLine - 2;
+		std::string buffer;
+		unsigned int sent = 0;
+		for (size_t i = 0; i < list->count; ++i)
+		{
+			const HistoryLine* line = list->Get(i);
+			if (line->ts < mintime)
+				continue;
+
+			const std::string::size_type start = buffer.length();
+			buffer.push_back(':');
+			buffer.append(line->GetMask(), line->masklen).append(" PRIVMSG ").append(memb->chan->name).append(" :");
+			buffer.append(line->GetText(), line->textlen);
+			if (buffer.length() - start > maxline)
+				buffer.erase(start + maxline);
+			buffer.append("\r\n");
+			sent++;
 		}
 
-		for(std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
+		user->WriteBatch(buffer, sent);
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'z')
+			return MOD_RES_PASSTHRU;
+
+		// Report the totals and the channels using the most memory
+		std::vector<std::pair<size_t, Channel*> > usage;
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
 		{
-			if (i->ts >= mintime)
-				memb->user->Write(i->line);
+			HistoryList* list = m.ext.get(i->second);
+			if (list)
+				usage.push_back(std::make_pair(list->bytes, i->second));
+		}
+
+		results.push_back("249 " + user->nick + " :Channel history: " + ConvToStr(store.GetLineCount()) + " lines in "
+			+ ConvToStr(usage.size()) + " channels using " + ConvToStr(store.GetUsed()) + " bytes ("
+			+ ConvToStr(store.GetReserved()) + " reserved, limit " + (store.maxmemory ? ConvToStr(store.maxmemory) : "none") + ")");
+
+		const size_t top = std::min<size_t>(usage.size(), 5);
+		std::partial_sort(usage.begin(), usage.begin() + top, usage.end(), std::greater<std::pair<size_t, Channel*> >());
+		for (size_t i = 0; i < top; ++i)
+		{
+			const HistoryList* list = m.ext.get(usage[i].second);
+			results.push_back("249 " + user->nick + " :Channel history: " + usage[i].second->name + " " + ConvToStr(list->count)
+				+ "/" + ConvToStr(list->GetMaxLen()) + " lines using " + ConvToStr(usage[i].first) + " bytes");
 		}
+
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -155,8 +155,9 @@ class ModuleClearChan : public Module
 		ServerInstance->Modules->DetachAll(this);
 	}
 
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE
+	void OnBuildNeighborList(User* source, NeighborList& neighbors) CXX11_OVERRIDE
 	{
+		IncludeChanList& include = neighbors.chans;
 		bool found = false;
 		for (IncludeChanList::iterator i = include.begin(); i != include.end(); ++i)
 		{
@@ -182,15 +183,15 @@ class ModuleClearChan : public Module
 				// to consider for sending the QUIT to then don't add exceptions for opers, because the
 				// module before us doesn't want them to see it or added the exceptions already.
 				// If there is a value for this oper in excepts already, this won't overwrite it.
-				if (found)
-					exception.insert(std::make_pair(curr, true));
+				if ((found) && (!neighbors.IsExcepted(curr)))
+					neighbors.Include(curr);
 				continue;
 			}
 			else if (!include.empty() && curr->chans.size() > 1)
 			{
 				// This is a victim and potentially has another common channel with the user quitting,
 				// add a negative exception overwriting the previous value, if any.
-				exception[curr] = false;
+				neighbors.Exclude(curr);
 			}
 		}
 	}
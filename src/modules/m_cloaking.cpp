@@ -132,6 +132,15 @@ class CommandCloak : public Command
 
 class ModuleCloaking : public Module
 {
+	/** Maps the cache key of an address (see GenCloak) to its cloak */
+	typedef TR1NS::unordered_map<std::string, std::string> CloakCache;
+
+	/** Cloaks which have already been generated with the current key set */
+	CloakCache cache;
+
+	/** Maximum number of entries in the cache, 0 to disable caching */
+	unsigned long cachesize;
+
  public:
 	CloakUser cu;
 	CloakMode mode;
@@ -139,10 +148,11 @@ class ModuleCloaking : public Module
 	std::string prefix;
 	std::string suffix;
 	std::string key;
+	bool hmac;
 	const char* xtab[4];
 	dynamic_reference<HashProvider> Hash;
 
-	ModuleCloaking() : cu(this), mode(MODE_OPAQUE), ck(this), Hash(this, "hash/md5")
+	ModuleCloaking() : cachesize(0), cu(this), mode(MODE_OPAQUE), ck(this), hmac(false), Hash(this, "hash/md5")
 	{
 	}
 
@@ -185,14 +195,26 @@ class ModuleCloaking : public Module
 	 */
 	std::string SegmentCloak(const std::string& item, char id, int len)
 	{
-		std::string input;
-		input.reserve(key.length() + 3 + item.length());
-		input.append(1, id);
-		input.append(key);
-		input.append(1, '\0'); // null does not terminate a C++ string
-		input.append(item);
-
-		std::string rv = Hash->sum(input).substr(0,len);
+		std::string rv;
+		if (hmac)
+		{
+			std::string input;
+			input.reserve(1 + item.length());
+			input.append(1, id);
+			input.append(item);
+			rv = Hash->hmac(key, input).substr(0, len);
+		}
+		else
+		{
+			std::string input;
+			input.reserve(key.length() + 3 + item.length());
+			input.append(1, id);
+			input.append(key);
+			input.append(1, '\0'); // null does not terminate a C++ string
+			input.append(item);
+			rv = Hash->sum(input).substr(0, len);
+		}
+
 		for(int i=0; i < len; i++)
 		{
 			// this discards 3 bits per byte. We have an
@@ -339,9 +361,44 @@ class ModuleCloaking : public Module
 		key = tag->getString("key");
 		if (key.empty() || key == "secret")
 			throw ModuleException("You have not defined cloak keys for m_cloaking. Define <cloak:key> as a network-wide secret.");
+
+		const std::string hashname = tag->getString("hash", "md5");
+		Hash.SetProvider("hash/" + hashname);
+		// SegmentCloak() takes up to 8 bytes of the hash output
+		if ((Hash) && (Hash->out_size < 8))
+			throw ModuleException("The hash algorithm specified in <cloak:hash> produces too short output: " + hashname);
+
+		hmac = tag->getBool("hmac");
+		cachesize = tag->getInt("cachesize", 0, 0);
+
+		// Any key, mode or hash change invalidates all previously generated cloaks
+		cache.clear();
 	}
 
 	std::string GenCloak(const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
+	{
+		// The IP is only known when ipstr is not empty, don't cache anything else
+		if ((!cachesize) || (ipstr.empty()))
+			return CalcCloak(ip, ipstr, host);
+
+		// Half cloaks depend on the hostname as well as the IP
+		std::string cachekey = ipstr;
+		if (mode == MODE_HALF_CLOAK)
+			cachekey.append(1, ' ').append(host);
+
+		CloakCache::const_iterator it = cache.find(cachekey);
+		if (it != cache.end())
+			return it->second;
+
+		std::string chost = CalcCloak(ip, ipstr, host);
+		// Start over when the cache is full; entries are cheap to regenerate
+		if (cache.size() >= cachesize)
+			cache.clear();
+		cache.insert(std::make_pair(cachekey, chost));
+		return chost;
+	}
+
+	std::string CalcCloak(const irc::sockets::sockaddrs& ip, const std::string& ipstr, const std::string& host)
 	{
 		std::string chost;
 
@@ -35,6 +35,11 @@ class ModulePrivacyMode : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_USER));
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds user mode +c, which if set, users must be on a common channel with you to private message you", VF_VENDOR);
@@ -56,6 +56,11 @@ class ModuleWaitPong : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "PONG");
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser* user, bool validated, const std::string &original_line) CXX11_OVERRIDE
 	{
 		if (command == "PONG")
@@ -53,6 +53,11 @@ class ModuleDeaf : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL));
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("deaf");
@@ -46,11 +46,12 @@ class ModuleDelayJoin : public Module
 
 	Version GetVersion() CXX11_OVERRIDE;
 	void OnNamesListItem(User* issuer, Membership*, std::string &prefixes, std::string &nick) CXX11_OVERRIDE;
+	ModResult OnNamesListCache(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE;
 	void OnUserJoin(Membership*, bool, bool, CUList&) CXX11_OVERRIDE;
 	void CleanUser(User* user);
 	void OnUserPart(Membership*, std::string &partmessage, CUList&) CXX11_OVERRIDE;
 	void OnUserKick(User* source, Membership*, const std::string &reason, CUList&) CXX11_OVERRIDE;
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE;
+	void OnBuildNeighborList(User* source, NeighborList& neighbors) CXX11_OVERRIDE;
 	void OnText(User* user, void* dest, int target_type, const std::string &text, char status, CUList &exempt_list) CXX11_OVERRIDE;
 	ModResult OnRawMode(User* user, Channel* channel, ModeHandler* mh, const std::string& param, bool adding) CXX11_OVERRIDE;
 };
@@ -91,6 +92,12 @@ void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::strin
 		nick.clear();
 }
 
+ModResult ModuleDelayJoin::OnNamesListCache(User* issuer, Channel* chan, std::string& variant)
+{
+	/* Hidden users are only shown to themselves */
+	return (chan->IsModeSet(djm) ? MOD_RES_DENY : MOD_RES_PASSTHRU);
+}
+
 static void populate(CUList& except, Membership* memb)
 {
 	const UserMembList* users = memb->chan->GetUsers();
@@ -123,8 +130,9 @@ void ModuleDelayJoin::OnUserKick(User* source, Membership* memb, const std::stri
 		populate(except, memb);
 }
 
-void ModuleDelayJoin::OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception)
+void ModuleDelayJoin::OnBuildNeighborList(User* source, NeighborList& neighbors)
 {
+	IncludeChanList& include = neighbors.chans;
 	for (IncludeChanList::iterator i = include.begin(); i != include.end(); )
 	{
 		Membership* memb = *i;
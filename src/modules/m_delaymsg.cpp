@@ -52,6 +52,7 @@ class ModuleDelayMsg : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
 	void OnUserJoin(Membership* memb, bool sync, bool created, CUList&) CXX11_OVERRIDE;
 	ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype) CXX11_OVERRIDE;
@@ -78,6 +79,11 @@ void DelayMsgMode::OnUnset(User* source, Channel* chan)
 		jointime.set(n->second, 0);
 }
 
+void ModuleDelayMsg::init()
+{
+	ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL, &djm));
+}
+
 Version ModuleDelayMsg::GetVersion()
 {
 	return Version("Provides channelmode +d <int>, to deny messages to a channel until <int> seconds.", VF_VENDOR);
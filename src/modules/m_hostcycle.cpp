@@ -29,34 +29,19 @@ class ModuleHostCycle : public Module
 		// GetFullHost() returns the original data at the time this function is called
 		const std::string quitline = ":" + user->GetFullHost() + " QUIT :" + quitmsg;
 
-		already_sent_t silent_id = ++LocalUser::already_sent_id;
-		already_sent_t seen_id = ++LocalUser::already_sent_id;
+		NeighborList neighbors(user, false);
 
-		IncludeChanList include_chans(user->chans.begin(), user->chans.end());
-		std::map<User*,bool> exceptions;
-
-		FOREACH_MOD(OnBuildNeighborList, (user, include_chans, exceptions));
-
-		for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		const std::vector<LocalUser*>& included = neighbors.GetIncluded();
+		for (std::vector<LocalUser*>::const_iterator i = included.begin(); i != included.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting)
-			{
-				if (i->second)
-				{
-					u->already_sent = seen_id;
-					u->Write(quitline);
-				}
-				else
-				{
-					u->already_sent = silent_id;
-				}
-			}
+			LocalUser* u = *i;
+			if (!u->quitting)
+				u->Write(quitline);
 		}
 
 		std::string newfullhost = user->nick + "!" + newident + "@" + newhost;
 
-		for (IncludeChanList::const_iterator i = include_chans.begin(); i != include_chans.end(); ++i)
+		for (IncludeChanList::const_iterator i = neighbors.chans.begin(); i != neighbors.chans.end(); ++i)
 		{
 			Membership* memb = *i;
 			Channel* c = memb->chan;
@@ -78,14 +63,11 @@ class ModuleHostCycle : public Module
 				LocalUser* u = IS_LOCAL(j->first);
 				if (u == NULL || u == user)
 					continue;
-				if (u->already_sent == silent_id)
+				if (neighbors.IsExcluded(u))
 					continue;
 
-				if (u->already_sent != seen_id)
-				{
+				if (neighbors.Visit(u))
 					u->Write(quitline);
-					u->already_sent = seen_id;
-				}
 
 				u->Write(joinline);
 				if (!memb->modes.empty())
@@ -31,42 +31,38 @@ class ModuleIRCv3 : public Module
 
 	CUList last_excepts;
 
-	void WriteNeighboursWithExt(User* user, const std::string& line, const LocalIntExt& ext)
+	class WriteNeighborsWithCap : public ForEachNeighborHandler
 	{
-		IncludeChanList chans(user->chans.begin(), user->chans.end());
+		const std::string& line;
+		const GenericCap& cap;
 
-		std::map<User*, bool> exceptions;
-		FOREACH_MOD(OnBuildNeighborList, (user, chans, exceptions));
-
-		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
-		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		void Execute(const std::vector<LocalUser*>& users) CXX11_OVERRIDE
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if ((u) && (i->second) && (ext.get(u)))
-				u->Write(line);
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			{
+				LocalUser* const user = *i;
+				if (cap.get(user))
+					user->Write(line);
+			}
 		}
 
-		// Now consider sending it to all other users who has at least a common channel with the user
-		std::set<User*> already_sent;
-		for (IncludeChanList::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	 public:
+		WriteNeighborsWithCap(const std::string& msg, const GenericCap& capability)
+			: line(msg)
+			, cap(capability)
 		{
-			const UserMembList* userlist = (*i)->chan->GetUsers();
-			for (UserMembList::const_iterator m = userlist->begin(); m != userlist->end(); ++m)
-			{
-				/*
-				 * Send the line if the channel member in question meets all of the following criteria:
-				 * - local
-				 * - not the user who is doing the action (i.e. whose channels we're iterating)
-				 * - has the given extension
-				 * - not on the except list built by modules
-				 * - we haven't sent the line to the member yet
-				 *
-				 */
-				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
-					member->Write(line);
-			}
 		}
+	};
+
+	void WriteNeighboursWithCap(User* user, const std::string& line, const GenericCap& cap)
+	{
+		// Nobody would receive the line if no local user has the cap, skip looking at the neighbours
+		if (!cap.IsEnabledByAny())
+			return;
+
+		// Send the line to every neighbour except the user doing the action who has the given cap
+		WriteNeighborsWithCap handler(line, cap);
+		user->ForEachNeighbor(handler, false);
 	}
 
  public:
@@ -82,19 +78,16 @@ class ModuleIRCv3 : public Module
 		accountnotify = conf->getBool("accountnotify", true);
 		awaynotify = conf->getBool("awaynotify", true);
 		extendedjoin = conf->getBool("extendedjoin", true);
+
+		cap_accountnotify.SetActive(accountnotify);
+		cap_awaynotify.SetActive(awaynotify);
+		cap_extendedjoin.SetActive(extendedjoin);
 	}
 
 	void OnEvent(Event& ev) CXX11_OVERRIDE
 	{
-		if (awaynotify)
-			cap_awaynotify.HandleEvent(ev);
-		if (extendedjoin)
-			cap_extendedjoin.HandleEvent(ev);
-
 		if (accountnotify)
 		{
-			cap_accountnotify.HandleEvent(ev);
-
 			if (ev.id == "account_login")
 			{
 				AccountEvent* ae = static_cast<AccountEvent*>(&ev);
@@ -108,7 +101,7 @@ class ModuleIRCv3 : public Module
 				else
 					line += std::string(ae->account);
 
-				WriteNeighboursWithExt(ae->user, line, cap_accountnotify.ext);
+				WriteNeighboursWithCap(ae->user, line, cap_accountnotify);
 			}
 		}
 	}
@@ -116,10 +109,10 @@ class ModuleIRCv3 : public Module
 	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& excepts) CXX11_OVERRIDE
 	{
 		// Remember who is not going to see the JOIN because of other modules
-		if ((awaynotify) && (memb->user->IsAway()))
+		if ((awaynotify) && (memb->user->IsAway()) && (cap_awaynotify.IsEnabledByAny()))
 			last_excepts = excepts;
 
-		if (!extendedjoin)
+		if ((!extendedjoin) || (!cap_extendedjoin.IsEnabledByAny()))
 			return;
 
 		/*
@@ -139,7 +132,7 @@ class ModuleIRCv3 : public Module
 		{
 			// Send the extended join line if the current member is local, has the extended-join cap and isn't excepted
 			User* member = IS_LOCAL(it->first);
-			if ((member) && (cap_extendedjoin.ext.get(member)) && (excepts.find(member) == excepts.end()))
+			if ((member) && (cap_extendedjoin.get(member)) && (excepts.find(member) == excepts.end()))
 			{
 				// Construct the lines we're going to send if we haven't constructed them already
 				if (line.empty())
@@ -196,14 +189,14 @@ class ModuleIRCv3 : public Module
 			if (!awaymsg.empty())
 				line += " :" + awaymsg;
 
-			WriteNeighboursWithExt(user, line, cap_awaynotify.ext);
+			WriteNeighboursWithCap(user, line, cap_awaynotify);
 		}
 		return MOD_RES_PASSTHRU;
 	}
 
 	void OnPostJoin(Membership *memb) CXX11_OVERRIDE
 	{
-		if ((!awaynotify) || (!memb->user->IsAway()))
+		if ((!awaynotify) || (!memb->user->IsAway()) || (!cap_awaynotify.IsEnabledByAny()))
 			return;
 
 		std::string line = ":" + memb->user->GetFullHost() + " AWAY :" + memb->user->awaymsg;
@@ -213,7 +206,7 @@ class ModuleIRCv3 : public Module
 		{
 			// Send the away notify line if the current member is local, has the away-notify cap and isn't excepted
 			User* member = IS_LOCAL(it->first);
-			if ((member) && (cap_awaynotify.ext.get(member)) && (last_excepts.find(member) == last_excepts.end()))
+			if ((member) && (cap_awaynotify.get(member)) && (last_excepts.find(member) == last_excepts.end()))
 			{
 				member->Write(line);
 			}
@@ -22,6 +22,7 @@
 
 
 #include "inspircd.h"
+#include "modules/flood.h"
 
 /** Holds settings and state associated with channel mode +j
  */
@@ -30,35 +31,25 @@ class joinfloodsettings
  public:
 	unsigned int secs;
 	unsigned int joins;
-	time_t reset;
 	time_t unlocktime;
-	unsigned int counter;
+	TokenBucket bucket;
 
 	joinfloodsettings(unsigned int b, unsigned int c)
-		: secs(b), joins(c), unlocktime(0), counter(0)
+		: secs(b), joins(c), unlocktime(0)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
-	void addjoin()
+	/** Count a join
+	 * @return True if the channel should be locked
+	 */
+	bool addjoin()
 	{
-		if (ServerInstance->Time() > reset)
-		{
-			counter = 1;
-			reset = ServerInstance->Time() + secs;
-		}
-		else
-			counter++;
-	}
-
-	bool shouldlock()
-	{
-		return (counter >= this->joins);
+		return bucket.Add(joins, secs);
 	}
 
 	void clear()
 	{
-		counter = 0;
+		bucket.Reset();
 	}
 
 	bool islocked()
@@ -154,8 +145,7 @@ class ModuleJoinFlood : public Module
 		/* But all others are OK */
 		if ((f) && (!f->islocked()))
 		{
-			f->addjoin();
-			if (f->shouldlock())
+			if (f->addjoin())
 			{
 				f->clear();
 				f->lock();
@@ -26,6 +26,7 @@
 
 #include "inspircd.h"
 #include "modules/ldap.h"
+#include "modules/authcache.h"
 
 namespace
 {
@@ -36,8 +37,24 @@ namespace
 	std::string vhost;
 	LocalStringExt* vhosts;
 	std::vector<std::pair<std::string, std::string> > requiredattributes;
+	AuthCache* cache;
 }
 
+/** Credentials being checked, passed along the queries so the verdict can be cached
+ */
+struct CacheKey
+{
+	std::string key;
+	unsigned int generation;
+
+	CacheKey(const std::string& k) : key(k), generation(cache->GetGeneration()) { }
+
+	void Add(bool allow, const std::string& DN = "") const
+	{
+		cache->Add(key, generation, allow, DN);
+	}
+};
+
 class BindInterface : public LDAPInterface
 {
 	const std::string provider;
@@ -46,6 +63,8 @@ class BindInterface : public LDAPInterface
 	bool checkingAttributes;
 	bool passed;
 	int attrCount;
+	const CacheKey key;
+	bool rejected;
 
 	static std::string SafeReplace(const std::string& text, std::map<std::string, std::string>& replacements)
 	{
@@ -74,6 +93,7 @@ class BindInterface : public LDAPInterface
 		return result;
 	}
 
+ public:
 	static void SetVHost(User* user, const std::string& DN)
 	{
 		if (!vhost.empty())
@@ -100,15 +120,17 @@ class BindInterface : public LDAPInterface
 		}
 	}
 
- public:
-	BindInterface(Module* c, const std::string& p, const std::string& u, const std::string& dn)
+	BindInterface(Module* c, const std::string& p, const std::string& u, const std::string& dn, const CacheKey& k)
 		: LDAPInterface(c)
-		, provider(p), uid(u), DN(dn), checkingAttributes(false), passed(false), attrCount(0)
+		, provider(p), uid(u), DN(dn), checkingAttributes(false), passed(false), attrCount(0), key(k), rejected(true)
 	{
 	}
 
 	void OnResult(const LDAPResult& r) CXX11_OVERRIDE
 	{
+		if (!checkingAttributes ? requiredattributes.empty() : !passed)
+			key.Add(true, DN);
+
 		User* user = ServerInstance->FindUUID(uid);
 		dynamic_reference<LDAPProvider> LDAP(me, provider);
 
@@ -182,6 +204,8 @@ class BindInterface : public LDAPInterface
 
 	void OnError(const LDAPResult& err) CXX11_OVERRIDE
 	{
+		// Only cache a refusal if every query was refused rather than failed
+		rejected = rejected && err.rejected;
 		if (checkingAttributes && --attrCount)
 			return;
 
@@ -191,6 +215,9 @@ class BindInterface : public LDAPInterface
 			return;
 		}
 
+		if (rejected)
+			key.Add(false);
+
 		User* user = ServerInstance->FindUUID(uid);
 		if (user)
 		{
@@ -207,15 +234,20 @@ class SearchInterface : public LDAPInterface
 {
 	const std::string provider;
 	const std::string uid;
+	const CacheKey key;
 
  public:
-	SearchInterface(Module* c, const std::string& p, const std::string& u)
-		: LDAPInterface(c), provider(p), uid(u)
+	SearchInterface(Module* c, const std::string& p, const std::string& u, const CacheKey& k)
+		: LDAPInterface(c), provider(p), uid(u), key(k)
 	{
 	}
 
 	void OnResult(const LDAPResult& r) CXX11_OVERRIDE
 	{
+		// No such account
+		if (r.empty())
+			key.Add(false);
+
 		LocalUser* user = static_cast<LocalUser*>(ServerInstance->FindUUID(uid));
 		dynamic_reference<LDAPProvider> LDAP(me, provider);
 		if (!LDAP || r.empty() || !user)
@@ -237,7 +269,7 @@ class SearchInterface : public LDAPInterface
 				return;
 			}
 
-			LDAP->Bind(new BindInterface(this->creator, provider, uid, bindDn), bindDn, user->password);
+			LDAP->Bind(new BindInterface(this->creator, provider, uid, bindDn, key), bindDn, user->password);
 		}
 		catch (LDAPException& ex)
 		{
@@ -262,10 +294,11 @@ class AdminBindInterface : public LDAPInterface
 	const std::string uuid;
 	const std::string base;
 	const std::string what;
+	const CacheKey key;
 
  public:
-	AdminBindInterface(Module* c, const std::string& p, const std::string& u, const std::string& b, const std::string& w)
-		: LDAPInterface(c), provider(p), uuid(u), base(b), what(w)
+	AdminBindInterface(Module* c, const std::string& p, const std::string& u, const std::string& b, const std::string& w, const CacheKey& k)
+		: LDAPInterface(c), provider(p), uuid(u), base(b), what(w), key(k)
 	{
 	}
 
@@ -276,7 +309,7 @@ class AdminBindInterface : public LDAPInterface
 		{
 			try
 			{
-				LDAP->Search(new SearchInterface(this->creator, provider, uuid), base, what);
+				LDAP->Search(new SearchInterface(this->creator, provider, uuid, key), base, what);
 			}
 			catch (LDAPException& ex)
 			{
@@ -298,6 +331,7 @@ class ModuleLDAPAuth : public Module
 	dynamic_reference<LDAPProvider> LDAP;
 	LocalIntExt ldapAuthed;
 	LocalStringExt ldapVhost;
+	AuthCache verdicts;
 	std::string base;
 	std::string attribute;
 	std::vector<std::string> allowpatterns;
@@ -313,6 +347,7 @@ public:
 		me = this;
 		authed = &ldapAuthed;
 		vhosts = &ldapVhost;
+		cache = &verdicts;
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -328,6 +363,7 @@ public:
 		// Set to true if failed connects should be reported to operators
 		verbose			= tag->getBool("verbose");
 		useusername		= tag->getBool("userfield");
+		verdicts.Configure(tag);
 
 		LDAP.SetProvider("LDAP/" + tag->getString("dbid"));
 
@@ -406,10 +442,32 @@ public:
 			return MOD_RES_DENY;
 		}
 
+		std::string what = attribute + "=" + (useusername ? user->ident : user->nick);
+
+		std::string tuple;
+		AuthCache::AddField(tuple, what);
+		AuthCache::AddField(tuple, user->password);
+		const CacheKey key(verdicts.MakeKey(tuple));
+
+		const AuthCache::Entry* verdict = verdicts.Find(key.key);
+		if (verdict)
+		{
+			if (verdict->allow)
+			{
+				BindInterface::SetVHost(user, verdict->data);
+				ldapAuthed.set(user, 1);
+				return MOD_RES_PASSTHRU;
+			}
+
+			if (verbose)
+				ServerInstance->SNO->WriteToSnoMask('c', "Forbidden connection from %s (Invalid credentials, cached)", user->GetFullRealHost().c_str());
+			ServerInstance->Users->QuitUser(user, killreason);
+			return MOD_RES_DENY;
+		}
+
 		try
 		{
-			std::string what = attribute + "=" + (useusername ? user->ident : user->nick);
-			LDAP->BindAsManager(new AdminBindInterface(this, LDAP.GetProvider(), user->uuid, base, what));
+			LDAP->BindAsManager(new AdminBindInterface(this, LDAP.GetProvider(), user->uuid, base, what, key));
 		}
 		catch (LDAPException &ex)
 		{
@@ -201,6 +201,11 @@ class ModuleLDAPAuth : public Module
 		attribute = tag->getString("attribute");
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "OPER");
+	}
+
 	ModResult OnPreCommand(std::string& command, std::vector<std::string>& parameters, LocalUser* user, bool validated, const std::string& original_line) CXX11_OVERRIDE
 	{
 		if (validated && command == "OPER" && parameters.size() >= 2)
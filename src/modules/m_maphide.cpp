@@ -28,6 +28,12 @@ class ModuleMapHide : public Module
 		url = ServerInstance->Config->ConfValue("security")->getString("maphide");
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "MAP");
+		ServerInstance->Parser->SubscribePreCommand(this, "LINKS");
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line) CXX11_OVERRIDE
 	{
 		if (validated && !user->IsOper() && !url.empty() && (command == "MAP" || command == "LINKS"))
@@ -24,8 +24,9 @@
 
 
 #include "inspircd.h"
+#include "modules/flood.h"
 
-/** Holds flood settings and state for mode +f
+/** Holds flood settings for mode +f, the state is kept per membership
  */
 class floodsettings
 {
@@ -33,32 +34,9 @@ class floodsettings
 	bool ban;
 	unsigned int secs;
 	unsigned int lines;
-	time_t reset;
-	std::map<User*, unsigned int> counters;
 
 	floodsettings(bool a, int b, int c) : ban(a), secs(b), lines(c)
 	{
-		reset = ServerInstance->Time() + secs;
-	}
-
-	bool addmessage(User* who)
-	{
-		if (ServerInstance->Time() > reset)
-		{
-			counters.clear();
-			reset = ServerInstance->Time() + secs;
-		}
-
-		return (++counters[who] >= this->lines);
-	}
-
-	void clear(User* who)
-	{
-		std::map<User*, unsigned int>::iterator iter = counters.find(who);
-		if (iter != counters.end())
-		{
-			counters.erase(iter);
-		}
 	}
 };
 
@@ -67,11 +45,24 @@ class floodsettings
 class MsgFlood : public ParamMode<MsgFlood, SimpleExtItem<floodsettings> >
 {
  public:
+	/** Message rate of each member of a channel with +f, created when they first speak
+	 */
+	SimpleExtItem<TokenBucket> bucketext;
+
 	MsgFlood(Module* Creator)
 		: ParamMode<MsgFlood, SimpleExtItem<floodsettings> >(Creator, "flood", 'f')
+		, bucketext("flood_bucket", Creator)
 	{
 	}
 
+	void OnUnset(User* source, Channel* chan)
+	{
+		// Unset the per-membership extension when the mode is removed
+		const UserMembList* users = chan->GetUsers();
+		for (UserMembCIter i = users->begin(); i != users->end(); ++i)
+			bucketext.unset(i->second);
+	}
+
 	ModeAction OnSet(User* source, Channel* channel, std::string& parameter)
 	{
 		std::string::size_type colon = parameter.find(':');
@@ -116,6 +107,11 @@ class ModuleMsgFlood : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL, &mf));
+	}
+
 	ModResult OnUserPreMessage(User* user, void* voiddest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype) CXX11_OVERRIDE
 	{
 		if (target_type != TYPE_CHANNEL)
@@ -129,12 +125,20 @@ class ModuleMsgFlood : public Module
 			return MOD_RES_PASSTHRU;
 
 		floodsettings *f = mf.ext.get(dest);
-		if (f)
+		Membership* memb = dest->GetUser(user);
+		if ((f) && (memb))
 		{
-			if (f->addmessage(user))
+			TokenBucket* bucket = mf.bucketext.get(memb);
+			if (!bucket)
+			{
+				bucket = new TokenBucket;
+				mf.bucketext.set(memb, bucket);
+			}
+
+			if (bucket->Add(f->lines, f->secs))
 			{
 				/* Youre outttta here! */
-				f->clear(user);
+				bucket->Reset();
 				if (f->ban)
 				{
 					std::vector<std::string> parameters;
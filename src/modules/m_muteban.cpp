@@ -23,6 +23,11 @@
 class ModuleQuietBan : public Module
 {
  public:
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL));
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Implements extban +b m: - mute bans",VF_OPTCOMMON|VF_VENDOR);
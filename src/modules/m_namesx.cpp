@@ -41,6 +41,11 @@ class ModuleNamesX : public Module
 		tokens["NAMESX"];
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "PROTOCTL");
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line) CXX11_OVERRIDE
 	{
 		/* We don't actually create a proper command handler class for PROTOCTL,
@@ -52,7 +57,7 @@ class ModuleNamesX : public Module
 		{
 			if ((parameters.size()) && (!strcasecmp(parameters[0].c_str(),"NAMESX")))
 			{
-				cap.ext.set(user, 1);
+				cap.set(user);
 				return MOD_RES_DENY;
 			}
 		}
@@ -61,7 +66,7 @@ class ModuleNamesX : public Module
 
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
-		if (!cap.ext.get(issuer))
+		if (!cap.get(issuer))
 			return;
 
 		/* Some module hid this from being displayed, dont bother */
@@ -71,9 +76,16 @@ class ModuleNamesX : public Module
 		prefixes = memb->GetAllPrefixChars();
 	}
 
+	ModResult OnNamesListCache(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE
+	{
+		if (cap.get(issuer))
+			variant.push_back('x');
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnSendWhoLine(User* source, const std::vector<std::string>& params, User* user, Membership* memb, std::string& line) CXX11_OVERRIDE
 	{
-		if ((!memb) || (!cap.ext.get(source)))
+		if ((!memb) || (!cap.get(source)))
 			return;
 
 		// Channel names can contain ":", and ":" as a 'start-of-token' delimiter is
@@ -98,11 +110,6 @@ class ModuleNamesX : public Module
 		line.erase(pos, 1);
 		line.insert(pos, prefixes);
 	}
-
-	void OnEvent(Event& ev) CXX11_OVERRIDE
-	{
-		cap.HandleEvent(ev);
-	}
 };
 
 MODULE_INIT(ModuleNamesX)
@@ -19,6 +19,7 @@
 
 
 #include "inspircd.h"
+#include "modules/flood.h"
 
 /** Holds settings and state associated with channel mode +F
  */
@@ -27,39 +28,30 @@ class nickfloodsettings
  public:
 	unsigned int secs;
 	unsigned int nicks;
-	time_t reset;
 	time_t unlocktime;
-	unsigned int counter;
+	TokenBucket bucket;
 
 	nickfloodsettings(unsigned int b, unsigned int c)
-		: secs(b), nicks(c), unlocktime(0), counter(0)
+		: secs(b), nicks(c), unlocktime(0)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
 	void addnick()
 	{
-		if (ServerInstance->Time() > reset)
-		{
-			counter = 1;
-			reset = ServerInstance->Time() + secs;
-		}
-		else
-			counter++;
+		bucket.Add(nicks, secs);
 	}
 
 	bool shouldlock()
 	{
-		/* XXX HACK: using counter + 1 here now to allow the counter to only be incremented
-		 * on successful nick changes; this will be checked before the counter is
-		 * incremented.
+		/* This is checked before the nick change and the token is only taken
+		 * on successful nick changes, so lock once there is no token left.
 		 */
-		return ((ServerInstance->Time() <= reset) && (counter == this->nicks));
+		return bucket.IsEmpty(nicks, secs);
 	}
 
 	void clear()
 	{
-		counter = 0;
+		bucket.Reset();
 	}
 
 	bool islocked()
@@ -37,6 +37,11 @@ class ModuleNoCTCP : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL));
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides channel mode +C to block CTCPs", VF_VENDOR);
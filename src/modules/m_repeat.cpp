@@ -18,6 +18,7 @@
 
 
 #include "inspircd.h"
+#include "editdistance.h"
 
 class ChannelSettings
 {
@@ -64,7 +65,8 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 	{
 		time_t ts;
 		std::string line;
-		RepeatItem(time_t TS, const std::string& Line) : ts(TS), line(Line) { }
+		CharHistogram histogram;
+		RepeatItem(time_t TS, const std::string& Line, const CharHistogram& Histogram) : ts(TS), line(Line), histogram(Histogram) { }
 	};
 
 	typedef std::deque<RepeatItem> RepeatItemList;
@@ -83,38 +85,31 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		unsigned int MaxBacklog;
 		unsigned int MaxDiff;
 		unsigned int MaxMessageSize;
-		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff() { }
+		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff(), MaxMessageSize(0) { }
 	};
 
-	std::vector<unsigned int> mx[2];
+	EditDistance distance;
 	ModuleSettings ms;
 
-	bool CompareLines(const std::string& message, const std::string& historyline, unsigned int trigger)
-	{
-		if (message == historyline)
-			return true;
-		else if (trigger)
-			return (Levenshtein(message, historyline) <= trigger);
+	/** Lowercased copy of the message being matched, kept to reuse its buffer
+	 */
+	std::string message;
 
-		return false;
-	}
-
-	unsigned int Levenshtein(const std::string& s1, const std::string& s2)
+	/** Compare the message to a line from the backlog, the message must already be the pattern of distance
+	 */
+	bool CompareLines(const CharHistogram& histogram, const RepeatItem& item, unsigned int trigger)
 	{
-		unsigned int l1 = s1.size();
-		unsigned int l2 = s2.size();
+		if (message == item.line)
+			return true;
+		else if (!trigger)
+			return false;
 
-		for (unsigned int i = 0; i < l2; i++)
-			mx[0][i] = i;
-		for (unsigned int i = 0; i < l1; i++)
-		{
-			mx[1][0] = i + 1;
-			for (unsigned int j = 0; j < l2; j++)
-	            mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+		// Rule out lines which can't be close enough before computing the distance
+		const unsigned int lengthdiff = (message.size() > item.line.size() ? message.size() - item.line.size() : item.line.size() - message.size());
+		if ((lengthdiff > trigger) || (histogram.MinDistance(item.histogram) > trigger))
+			return false;
 
-			mx[0].swap(mx[1]);
-		}
-		return mx[0][l2];
+		return (distance.Get(item.line, trigger) <= trigger);
 	}
 
  public:
@@ -158,12 +153,11 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		return MODEACTION_ALLOW;
 	}
 
-	bool MatchLine(Membership* memb, ChannelSettings* rs, std::string message)
+	bool MatchLine(Membership* memb, ChannelSettings* rs, const std::string& text)
 	{
 		// If the message is larger than whatever size it's set to,
 		// let's pretend it isn't. If the first 512 (def. setting) match, it's probably spam.
-		if (message.size() > ms.MaxMessageSize)
-			message.erase(ms.MaxMessageSize);
+		message.assign(text, 0, ms.MaxMessageSize);
 
 		MemberInfo* rp = MemberInfoExt.get(memb);
 		if (!rp)
@@ -181,6 +175,9 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		const time_t now = ServerInstance->Time();
 
 		std::transform(message.begin(), message.end(), message.begin(), ::tolower);
+		const CharHistogram histogram(message);
+		if (trigger)
+			distance.SetPattern(message);
 
 		for (std::deque<RepeatItem>::iterator it = items.begin(); it != items.end(); ++it)
 		{
@@ -191,7 +188,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 				break;
 			}
 
-			if (CompareLines(message, it->line, trigger))
+			if (CompareLines(histogram, *it, trigger))
 			{
 				if (++matches >= rs->Lines)
 				{
@@ -212,19 +209,17 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (items.size() >= max_items)
 			items.pop_back();
 
-		items.push_front(RepeatItem(now + rs->Seconds, message));
+		items.push_front(RepeatItem(now + rs->Seconds, message, histogram));
 		rp->Counter = matches;
 		return false;
 	}
 
 	void Resize(size_t size)
 	{
-		size_t newsize = size+1;
-		if (newsize <= mx[0].size())
+		if (size <= ms.MaxMessageSize)
 			return;
 		ms.MaxMessageSize = size;
-		mx[0].resize(newsize);
-		mx[1].resize(newsize);
+		distance.Resize(size);
 	}
 
 	void ReadConfig()
@@ -344,6 +339,11 @@ class RepeatModule : public Module
  public:
 	RepeatModule() : rm(this) {}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_CHANNEL, &rm));
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		rm.ReadConfig();
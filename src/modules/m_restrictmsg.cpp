@@ -24,6 +24,11 @@
 class ModuleRestrictMsg : public Module
 {
  public:
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(I_OnUserPreMessage, this, HookFilter(TYPE_USER));
+	}
+
 	ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype) CXX11_OVERRIDE
 	{
 		if ((target_type == TYPE_USER) && (IS_LOCAL(user)))
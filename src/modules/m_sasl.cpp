@@ -187,7 +187,7 @@ class CommandAuthenticate : public Command
 		/* Only allow AUTHENTICATE on unregistered clients */
 		if (user->registered != REG_ALL)
 		{
-			if (!cap.ext.get(user))
+			if (!cap.get(user))
 				return CMD_FAILURE;
 
 			SaslAuthenticator *sasl = authExt.get(user);
@@ -280,11 +280,6 @@ class ModuleSASL : public Module
 	{
 		return Version("Provides support for IRC Authentication Layer (aka: atheme SASL) via AUTHENTICATE.",VF_VENDOR);
 	}
-
-	void OnEvent(Event &ev) CXX11_OVERRIDE
-	{
-		cap.HandleEvent(ev);
-	}
 };
 
 MODULE_INIT(ModuleSASL)
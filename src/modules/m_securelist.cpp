@@ -43,6 +43,10 @@ class ModuleSecureList : public Module
 		WaitTime = ServerInstance->Config->ConfValue("securelist")->getInt("waittime", 60);
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "LIST");
+	}
 
 	/*
 	 * OnPreCommand()
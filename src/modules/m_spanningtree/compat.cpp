@@ -182,6 +182,20 @@ void TreeSocket::WriteLine(const std::string& original_line)
 	this->WriteData(newline);
 }
 
+void TreeSocket::WriteLine(const reference<SharedBuffer>& line)
+{
+	const std::string& data = line->data;
+	if ((LinkState == CONNECTED) && ((data[0] != ':') || (proto_version != ProtocolVersion)))
+	{
+		// The line may have to be prefixed or translated for this server
+		WriteLine(data.substr(0, data.length() - 1));
+		return;
+	}
+
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %.*s", this->GetFd(), static_cast<int>(data.length() - 1), data.c_str());
+	this->WriteData(line);
+}
+
 namespace
 {
 	bool InsertCurrentChannelTS(std::vector<std::string>& params)
@@ -67,6 +67,11 @@ void ModuleSpanningTree::init()
 {
 	ServerInstance->SNO->EnableSnomask('l', "LINK");
 
+	// Only these commands are handled in OnPreCommand()
+	const char* precommands[] = { "CONNECT", "SQUIT", "LINKS", "WHOIS", "VERSION", NULL };
+	for (const char** cmd = precommands; *cmd; ++cmd)
+		ServerInstance->Parser->SubscribePreCommand(this, *cmd);
+
 	Utils = new SpanningTreeUtilities(this);
 	Utils->TreeRoot = new TreeServer;
 	commands = new SpanningTreeCommands(this);
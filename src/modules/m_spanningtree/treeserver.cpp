@@ -146,14 +146,16 @@ int TreeServer::QuitUsers(const std::string &reason)
 
 	const user_hash& users = ServerInstance->Users->GetUsers();
 	unsigned int original_size = users.size();
-	for (user_hash::const_iterator i = users.begin(); i != users.end(); )
+
+	// Quit all users in one batch so the channels they share are only scanned once
+	std::vector<User*> quitting;
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
 	{
 		User* user = i->second;
-		// Increment the iterator now because QuitUser() removes the user from the container
-		++i;
 		if (user->server == this)
-			ServerInstance->Users->QuitUser(user, publicreason, &reason);
+			quitting.push_back(user);
 	}
+	ServerInstance->Users->QuitUsers(quitting, publicreason, &reason);
 	return original_size - users.size();
 }
 
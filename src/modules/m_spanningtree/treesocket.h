@@ -248,6 +248,13 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line which is also being sent to other servers down the socket.
+	 * The buffer is queued without copying it unless the line has to be translated
+	 * for an older protocol version.
+	 * @param line The line, terminated by a newline
+	 */
+	void WriteLine(const reference<SharedBuffer>& line);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -187,7 +187,8 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
-	const std::string& FullLine = params.str();
+	// The line is built once and the sendq of every route references it
+	reference<SharedBuffer> line;
 
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
@@ -196,7 +197,9 @@ void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeSe
 		// Send the line if the route isn't the path to the one to be omitted
 		if (Route != omitroute)
 		{
-			Route->GetSocket()->WriteLine(FullLine);
+			if (!line)
+				line = new SharedBuffer(params.str() + '\n');
+			Route->GetSocket()->WriteLine(line);
 		}
 	}
 }
@@ -382,10 +385,15 @@ void SpanningTreeUtilities::SendChannelMessage(const std::string& prefix, Channe
 
 	TreeSocketSet list;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
+	reference<SharedBuffer> line;
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
-		if (Sock != omit)
-			Sock->WriteLine(msg);
+		if (Sock == omit)
+			continue;
+
+		if (!line)
+			line = new SharedBuffer(msg.str() + '\n');
+		Sock->WriteLine(line);
 	}
 }
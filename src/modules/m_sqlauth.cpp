@@ -21,6 +21,7 @@
 #include "modules/sql.h"
 #include "modules/hash.h"
 #include "modules/ssl.h"
+#include "modules/authcache.h"
 
 enum AuthState {
 	AUTH_STATE_NONE = 0,
@@ -34,13 +35,18 @@ class AuthQuery : public SQLQuery
 	const std::string uid;
 	LocalIntExt& pendingExt;
 	bool verbose;
-	AuthQuery(Module* me, const std::string& u, LocalIntExt& e, bool v)
-		: SQLQuery(me), uid(u), pendingExt(e), verbose(v)
+	AuthCache& cache;
+	const std::string key;
+	const unsigned int generation;
+	AuthQuery(Module* me, const std::string& u, LocalIntExt& e, bool v, AuthCache& c, const std::string& k)
+		: SQLQuery(me), uid(u), pendingExt(e), verbose(v), cache(c), key(k), generation(c.GetGeneration())
 	{
 	}
 
 	void OnResult(SQLResult& res) CXX11_OVERRIDE
 	{
+		cache.Add(key, generation, res.Rows() != 0);
+
 		User* user = ServerInstance->FindNick(uid);
 		if (!user)
 			return;
@@ -71,12 +77,17 @@ class ModuleSQLAuth : public Module
 {
 	LocalIntExt pendingExt;
 	dynamic_reference<SQLProvider> SQL;
+	AuthCache cache;
 
 	std::string freeformquery;
 	std::string killreason;
 	std::string allowpattern;
 	bool verbose;
 
+	/** Names of the fields used by the query, the cache key is built from their values
+	 */
+	std::vector<std::string> keyfields;
+
  public:
 	ModuleSQLAuth() : pendingExt("sqlauth-wait", this), SQL(this, "SQL")
 	{
@@ -94,6 +105,16 @@ class ModuleSQLAuth : public Module
 		killreason = conf->getString("killreason");
 		allowpattern = conf->getString("allowpattern");
 		verbose = conf->getBool("verbose");
+		cache.Configure(conf);
+
+		keyfields.clear();
+		for (std::string::size_type i = freeformquery.find('$'); i != std::string::npos; i = freeformquery.find('$', i))
+		{
+			std::string field;
+			while (++i < freeformquery.length() && isalnum(freeformquery[i]))
+				field.push_back(freeformquery[i]);
+			keyfields.push_back(field);
+		}
 	}
 
 	ModResult OnUserRegister(LocalUser* user) CXX11_OVERRIDE
@@ -133,7 +154,29 @@ class ModuleSQLAuth : public Module
 		const std::string certfp = SSLClientCert::GetFingerprint(&user->eh);
 		userinfo["certfp"] = certfp;
 
-		SQL->submit(new AuthQuery(this, user->uuid, pendingExt, verbose), freeformquery, userinfo);
+		// The verdict only depends on the values the query uses
+		std::string tuple;
+		for (std::vector<std::string>::const_iterator i = keyfields.begin(); i != keyfields.end(); ++i)
+			AuthCache::AddField(tuple, userinfo[*i]);
+
+		const std::string key = cache.MakeKey(tuple);
+		const AuthCache::Entry* verdict = cache.Find(key);
+		if (verdict)
+		{
+			if (verdict->allow)
+			{
+				pendingExt.set(user, AUTH_STATE_NONE);
+			}
+			else
+			{
+				if (verbose)
+					ServerInstance->SNO->WriteGlobalSno('a', "Forbidden connection from %s (SQL query returned no matches, cached)", user->GetFullRealHost().c_str());
+				pendingExt.set(user, AUTH_STATE_FAIL);
+			}
+			return MOD_RES_PASSTHRU;
+		}
+
+		SQL->submit(new AuthQuery(this, user->uuid, pendingExt, verbose, cache, key), freeformquery, userinfo);
 
 		return MOD_RES_PASSTHRU;
 	}
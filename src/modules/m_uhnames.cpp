@@ -41,6 +41,11 @@ class ModuleUHNames : public Module
 		tokens["UHNAMES"];
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Parser->SubscribePreCommand(this, "PROTOCTL");
+	}
+
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line) CXX11_OVERRIDE
 	{
 		/* We don't actually create a proper command handler class for PROTOCTL,
@@ -52,7 +57,7 @@ class ModuleUHNames : public Module
 		{
 			if ((parameters.size()) && (!strcasecmp(parameters[0].c_str(),"UHNAMES")))
 			{
-				cap.ext.set(user, 1);
+				cap.set(user);
 				return MOD_RES_DENY;
 			}
 		}
@@ -61,7 +66,7 @@ class ModuleUHNames : public Module
 
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
-		if (!cap.ext.get(issuer))
+		if (!cap.get(issuer))
 			return;
 
 		if (nick.empty())
@@ -70,9 +75,11 @@ class ModuleUHNames : public Module
 		nick = memb->user->GetFullHost();
 	}
 
-	void OnEvent(Event& ev) CXX11_OVERRIDE
+	ModResult OnNamesListCache(User* issuer, Channel* chan, std::string& variant) CXX11_OVERRIDE
 	{
-		cap.HandleEvent(ev);
+		if (cap.get(issuer))
+			variant.push_back('h');
+		return MOD_RES_PASSTHRU;
 	}
 };
 
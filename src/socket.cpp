@@ -91,6 +91,9 @@ int InspIRCd::BindPorts(FailedPortList &failed_ports)
 		if (strncasecmp(Addr.c_str(), "::ffff:", 7) == 0)
 			this->Logs->Log("SOCKET", LOG_DEFAULT, "Using 4in6 (::ffff:) isn't recommended. You should bind IPv4 addresses directly instead.");
 
+		// With more than one listener per port the OS spreads connections across them using SO_REUSEPORT
+		unsigned int listeners = tag->getInt("listeners", 1, 1, 64);
+
 		irc::portparser portrange(porttag, false);
 		int portno = -1;
 		while (0 != (portno = portrange.GetToken()))
@@ -100,32 +103,55 @@ int InspIRCd::BindPorts(FailedPortList &failed_ports)
 				continue;
 			std::string bind_readable = bindspec.str();
 
-			bool skip = false;
-			for (std::vector<ListenSocket*>::iterator n = old_ports.begin(); n != old_ports.end(); ++n)
+			// A port can only be shared if every socket on it has SO_REUSEPORT, so sockets which
+			// were opened with the wrong setting for the new number of listeners are reopened
+			const bool reuseport = (listeners > 1);
+			for (std::vector<ListenSocket*>::iterator n = old_ports.begin(); n != old_ports.end(); )
 			{
-				if ((**n).bind_desc == bind_readable)
+				ListenSocket* const ls = *n;
+				if ((ls->bind_desc != bind_readable) || (ls->reuseport == reuseport))
 				{
-					(*n)->bind_tag = tag; // Replace tag, we know addr and port match, but other info (type, ssl) may not
-					(*n)->ResetIOHookProvider();
-
-					skip = true;
-					old_ports.erase(n);
-					break;
+					++n;
+					continue;
 				}
+
+				this->Logs->Log("SOCKET", LOG_DEFAULT, "Port binding %s changed its number of listeners, reopening.",
+					bind_readable.c_str());
+				ports.erase(std::find(ports.begin(), ports.end(), ls));
+				delete ls;
+				n = old_ports.erase(n);
 			}
-			if (!skip)
-			{
-				ListenSocket* ll = new ListenSocket(tag, bindspec);
 
-				if (ll->GetFd() > -1)
+			for (unsigned int listener = 0; listener < listeners; ++listener)
+			{
+				bool skip = false;
+				for (std::vector<ListenSocket*>::iterator n = old_ports.begin(); n != old_ports.end(); ++n)
 				{
-					bound++;
-					ports.push_back(ll);
+					if ((**n).bind_desc == bind_readable)
+					{
+						(*n)->bind_tag = tag; // Replace tag, we know addr and port match, but other info (type, ssl) may not
+						(*n)->ResetIOHookProvider();
+
+						skip = true;
+						old_ports.erase(n);
+						break;
+					}
 				}
-				else
+				if (!skip)
 				{
-					failed_ports.push_back(std::make_pair(bind_readable, strerror(errno)));
-					delete ll;
+					ListenSocket* ll = new ListenSocket(tag, bindspec, reuseport);
+
+					if (ll->GetFd() > -1)
+					{
+						bound++;
+						ports.push_back(ll);
+					}
+					else
+					{
+						failed_ports.push_back(std::make_pair(bind_readable, strerror(errno)));
+						delete ll;
+						break;
+					}
 				}
 			}
 		}
@@ -34,7 +34,7 @@ size_t SocketEngine::CurrentSetSize = 0;
 
 /** List of handlers that want a trial read/write
  */
-std::set<int> SocketEngine::trials;
+intrusive_list_tail<EventHandler> SocketEngine::trials;
 
 int SocketEngine::MAX_DESCRIPTORS;
 
@@ -48,6 +48,13 @@ EventHandler::EventHandler()
 	event_mask = 0;
 }
 
+EventHandler::~EventHandler()
+{
+	// DelFd() normally takes the handler off the list, but nothing must point to it once it is gone
+	if (event_mask & FD_TRIAL_NOTE_MASK)
+		SocketEngine::trials.erase(this);
+}
+
 void EventHandler::SetFd(int FD)
 {
 	this->fd = FD;
@@ -64,9 +71,16 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	if (change & FD_WANT_WRITE_MASK)
 		new_m &= ~FD_WANT_WRITE_MASK;
 
-	// if adding a trial read/write, insert it into the set
-	if (change & FD_TRIAL_NOTE_MASK && !(old_m & FD_TRIAL_NOTE_MASK))
-		trials.insert(eh->GetFd());
+	// if adding a trial read/write, append it to the list
+	if (change & FD_TRIAL_NOTE_MASK)
+	{
+		// Handlers which aren't in the socket engine (anymore) can't be tried, and they
+		// must not be on the list as nothing would take them off it before they are deleted
+		if (GetRef(eh->GetFd()) != eh)
+			change &= ~FD_TRIAL_NOTE_MASK;
+		else if (!(old_m & FD_TRIAL_NOTE_MASK))
+			trials.push_back(eh);
+	}
 
 	new_m |= change;
 	if (new_m == old_m)
@@ -78,16 +92,12 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 
 void SocketEngine::DispatchTrialWrites()
 {
-	std::vector<int> working_list;
-	working_list.reserve(trials.size());
-	working_list.assign(trials.begin(), trials.end());
-	trials.clear();
-	for(unsigned int i=0; i < working_list.size(); i++)
+	// Handlers asking for another trial while being tried are appended to the
+	// list, only try the ones which were already waiting
+	for (size_t pending = trials.size(); (pending) && (!trials.empty()); pending--)
 	{
-		int fd = working_list[i];
-		EventHandler* eh = GetRef(fd);
-		if (!eh)
-			continue;
+		EventHandler* eh = trials.front();
+		trials.pop_front();
 		int mask = eh->event_mask;
 		eh->event_mask &= ~(FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
 		if ((mask & (FD_ADD_TRIAL_READ | FD_READ_WILL_BLOCK)) == FD_ADD_TRIAL_READ)
@@ -112,6 +122,12 @@ bool SocketEngine::AddFdRef(EventHandler* eh)
 
 void SocketEngine::DelFdRef(EventHandler *eh)
 {
+	if (eh->event_mask & FD_TRIAL_NOTE_MASK)
+	{
+		trials.erase(eh);
+		eh->event_mask &= ~FD_TRIAL_NOTE_MASK;
+	}
+
 	int fd = eh->GetFd();
 	if (GetRef(fd) == eh)
 	{
@@ -144,7 +160,16 @@ bool SocketEngine::BoundsCheckFd(EventHandler* eh)
 
 int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
 {
-	return accept(fd->GetFd(), addr, addrlen);
+#if defined SOCK_NONBLOCK && defined SOCK_CLOEXEC
+	// Set the flags in the same call where we can, this saves two syscalls per connection
+	int newfd = accept4(fd->GetFd(), addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if ((newfd >= 0) || (errno != ENOSYS))
+		return newfd;
+#endif
+	int ret = accept(fd->GetFd(), addr, addrlen);
+	if (ret >= 0)
+		NonBlocking(ret);
+	return ret;
 }
 
 int SocketEngine::Close(EventHandler* eh)
@@ -192,6 +217,17 @@ void SocketEngine::SetReuse(int fd)
 	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on));
 }
 
+bool SocketEngine::SetReusePort(int fd)
+{
+#ifdef SO_REUSEPORT
+	int on = 1;
+	return (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&on, sizeof(on)) == 0);
+#else
+	errno = ENOPROTOOPT;
+	return false;
+#endif
+}
+
 int SocketEngine::RecvFrom(EventHandler* fd, void *buf, size_t len, int flags, sockaddr *from, socklen_t *fromlen)
 {
 	int nbRecvd = recvfrom(fd->GetFd(), (char*)buf, len, flags, from, fromlen);
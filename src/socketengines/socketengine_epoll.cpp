@@ -173,9 +173,9 @@ void SocketEngine::DelFd(EventHandler* eh)
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(int timeout)
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), timeout);
 	ServerInstance->UpdateTime();
 
 	stats.TotalEvents += i;
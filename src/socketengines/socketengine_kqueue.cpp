@@ -169,11 +169,11 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 	}
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(int timeout)
 {
 	struct timespec ts;
-	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+	ts.tv_sec = timeout / 1000;
 
 	int i = kevent(EngineHandle, &changelist.front(), ChangePos, &ke_list.front(), ke_list.size(), &ts);
 	ChangePos = 0;
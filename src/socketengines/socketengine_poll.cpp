@@ -168,9 +168,9 @@ void SocketEngine::DelFd(EventHandler* eh)
 			"(Filled gap with: %d (index: %d))", fd, index, last_fd, last_index);
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(int timeout)
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, timeout);
 	int processed = 0;
 	ServerInstance->UpdateTime();
 
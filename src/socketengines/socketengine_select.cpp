@@ -109,11 +109,11 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 	}
 }
 
-int SocketEngine::DispatchEvents()
+int SocketEngine::DispatchEvents(int timeout)
 {
 	timeval tval;
-	tval.tv_sec = 1;
-	tval.tv_usec = 0;
+	tval.tv_sec = timeout / 1000;
+	tval.tv_usec = (timeout % 1000) * 1000;
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
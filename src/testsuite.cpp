@@ -24,6 +24,7 @@
 #include "inspircd.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "editdistance.h"
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -64,6 +65,11 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Trial write benchmark\n";
+		std::cout << "(A) QUIT fan-out benchmark\n";
+		std::cout << "(B) Edit distance benchmark\n";
+		std::cout << "(C) Batched quit tests\n";
+		std::cout << "(D) Cull list tests\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -111,6 +117,21 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoTrialWriteBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoQuitFanOutBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoEditDistanceBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'C':
+				std::cout << (DoBatchedQuitTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'D':
+				std::cout << (DoCullListTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -395,6 +416,540 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+class TestSuiteTrialHandler : public EventHandler
+{
+ public:
+	unsigned int writes;
+
+	TestSuiteTrialHandler(int newfd) : writes(0)
+	{
+		SetFd(newfd);
+	}
+
+	void HandleEvent(EventType et, int errornum)
+	{
+		if (et == EVENT_WRITE)
+			writes++;
+	}
+};
+
+bool TestSuite::DoTrialWriteBenchmark()
+{
+	const unsigned int ROUNDS = 100;
+	std::vector<TestSuiteTrialHandler*> handlers;
+	const size_t count = std::min<size_t>(10000, SocketEngine::GetMaxFds() / 2);
+
+	std::cout << "\n\nTrial write benchmark\n\n";
+	while (handlers.size() + 2 <= count)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+			break;
+
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			TestSuiteTrialHandler* eh = new TestSuiteTrialHandler(fds[i]);
+			SocketEngine::NonBlocking(fds[i]);
+			if (!SocketEngine::AddFd(eh, FD_WANT_NO_READ | FD_WANT_NO_WRITE))
+			{
+				SocketEngine::Close(eh);
+				delete eh;
+				continue;
+			}
+			handlers.push_back(eh);
+		}
+	}
+	std::cout << "Using " << handlers.size() << " handlers, " << ROUNDS << " rounds\n";
+
+	// What the socket engine did before: an ordered set of fds, copied to a vector and looked up again on dispatch
+	unsigned long start = HookTimer::Now();
+	for (unsigned int round = 0; round < ROUNDS; round++)
+	{
+		std::set<int> trials;
+		for (std::vector<TestSuiteTrialHandler*>::const_iterator i = handlers.begin(); i != handlers.end(); ++i)
+			trials.insert((*i)->GetFd());
+
+		std::vector<int> working_list;
+		working_list.reserve(trials.size());
+		working_list.assign(trials.begin(), trials.end());
+		trials.clear();
+		for (std::vector<int>::const_iterator i = working_list.begin(); i != working_list.end(); ++i)
+		{
+			EventHandler* eh = SocketEngine::GetRef(*i);
+			if (eh)
+				eh->HandleEvent(EVENT_WRITE, 0);
+		}
+	}
+	const unsigned long settime = HookTimer::Now() - start;
+
+	start = HookTimer::Now();
+	for (unsigned int round = 0; round < ROUNDS; round++)
+	{
+		for (std::vector<TestSuiteTrialHandler*>::const_iterator i = handlers.begin(); i != handlers.end(); ++i)
+			SocketEngine::ChangeEventMask(*i, FD_ADD_TRIAL_WRITE);
+		SocketEngine::DispatchTrialWrites();
+	}
+	const unsigned long listtime = HookTimer::Now() - start;
+
+	std::cout << "std::set<int> of fds: " << settime << " us\n";
+	std::cout << "intrusive list:       " << listtime << " us (including ChangeEventMask())\n";
+
+	bool passed = !handlers.empty();
+	for (std::vector<TestSuiteTrialHandler*>::const_iterator i = handlers.begin(); i != handlers.end(); ++i)
+	{
+		TestSuiteTrialHandler* eh = *i;
+		if (eh->writes != ROUNDS * 2)
+		{
+			std::cout << "TRIALWRITE: Handler " << eh->GetFd() << " got " << eh->writes << " write events instead of " << ROUNDS * 2 << std::endl;
+			passed = false;
+		}
+		SocketEngine::DelFd(eh);
+		SocketEngine::Close(eh);
+		delete eh;
+	}
+
+	return passed;
+}
+
+class TestSuiteNeighborCounter : public ForEachNeighborHandler
+{
+ public:
+	unsigned long count;
+
+	TestSuiteNeighborCounter() : count(0) { }
+
+	void Execute(const std::vector<LocalUser*>& users) CXX11_OVERRIDE
+	{
+		count += users.size();
+	}
+};
+
+bool TestSuite::DoQuitFanOutBenchmark()
+{
+	const unsigned int USERS = 2000;
+	const unsigned int CHANNELS = 200;
+	const unsigned int CHANS_PER_USER = 5;
+	const unsigned int ROUNDS = 10;
+	const unsigned int REPEATS = 10;
+
+	std::cout << "\n\nQUIT fan-out benchmark\n\n";
+
+	irc::sockets::sockaddrs sa;
+	irc::sockets::aptosa("127.0.0.1", 0, sa);
+
+	std::vector<Channel*> chans;
+	for (unsigned int i = 0; i < CHANNELS; i++)
+	{
+		const std::string name = "#testsuite-fanout-" + ConvToStr(i);
+		Channel* chan = ServerInstance->FindChan(name);
+		chans.push_back(chan ? chan : new Channel(name, ServerInstance->Time()));
+	}
+
+	std::vector<LocalUser*> users;
+	for (unsigned int i = 0; i < USERS; i++)
+	{
+		LocalUser* user = new LocalUser(-1, &sa, &sa);
+		ServerInstance->Users->local_users.push_front(user);
+		for (unsigned int j = 0; j < CHANS_PER_USER; j++)
+		{
+			Channel* chan = chans[(i * 7 + j * 31) % CHANNELS];
+			Membership* memb = chan->AddUser(user);
+			if (memb)
+				user->chans.push_front(memb);
+		}
+		users.push_back(user);
+	}
+	std::cout << USERS << " local users in " << CHANNELS << " channels, " << CHANS_PER_USER << " channels each, " << ROUNDS << " rounds\n";
+
+	// Run both loops a few times, alternating between them, and keep the fastest time of each
+	// so neither is penalized by running first or by other load on the machine
+	unsigned long maptime = ULONG_MAX;
+	unsigned long listtime = ULONG_MAX;
+	unsigned long buildtime = ULONG_MAX;
+	unsigned long unhookedtime = ULONG_MAX;
+	unsigned long oldcount = 0;
+	TestSuiteNeighborCounter counter;
+	for (unsigned int rep = 0; rep < REPEATS; rep++)
+	{
+		// What WriteCommonQuit() did before NeighborList: copy the channel list and build a map of exceptions for every user
+		oldcount = 0;
+		unsigned long start = HookTimer::Now();
+		for (unsigned int round = 0; round < ROUNDS; round++)
+		{
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			{
+				User* const source = *i;
+				already_sent_t uniq_id = ++LocalUser::already_sent_id;
+				IncludeChanList include_c(source->chans.begin(), source->chans.end());
+				std::map<User*, bool> exceptions;
+				exceptions[source] = false;
+
+				for (std::map<User*, bool>::iterator j = exceptions.begin(); j != exceptions.end(); ++j)
+				{
+					LocalUser* u = IS_LOCAL(j->first);
+					if (u && !u->quitting)
+					{
+						u->already_sent = uniq_id;
+						if (j->second)
+							oldcount++;
+					}
+				}
+				for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
+				{
+					const UserMembList* ulist = (*v)->chan->GetUsers();
+					for (UserMembCIter j = ulist->begin(); j != ulist->end(); ++j)
+					{
+						LocalUser* u = IS_LOCAL(j->first);
+						if (u && (u->already_sent != uniq_id))
+						{
+							u->already_sent = uniq_id;
+							oldcount++;
+						}
+					}
+				}
+			}
+		}
+		maptime = std::min(maptime, HookTimer::Now() - start);
+
+		counter.count = 0;
+		start = HookTimer::Now();
+		for (unsigned int round = 0; round < ROUNDS; round++)
+		{
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+				(*i)->ForEachNeighbor(counter, false);
+		}
+		listtime = std::min(listtime, HookTimer::Now() - start);
+
+		// The old loop above can't call the hook as its signature has changed, so also walk
+		// without any OnBuildNeighborList handlers to compare the same work
+		IntModuleList& handlers = ServerInstance->Modules->EventHandlers[I_OnBuildNeighborList];
+		IntModuleList hooked;
+		hooked.swap(handlers);
+		counter.count = 0;
+		start = HookTimer::Now();
+		for (unsigned int round = 0; round < ROUNDS; round++)
+		{
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+				(*i)->ForEachNeighbor(counter, false);
+		}
+		unhookedtime = std::min(unhookedtime, HookTimer::Now() - start);
+		hooked.swap(handlers);
+
+		start = HookTimer::Now();
+		for (unsigned int round = 0; round < ROUNDS; round++)
+		{
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+				NeighborList neighbors(*i, false);
+		}
+		buildtime = std::min(buildtime, HookTimer::Now() - start);
+	}
+
+	std::cout << "Fastest of " << REPEATS << " runs:\n";
+	std::cout << "Copied channel list and std::map:   " << maptime << " us, " << oldcount << " neighbors (without OnBuildNeighborList)\n";
+	std::cout << "NeighborList:                       " << unhookedtime << " us, " << counter.count << " neighbors (without OnBuildNeighborList)\n";
+	std::cout << "NeighborList with the loaded hooks: " << listtime << " us\n";
+	std::cout << "  of which building the lists:      " << buildtime << " us\n";
+
+	bool passed = (oldcount == counter.count);
+	if (!passed)
+		std::cout << "QUITFANOUT: Neighbor counts differ\n";
+
+	// A walk started while another list is built, like a module writing from OnBuildNeighborList,
+	// must not change what the other list visits
+	for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		TestSuiteNeighborCounter plain;
+		TestSuiteNeighborCounter nesting;
+		(*i)->ForEachNeighbor(plain, false);
+		{
+			NeighborList outer(*i, false);
+			TestSuiteNeighborCounter inner;
+			(*i)->ForEachNeighbor(inner, false);
+			outer.ForEach(nesting);
+		}
+		if (plain.count != nesting.count)
+		{
+			std::cout << "QUITFANOUT: Nested walk changed the neighbors of " << (*i)->uuid << " from " << plain.count << " to " << nesting.count << std::endl;
+			passed = false;
+			break;
+		}
+	}
+
+	for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		LocalUser* const user = *i;
+		while (!user->chans.empty())
+		{
+			Membership* memb = *user->chans.begin();
+			user->chans.erase(memb);
+			memb->chan->DelUser(user);
+		}
+
+		user->quitting = true;
+		user->client_sa.sa.sa_family = AF_UNSPEC;
+		ServerInstance->Users->uuidlist.erase(user->uuid);
+		user->cull();
+		delete user;
+	}
+	ServerInstance->GlobalCulls.Apply();
+
+	return passed;
+}
+
+static LocalUser* TestSuiteCreateUser(irc::sockets::sockaddrs& sa)
+{
+	LocalUser* user = new LocalUser(-1, &sa, &sa);
+	user->nick = user->uuid;
+	user->registered = REG_ALL;
+	ServerInstance->Users->clientlist[user->nick] = user;
+	ServerInstance->Users->local_users.push_front(user);
+	return user;
+}
+
+static void TestSuiteJoin(LocalUser* user, Channel* chan)
+{
+	Membership* memb = chan->AddUser(user);
+	if (memb)
+		user->chans.push_front(memb);
+}
+
+bool TestSuite::DoBatchedQuitTests()
+{
+	const unsigned int DEPARTING = 20;
+
+	std::cout << "\n\nBatched quit tests\n\n";
+
+	irc::sockets::sockaddrs sa;
+	irc::sockets::aptosa("127.0.0.1", 0, sa);
+
+	// #testsuite-batch-shared has observers who stay, #testsuite-batch-gone only has users who quit
+	Channel* shared = new Channel("#testsuite-batch-shared", ServerInstance->Time());
+	Channel* gone = new Channel("#testsuite-batch-gone", ServerInstance->Time());
+
+	std::vector<LocalUser*> observers;
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		observers.push_back(TestSuiteCreateUser(sa));
+		TestSuiteJoin(observers.back(), shared);
+	}
+
+	std::vector<User*> departing;
+	for (unsigned int i = 0; i < DEPARTING; i++)
+	{
+		LocalUser* user = TestSuiteCreateUser(sa);
+		TestSuiteJoin(user, shared);
+		TestSuiteJoin(user, gone);
+		departing.push_back(user);
+	}
+
+	bool passed = true;
+
+	// A cached channel must see a local user who joins after it was cached
+	LocalMemberCache cache;
+	const size_t before = cache.GetLocalMembers(shared).size();
+	LocalUser* late = TestSuiteCreateUser(sa);
+	TestSuiteJoin(late, shared);
+	observers.push_back(late);
+	const LocalMemberCache::LocalMemberList& members = cache.GetLocalMembers(shared);
+	if ((members.size() != before + 1) || (std::find(members.begin(), members.end(), late) == members.end()))
+	{
+		std::cout << "BATCHEDQUIT: Cache did not see a user joining after it was built\n";
+		passed = false;
+	}
+
+	ServerInstance->Users->QuitUsers(departing, "Batched quit test");
+
+	for (std::vector<User*>::const_iterator i = departing.begin(); i != departing.end(); ++i)
+	{
+		User* const user = *i;
+		if ((!user->quitting) || (shared->HasUser(user)) || (ServerInstance->FindUUID(user->uuid)) || (ServerInstance->FindNickOnly(user->nick)))
+		{
+			std::cout << "BATCHEDQUIT: " << user->uuid << " was not fully removed\n";
+			passed = false;
+			break;
+		}
+	}
+
+	if (ServerInstance->FindChan("#testsuite-batch-gone"))
+	{
+		std::cout << "BATCHEDQUIT: Channel of departed users was not destroyed\n";
+		passed = false;
+	}
+
+	if ((ServerInstance->FindChan("#testsuite-batch-shared") != shared) || (static_cast<size_t>(shared->GetUserCounter()) != observers.size()))
+	{
+		std::cout << "BATCHEDQUIT: Channel with observers lost the wrong members\n";
+		passed = false;
+	}
+
+	for (std::vector<LocalUser*>::const_iterator i = observers.begin(); i != observers.end(); ++i)
+	{
+		LocalUser* const user = *i;
+		if (user->chans.size() != 1)
+		{
+			std::cout << "BATCHEDQUIT: Observer " << user->uuid << " is on " << user->chans.size() << " channels\n";
+			passed = false;
+		}
+		ServerInstance->Users->QuitUser(user, "Batched quit test");
+	}
+
+	if (ServerInstance->FindChan("#testsuite-batch-shared"))
+	{
+		std::cout << "BATCHEDQUIT: Channel was not destroyed after everyone quit\n";
+		passed = false;
+	}
+
+	// None of these users were added to the clone counts
+	for (std::vector<User*>::const_iterator i = departing.begin(); i != departing.end(); ++i)
+		(*i)->client_sa.sa.sa_family = AF_UNSPEC;
+	for (std::vector<LocalUser*>::const_iterator i = observers.begin(); i != observers.end(); ++i)
+		(*i)->client_sa.sa.sa_family = AF_UNSPEC;
+	ServerInstance->GlobalCulls.Apply();
+
+	return passed;
+}
+
+/** Queues itself for culling again from cull(), like User::cull() does through QuitUser() */
+class TestSuiteCullable : public classbase
+{
+ public:
+	static unsigned int culls;
+	static unsigned int deletes;
+	bool requeue;
+
+	TestSuiteCullable(bool again) : requeue(again) { }
+	~TestSuiteCullable() { deletes++; }
+
+	CullResult cull() CXX11_OVERRIDE
+	{
+		culls++;
+		if (requeue)
+			ServerInstance->GlobalCulls.AddItem(this);
+		return classbase::cull();
+	}
+};
+
+unsigned int TestSuiteCullable::culls = 0;
+unsigned int TestSuiteCullable::deletes = 0;
+
+bool TestSuite::DoCullListTests()
+{
+	std::cout << "\n\nCull list tests\n\n";
+
+	bool passed = true;
+
+	// Queued again from its own cull(), the requeued copy is in the next batch of the same pass
+	TestSuiteCullable::culls = TestSuiteCullable::deletes = 0;
+	ServerInstance->GlobalCulls.AddItem(new TestSuiteCullable(true));
+	ServerInstance->GlobalCulls.Apply();
+	std::cout << "Requeued from cull(): " << TestSuiteCullable::culls << " culls, " << TestSuiteCullable::deletes << " deletes\n";
+	if ((TestSuiteCullable::culls != 1) || (TestSuiteCullable::deletes != 1))
+		passed = false;
+
+	// Queued twice in the same batch
+	TestSuiteCullable::culls = TestSuiteCullable::deletes = 0;
+	TestSuiteCullable* twice = new TestSuiteCullable(false);
+	ServerInstance->GlobalCulls.AddItem(new TestSuiteCullable(false));
+	ServerInstance->GlobalCulls.AddItem(twice);
+	ServerInstance->GlobalCulls.AddItem(new TestSuiteCullable(false));
+	ServerInstance->GlobalCulls.AddItem(twice);
+	ServerInstance->GlobalCulls.Apply();
+	std::cout << "Queued twice: " << TestSuiteCullable::culls << " culls, " << TestSuiteCullable::deletes << " deletes\n";
+	if ((TestSuiteCullable::culls != 3) || (TestSuiteCullable::deletes != 3))
+		passed = false;
+
+	return passed;
+}
+
+/** The edit distance as m_repeat computed it before EditDistance, one matrix cell at a time */
+static unsigned int TestSuiteLevenshtein(const std::string& s1, const std::string& s2, std::vector<unsigned int> (&mx)[2])
+{
+	const size_t l1 = s1.size();
+	const size_t l2 = s2.size();
+	mx[0].resize(l2 + 1);
+	mx[1].resize(l2 + 1);
+
+	for (size_t j = 0; j <= l2; j++)
+		mx[0][j] = j;
+	for (size_t i = 0; i < l1; i++)
+	{
+		mx[1][0] = i + 1;
+		for (size_t j = 0; j < l2; j++)
+			mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+		mx[0].swap(mx[1]);
+	}
+	return mx[0][l2];
+}
+
+bool TestSuite::DoEditDistanceBenchmark()
+{
+	const unsigned int PAIRS = 1000;
+	const size_t lengths[] = { 20, 120, 512 };
+
+	std::cout << "\n\nEdit distance benchmark\n\n";
+
+	// A fixed seed so every run compares the same lines
+	unsigned long seed = 12345;
+	bool passed = true;
+	EditDistance distance;
+	std::vector<unsigned int> mx[2];
+	for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+	{
+		const size_t len = lengths[l];
+		std::vector<std::string> patterns;
+		std::vector<std::string> texts;
+		for (unsigned int i = 0; i < PAIRS; i++)
+		{
+			std::string pattern;
+			for (size_t j = 0; j < len; j++)
+			{
+				seed = seed * 1103515245 + 12345;
+				pattern.push_back("abcdefghijklmnopqrstuvwxyz "[(seed >> 16) % 27]);
+			}
+
+			// Half of the lines are the pattern with a few changes, like repeated messages, the rest are unrelated
+			std::string text = pattern;
+			for (size_t j = 0; j < text.length(); j++)
+			{
+				seed = seed * 1103515245 + 12345;
+				if ((i % 2) || ((seed >> 16) % 10 == 0))
+					text[j] = "abcdefghijklmnopqrstuvwxyz "[(seed >> 8) % 27];
+			}
+			patterns.push_back(pattern);
+			texts.push_back(text);
+		}
+
+		std::vector<unsigned int> expected(PAIRS);
+		unsigned long start = HookTimer::Now();
+		for (unsigned int i = 0; i < PAIRS; i++)
+			expected[i] = TestSuiteLevenshtein(patterns[i], texts[i], mx);
+		const unsigned long dptime = HookTimer::Now() - start;
+
+		std::vector<unsigned int> result(PAIRS);
+		distance.Resize(len);
+		start = HookTimer::Now();
+		for (unsigned int i = 0; i < PAIRS; i++)
+		{
+			distance.SetPattern(patterns[i]);
+			result[i] = distance.Get(texts[i], len * 2);
+		}
+		const unsigned long bittime = HookTimer::Now() - start;
+
+		std::cout << "Length " << len << ": matrix " << dptime << " us, bit-parallel " << bittime << " us for " << PAIRS << " pairs\n";
+		for (unsigned int i = 0; i < PAIRS; i++)
+		{
+			if (result[i] != expected[i])
+			{
+				std::cout << "EDITDISTANCE: Got " << result[i] << " instead of " << expected[i] << " for a pair of length " << len << std::endl;
+				passed = false;
+				break;
+			}
+		}
+	}
+
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
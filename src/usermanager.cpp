@@ -152,6 +152,23 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 }
 
 void UserManager::QuitUser(User* user, const std::string& quitreason, const std::string* operreason)
+{
+	DoQuitUser(user, quitreason, operreason, NULL);
+}
+
+void UserManager::QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason)
+{
+	LocalMemberCache cache;
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		User* user = *i;
+		// A hook may have quit some users in the list already
+		if (!user->quitting)
+			DoQuitUser(user, quitreason, operreason, &cache);
+	}
+}
+
+void UserManager::DoQuitUser(User* user, const std::string& quitreason, const std::string* operreason, LocalMemberCache* cache)
 {
 	if (user->quitting)
 	{
@@ -180,7 +197,7 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	if (user->registered == REG_ALL)
 	{
 		FOREACH_MOD(OnUserQuit, (user, reason, *operreason));
-		user->WriteCommonQuit(reason, *operreason);
+		user->WriteCommonQuit(reason, *operreason, cache);
 	}
 	else
 		unregistered_count--;
@@ -86,7 +86,7 @@ User::User(const std::string& uid, Server* srv, int type)
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
-	already_sent(0)
+	already_sent(0), caps(0)
 {
 	exempt = quitting_sendq = false;
 	idle_lastmsg = 0;
@@ -335,10 +335,63 @@ CullResult LocalUser::cull()
 {
 	ServerInstance->Users->local_users.erase(this);
 	ClearInvites();
+	for (unsigned int bit = 0; caps; bit++)
+		SetCap(bit, false);
 	eh.cull();
 	return User::cull();
 }
 
+/** Capability bits which are in use
+ */
+static uint64_t usedcapbits = 0;
+
+/** Number of local users who have each capability bit on
+ */
+static unsigned int capusers[LocalUser::MaxCaps];
+
+unsigned int LocalUser::AllocateCapBit()
+{
+	for (unsigned int bit = 0; bit < MaxCaps; bit++)
+	{
+		const uint64_t mask = static_cast<uint64_t>(1) << bit;
+		if (!(usedcapbits & mask))
+		{
+			usedcapbits |= mask;
+			return bit;
+		}
+	}
+	return MaxCaps;
+}
+
+void LocalUser::ReleaseCapBit(unsigned int bit)
+{
+	if (GetCapUserCount(bit))
+	{
+		const LocalUserList& list = ServerInstance->Users->local_users;
+		for (LocalUserList::const_iterator i = list.begin(); i != list.end(); ++i)
+			(*i)->SetCap(bit, false);
+	}
+	usedcapbits &= ~(static_cast<uint64_t>(1) << bit);
+}
+
+unsigned int LocalUser::GetCapUserCount(unsigned int bit)
+{
+	return capusers[bit];
+}
+
+void LocalUser::SetCap(unsigned int bit, bool enable)
+{
+	const uint64_t mask = static_cast<uint64_t>(1) << bit;
+	if (enable == ((caps & mask) != 0))
+		return;
+
+	caps ^= mask;
+	if (enable)
+		capusers[bit]++;
+	else
+		capusers[bit]--;
+}
+
 CullResult FakeUser::cull()
 {
 	// Fake users don't quit, they just get culled.
@@ -571,16 +624,14 @@ void LocalUser::FullConnect()
 		ServerInstance->Users->unregistered_count--;
 
 	/* Trigger MOTD and LUSERS output, give modules a chance too */
-	ModResult MOD_RESULT;
 	std::string command("LUSERS");
 	std::vector<std::string> parameters;
-	FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, parameters, this, true, command));
+	ModResult MOD_RESULT = ServerInstance->Parser->CallPreCommand(command, parameters, this, true, command);
 	if (!MOD_RESULT)
 		ServerInstance->Parser->CallHandler(command, parameters, this);
 
-	MOD_RESULT = MOD_RES_PASSTHRU;
 	command = "MOTD";
-	FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, parameters, this, true, command));
+	MOD_RESULT = ServerInstance->Parser->CallPreCommand(command, parameters, this, true, command);
 	if (!MOD_RESULT)
 		ServerInstance->Parser->CallHandler(command, parameters, this);
 
@@ -612,6 +663,10 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+
+	// The nick and host are shown in NAMES
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->chan->InvalidateNames(*i);
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force, time_t newts)
@@ -842,6 +897,20 @@ void LocalUser::Write(const std::string& text)
 	this->cmds_out++;
 }
 
+void LocalUser::WriteBatch(const std::string& lines, unsigned int count)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh) || lines.empty())
+		return;
+
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O (%u lines) %s", uuid.c_str(), count, lines.c_str());
+
+	eh.AddWriteBuf(lines);
+
+	ServerInstance->stats->statsSent += lines.length();
+	this->bytes_out += lines.length();
+	this->cmds_out += count;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -919,84 +988,250 @@ void User::WriteCommon(const char* text, ...)
 	this->WriteCommonRaw(textbuffer, true);
 }
 
-void User::WriteCommonRaw(const std::string &line, bool include_self)
+namespace
 {
-	if (this->registered != REG_ALL || quitting)
-		return;
+	/** Pool of NeighborList storage. More than one list is in use only when a
+	 * neighbor walk is started from a module hook or handler.
+	 */
+	class NeighborScratchPool
+	{
+		std::vector<NeighborList::Scratch*> free;
 
-	LocalUser::already_sent_id++;
+	 public:
+		~NeighborScratchPool()
+		{
+			stdalgo::delete_all(free);
+		}
 
-	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+		NeighborList::Scratch* Get()
+		{
+			if (free.empty())
+				return new NeighborList::Scratch;
 
-	exceptions[this] = include_self;
+			NeighborList::Scratch* scratch = free.back();
+			free.pop_back();
+			return scratch;
+		}
 
-	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
+		void Put(NeighborList::Scratch* scratch)
+		{
+			scratch->chans.clear();
+			scratch->included.clear();
+			scratch->saved.clear();
+			scratch->neighbors.clear();
+			free.push_back(scratch);
+		}
+	};
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	NeighborScratchPool neighborpool;
+
+	class WriteCommonRawHandler : public ForEachNeighborHandler
 	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
+		const std::string& line;
+
+		void Execute(const std::vector<LocalUser*>& users) CXX11_OVERRIDE
 		{
-			u->already_sent = LocalUser::already_sent_id;
-			if (i->second)
-				u->Write(line);
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+				(*i)->Write(line);
 		}
-	}
-	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
+
+	 public:
+		WriteCommonRawHandler(const std::string& writeme)
+			: line(writeme)
+		{
+		}
+	};
+
+	class WriteCommonQuitHandler : public ForEachNeighborHandler
 	{
-		Channel* c = (*v)->chan;
-		const UserMembList* ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const std::string normalMessage;
+		const std::string operMessage;
+
+		void Execute(const std::vector<LocalUser*>& users) CXX11_OVERRIDE
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && u->already_sent != LocalUser::already_sent_id)
+			for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
 			{
-				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				LocalUser* const user = *i;
+				user->Write(user->IsOper() ? operMessage : normalMessage);
 			}
 		}
-	}
+
+	 public:
+		WriteCommonQuitHandler(User* user, const std::string& normal_text, const std::string& oper_text)
+			: normalMessage(":" + user->GetFullHost() + " QUIT :" + normal_text)
+			, operMessage(":" + user->GetFullHost() + " QUIT :" + oper_text)
+		{
+		}
+	};
 }
 
-void User::WriteCommonQuit(const std::string &normal_text, const std::string &oper_text)
+unsigned int NeighborList::active = 0;
+
+NeighborList::NeighborList(User* source, bool include_self)
+	: scratch(neighborpool.Get())
+	, seen_id(++LocalUser::already_sent_id)
+	, silent_id(++LocalUser::already_sent_id)
+	, nested(active++ > 0)
+	, chans(scratch->chans)
 {
-	if (this->registered != REG_ALL)
+	chans.assign(source->chans.begin(), source->chans.end());
+
+	if (include_self)
+		Include(source);
+	else
+		Exclude(source);
+
+	FOREACH_MOD(OnBuildNeighborList, (source, *this));
+}
+
+NeighborList::~NeighborList()
+{
+	// Give the users back the marks of the list this one was nested in, in reverse
+	// order so a user marked more than once ends up with the oldest value
+	for (size_t i = scratch->saved.size(); i > 0; i--)
+		scratch->saved[i - 1].first->already_sent = scratch->saved[i - 1].second;
+
+	active--;
+	neighborpool.Put(scratch);
+}
+
+void NeighborList::Include(User* user)
+{
+	LocalUser* const localuser = IS_LOCAL(user);
+	if ((!localuser) || (localuser->already_sent == seen_id))
+		return;
+
+	Mark(localuser, seen_id);
+	scratch->included.push_back(localuser);
+}
+
+void NeighborList::Exclude(User* user)
+{
+	LocalUser* const localuser = IS_LOCAL(user);
+	if (!localuser)
 		return;
 
-	already_sent_t uniq_id = ++LocalUser::already_sent_id;
+	// Exclusions are rare and the included list is short, a linear search is fine
+	if (localuser->already_sent == seen_id)
+		stdalgo::vector::swaperase(scratch->included, localuser);
+	Mark(localuser, silent_id);
+}
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+bool NeighborList::IsExcepted(User* user) const
+{
+	LocalUser* const localuser = IS_LOCAL(user);
+	if (!localuser)
+		return false;
+	return ((localuser->already_sent == seen_id) || (localuser->already_sent == silent_id));
+}
 
-	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+namespace
+{
+	typedef std::vector<std::pair<LocalUser*, already_sent_t> > SavedMarks;
 
-	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
+	/** Add a user to the neighbors unless they were visited, included or excluded already
+	 * @param saved If not NULL, the old already_sent value of the user is saved here before it is changed
+	 */
+	inline void AddNeighbor(LocalUser* user, already_sent_t seen, SavedMarks* saved, std::vector<LocalUser*>& neighbors)
+	{
+		// silent_id is always seen_id + 1 (also when the counter wraps), so this is true for both
+		const already_sent_t mark = user->already_sent;
+		if (static_cast<already_sent_t>(mark - seen) <= 1)
+			return;
+
+		if (saved)
+			saved->push_back(std::make_pair(user, mark));
+		user->already_sent = seen;
+		neighbors.push_back(user);
+	}
+}
+
+void NeighborList::ForEach(ForEachNeighborHandler& handler, LocalMemberCache* cache)
+{
+	// Collect every neighbor first and call the handler once, not once per neighbor
+	std::vector<LocalUser*>& neighbors = scratch->neighbors;
+	neighbors.clear();
+	for (std::vector<LocalUser*>::const_iterator i = scratch->included.begin(); i != scratch->included.end(); ++i)
+	{
+		LocalUser* const user = *i;
+		if (!user->quitting)
+			neighbors.push_back(user);
+	}
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	// Local copies, as far as the compiler knows writing already_sent could change the members
+	// and they would be loaded again for every channel member
+	const already_sent_t seen = seen_id;
+	SavedMarks* const saved = (nested ? &scratch->saved : NULL);
+	for (IncludeChanList::const_iterator i = chans.begin(); i != chans.end(); ++i)
 	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
+		if (cache)
 		{
-			u->already_sent = uniq_id;
-			if (i->second)
-				u->Write(u->IsOper() ? operMessage : normalMessage);
+			const LocalMemberCache::LocalMemberList& members = cache->GetLocalMembers((*i)->chan);
+			for (LocalMemberCache::LocalMemberList::const_iterator j = members.begin(); j != members.end(); ++j)
+				AddNeighbor(*j, seen, saved, neighbors);
+			continue;
+		}
+
+		const UserMembList* ulist = (*i)->chan->GetUsers();
+		for (UserMembCIter j = ulist->begin(); j != ulist->end(); ++j)
+		{
+			LocalUser* const user = IS_LOCAL(j->first);
+			if (user)
+				AddNeighbor(user, seen, saved, neighbors);
 		}
 	}
-	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
+
+	if (!neighbors.empty())
+		handler.Execute(neighbors);
+}
+
+unsigned long LocalMemberCache::changes = 0;
+
+const LocalMemberCache::LocalMemberList& LocalMemberCache::GetLocalMembers(Channel* chan)
+{
+	if (cachedchanges != changes)
 	{
-		const UserMembList* ulist = (*v)->chan->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		chans.clear();
+		cachedchanges = changes;
+	}
+
+	std::pair<ChanMap::iterator, bool> ret = chans.insert(std::make_pair(chan, LocalMemberList()));
+	LocalMemberList& members = ret.first->second;
+	if (ret.second)
+	{
+		const UserMembList* ulist = chan->GetUsers();
+		for (UserMembCIter i = ulist->begin(); i != ulist->end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && (u->already_sent != uniq_id))
-			{
-				u->already_sent = uniq_id;
-				u->Write(u->IsOper() ? operMessage : normalMessage);
-			}
+			LocalUser* const user = IS_LOCAL(i->first);
+			if (user)
+				members.push_back(user);
 		}
 	}
+	return members;
+}
+
+void User::ForEachNeighbor(ForEachNeighborHandler& handler, bool include_self, LocalMemberCache* cache)
+{
+	NeighborList neighbors(this, include_self);
+	neighbors.ForEach(handler, cache);
+}
+
+void User::WriteCommonRaw(const std::string &line, bool include_self)
+{
+	if (this->registered != REG_ALL || quitting)
+		return;
+
+	WriteCommonRawHandler handler(line);
+	ForEachNeighbor(handler, include_self);
+}
+
+void User::WriteCommonQuit(const std::string &normal_text, const std::string &oper_text, LocalMemberCache* cache)
+{
+	if (this->registered != REG_ALL)
+		return;
+
+	WriteCommonQuitHandler handler(this, normal_text, oper_text);
+	ForEachNeighbor(handler, false, cache);
 }
 
 void LocalUser::SendText(const std::string& line)